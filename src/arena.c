@@ -0,0 +1,165 @@
+/* arena.c - Memory that is allocated piecemeal and freed all at once.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "hash.h"
+
+#define ARENA_BLOCK_SIZE 16384
+#define ARENA_ALIGNMENT sizeof(size_t)
+
+struct arena_block_s {
+    struct arena_block_s *next;
+    size_t size, used;
+    size_t data[1];     /* aligned for anything the arena holds */
+};
+
+/* size bytes, aligned for size_t and pointers; NULL if out of memory */
+void *arena_alloc(arena_t *arena, size_t size) {
+    arena_block_t *block = arena->blocks;
+    size_t block_size;
+    void *p;
+
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    if(!block || block->size - block->used < size) {
+        block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        if( !(block = (arena_block_t *)malloc(offsetof(arena_block_t, data) + block_size)) ) {
+            return NULL;
+        }
+        block->size = block_size;
+        block->used = 0;
+
+        /* a block made for one big allocation does not replace the one being filled */
+        if(arena->blocks && size > ARENA_BLOCK_SIZE) {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        } else {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+    p = (char *)block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+/*
+ * Make room for size bytes in place of array, of which used are kept.
+ * The old space is only given back with the arena, so arrays should
+ * grow by doubling.
+ */
+void *arena_grow(arena_t *arena, void *array, size_t used, size_t size) {
+    void *p;
+
+    if( (p = arena_alloc(arena, size)) && used ) {
+        memcpy(p, array, used);
+    }
+    return p;
+}
+
+static const char **find_string(const char **strings, size_t slots,
+                                const char *s, size_t length, unsigned long hash)
+{
+    size_t i = hash & (slots - 1);
+
+    for(;;) {
+        if(!strings[i] ||
+           (ARENA_STRING_LENGTH(strings[i]) == length && !memcmp(strings[i], s, length)))
+        {
+            return &strings[i];
+        }
+        i = (i + 1) & (slots - 1);
+    }
+}
+
+static int grow_strings(arena_t *arena) {
+    const char **strings, *s;
+    size_t i, slots = arena->string_slots ? 2 * arena->string_slots : 64;
+
+    if( !(strings = (const char **)calloc(slots, sizeof(const char *))) ) {
+        return 0;
+    }
+    for(i = 0; i < arena->string_slots; i++) {
+        if( (s = arena->strings[i]) ) {
+            *find_string(strings, slots, s, ARENA_STRING_LENGTH(s),
+                         hash_string(s, ARENA_STRING_LENGTH(s))) = s;
+        }
+    }
+    free(arena->strings);
+    arena->strings = strings;
+    arena->string_slots = slots;
+    return 1;
+}
+
+/*
+ * The copy in arena of the first length bytes of s, made the first time
+ * it is asked for. Equal strings of one arena are the same pointer.
+ */
+const char *arena_intern(arena_t *arena, const char *s, size_t length) {
+    const char **slot;
+    size_t *header;
+    unsigned long hash = hash_string(s, length);
+
+    if(4 * (arena->string_count + 1) > 3 * arena->string_slots && !grow_strings(arena)) {
+        return NULL;
+    }
+    slot = find_string(arena->strings, arena->string_slots, s, length, hash);
+    if(*slot) {
+        return *slot;
+    }
+    if( !(header = (size_t *)arena_alloc(arena, sizeof(size_t) + length + 1)) ) {
+        return NULL;
+    }
+    *header = length;
+    memcpy(header + 1, s, length);
+    ((char *)(header + 1))[length] = '\0';
+    arena->string_count++;
+    return (*slot = (const char *)(header + 1));
+}
+
+const char *arena_string(arena_t *arena, const char *s) {
+    return arena_intern(arena, s, strlen(s));
+}
+
+void arena_free(arena_t *arena) {
+    arena_block_t *block, *next;
+
+    for(block = arena->blocks; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    free(arena->strings);
+    memset(arena, 0, sizeof(arena_t));
+}
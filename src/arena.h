@@ -0,0 +1,70 @@
+/* arena.h - Memory that is allocated piecemeal and freed all at once.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct arena_block_s arena_block_t;
+
+/*
+ * Everything allocated from an arena is freed with it. Strings interned
+ * in an arena are stored once each, with their length in front of them.
+ * A zeroed arena_t is an empty arena.
+ */
+typedef struct arena_s {
+    arena_block_t *blocks;
+    const char **strings;       /* the interned strings, open addressing */
+    size_t string_slots;        /* always a power of two, or 0 */
+    size_t string_count;
+} arena_t;
+
+/* length of a string returned by arena_intern() */
+#define ARENA_STRING_LENGTH(s) (((const size_t *)(const void *)(s))[-1])
+
+void *arena_alloc(arena_t *arena, size_t size);
+void *arena_grow(arena_t *arena, void *array, size_t used, size_t size);
+const char *arena_intern(arena_t *arena, const char *s, size_t length);
+const char *arena_string(arena_t *arena, const char *s);
+void arena_free(arena_t *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef ARENA_H */
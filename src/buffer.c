@@ -0,0 +1,162 @@
+/* buffer.c - Growable buffers, and whole files in memory.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#ifdef HAVE_UNISTD_H
+    #include <unistd.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+    #include <sys/stat.h>
+#endif
+#ifdef HAVE_LIMITS_H
+    #include <limits.h>
+#endif
+#include "buffer.h"
+
+/* returns 0 if out of memory */
+int buffer_append(buffer_t *buffer, const void *data, size_t length) {
+    size_t allocated;
+    char *p;
+
+    if(buffer->mapped) {
+        errno = EINVAL;
+        return 0;
+    }
+    if(buffer->allocated - buffer->length < length) {
+        allocated = buffer->allocated ? buffer->allocated : 4096;
+        while(allocated - buffer->length < length) {
+            allocated *= 2;
+        }
+        if( !(p = (char *)realloc(buffer->data, allocated)) ) {
+            return 0;
+        }
+        buffer->data = p;
+        buffer->allocated = allocated;
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return 1;
+}
+
+/*
+ * Make buffer the contents of the file at path, without reading it. A
+ * file replaced by rename() later stays as it was in the buffer.
+ */
+int buffer_map_file(buffer_t *buffer, const char *path) {
+    struct stat st;
+    void *p;
+    int fd;
+
+    memset(buffer, 0, sizeof(buffer_t));
+    if( (fd = open(path, O_RDONLY)) < 0 ) {
+        return 0;
+    }
+    if(0 != fstat(fd, &st)) {
+        close(fd);
+        return 0;
+    }
+    if(st.st_size > 0) {
+        if(MAP_FAILED == (p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))) {
+            close(fd);
+            return 0;
+        }
+        buffer->data = (char *)p;
+        buffer->length = st.st_size;
+        buffer->mapped = 1;
+    }
+    close(fd);
+    return 1;
+}
+
+/*
+ * Save buffer as path. It is written next to it and renamed over it, so
+ * path is always either the old file or the whole new one.
+ */
+int buffer_write_file(const buffer_t *buffer, const char *path, mode_t mode) {
+    char temp_path[PATH_MAX];
+    size_t done = 0;
+    ssize_t n;
+    int fd, saved_errno;
+
+    if(snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path) >= (int)sizeof(temp_path)) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    if( (fd = mkstemp(temp_path)) < 0 ) {
+        return 0;
+    }
+    while(done < buffer->length) {
+        if( (n = write(fd, buffer->data + done, buffer->length - done)) < 0 ) {
+            if(EINTR == errno) {
+                continue;
+            }
+            goto error;
+        }
+        done += n;
+    }
+    if(0 != fchmod(fd, mode) || 0 != fsync(fd)) {
+        goto error;
+    }
+    if(0 != close(fd)) {
+        fd = -1;
+        goto error;
+    }
+    fd = -1;
+    if(0 != rename(temp_path, path)) {
+        goto error;
+    }
+    return 1;
+ error:
+    saved_errno = errno;
+    if(fd >= 0) {
+        close(fd);
+    }
+    unlink(temp_path);
+    errno = saved_errno;
+    return 0;
+}
+
+void buffer_free(buffer_t *buffer) {
+    if(buffer->mapped) {
+        munmap(buffer->data, buffer->length);
+    } else {
+        free(buffer->data);
+    }
+    memset(buffer, 0, sizeof(buffer_t));
+}
@@ -0,0 +1,300 @@
+/* config_cache.c - Host configs compiled to a binary file.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Parsing the YAML config files and merging their package lists gives
+ * the same result for as long as the files stay the same, so what it
+ * comes to is saved in a binary file, which later rolls read back
+ * instead as long as the files hash the same.
+ *
+ * The file is "ROLLCFG1", the version of roll that wrote it, the hashes
+ * of the host and hostclass files, then the host config (hostclass tag,
+ * failsafe flag, packages), the hostclass config (host tag, failsafe
+ * flag, OS images, packages) and the merged packages. A string is a 16
+ * bit length and its bytes, NO_STRING for none; a flag is a byte; a
+ * list is a 32 bit count and its entries; numbers are little endian.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "config_cache.h"
+#include "buffer.h"
+#if !defined(HAVE_STRLCPY) && !HAVE_DECL_STRLCPY
+    #include "strlcpy.h"
+#endif
+
+#define CONFIG_CACHE_MAGIC "ROLLCFG1"
+#define MAGIC_SIZE 8
+#define NO_STRING 0xffff
+
+/* the part of a cache file not read yet */
+typedef struct reader_s {
+    const unsigned char *p;
+    const unsigned char *end;
+} reader_t;
+
+static int put_number(buffer_t *buffer, unsigned long n, int size) {
+    unsigned char bytes[4];
+    int i;
+
+    for(i = 0; i < size; i++) {
+        bytes[i] = (n >> (8 * i)) & 0xff;
+    }
+    return buffer_append(buffer, bytes, size);
+}
+
+static int put_string(buffer_t *buffer, const char *s) {
+    size_t length;
+
+    if(!s) {
+        return put_number(buffer, NO_STRING, 2);
+    }
+    if( (length = strlen(s)) >= NO_STRING ) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    return put_number(buffer, length, 2) && buffer_append(buffer, s, length);
+}
+
+static int put_packages(buffer_t *buffer, const package_list_t *list) {
+    const package_spec_t *package;
+
+    if(!put_number(buffer, list->count, 4)) {
+        return 0;
+    }
+    for(package = list->packages; package < list->packages + list->count; package++) {
+        if(!put_string(buffer, package->group) || !put_string(buffer, package->package_name)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int get_number(reader_t *reader, unsigned long *n, int size) {
+    int i;
+
+    if(reader->end - reader->p < size) {
+        return 0;
+    }
+    for(*n = 0, i = 0; i < size; i++) {
+        *n |= (unsigned long)reader->p[i] << (8 * i);
+    }
+    reader->p += size;
+    return 1;
+}
+
+/* a string as it is in the file; *s is NULL for none */
+static int get_bytes(reader_t *reader, const char **s, size_t *length) {
+    unsigned long n;
+
+    if(!get_number(reader, &n, 2)) {
+        return 0;
+    }
+    if(NO_STRING == n) {
+        *s = NULL;
+        *length = 0;
+        return 1;
+    }
+    if((unsigned long)(reader->end - reader->p) < n) {
+        return 0;
+    }
+    *s = (const char *)reader->p;
+    *length = n;
+    reader->p += n;
+    return 1;
+}
+
+/* is the next string expected? */
+static int match_string(reader_t *reader, const char *expected) {
+    const char *s;
+    size_t length;
+
+    return get_bytes(reader, &s, &length) && s &&
+           length == strlen(expected) && !memcmp(s, expected, length);
+}
+
+/* the next string, interned in arena */
+static int get_string(reader_t *reader, arena_t *arena, const char **s) {
+    const char *bytes;
+    size_t length;
+
+    if(!get_bytes(reader, &bytes, &length)) {
+        return 0;
+    }
+    *s = bytes ? arena_intern(arena, bytes, length) : NULL;
+    return !bytes || *s;
+}
+
+/* the next list's count, if there could be that many entries of at least size bytes */
+static int get_count(reader_t *reader, size_t *count, size_t size) {
+    unsigned long n;
+
+    if(!get_number(reader, &n, 4) || n > (unsigned long)(reader->end - reader->p) / size) {
+        return 0;
+    }
+    *count = n;
+    return 1;
+}
+
+static int get_packages(reader_t *reader, package_list_t *list) {
+    const char *group, *package_name;
+    size_t i, count;
+
+    if(!get_count(reader, &count, 4)) {
+        return 0;
+    }
+    for(i = 0; i < count; i++) {
+        if(!get_string(reader, &list->arena, &group) || !group ||
+           !get_string(reader, &list->arena, &package_name) || !package_name ||
+           !add_package_spec(list, group, package_name))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int get_os_images(reader_t *reader, hostclass_config_t *hostclass) {
+    arena_t *arena = &hostclass->package_list.arena;
+    size_t i, count;
+
+    if(!get_count(reader, &count, 4)) {
+        return 0;
+    }
+    if(count > 0 &&
+       !(hostclass->os_images = (os_image_spec_t *)arena_alloc(arena, count * sizeof(os_image_spec_t))))
+    {
+        return 0;
+    }
+    hostclass->os_image_count = hostclass->os_images_allocated = count;
+    for(i = 0; i < count; i++) {
+        if(!get_string(reader, arena, &hostclass->os_images[i].hardware_tag) ||
+           !get_string(reader, arena, &hostclass->os_images[i].image_name))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Read the config compiled in path, if it was compiled by this version
+ * of roll from a host config that hashes to host_hash. The hostclass
+ * part is only of use if config->hostclass_hash matches too. Returns 0,
+ * with config left empty, if the file is missing, damaged or out of date.
+ */
+int read_config_cache(resolved_config_t *config, const char *path, const char *host_hash) {
+    buffer_t file;
+    reader_t reader;
+    const char *s;
+    size_t length;
+    unsigned long host_failsafe, hostclass_failsafe;
+    int ok;
+
+    memset(config, 0, sizeof(resolved_config_t));
+    if(!buffer_map_file(&file, path)) {
+        return 0;
+    }
+    reader.p = (const unsigned char *)file.data;
+    reader.end = reader.p + file.length;
+    ok = file.length >= MAGIC_SIZE && !memcmp(file.data, CONFIG_CACHE_MAGIC, MAGIC_SIZE);
+    if(ok) {
+        reader.p += MAGIC_SIZE;
+    }
+    ok = ok &&
+         match_string(&reader, ROLL_VERSION) &&
+         match_string(&reader, host_hash) &&
+         get_bytes(&reader, &s, &length) && s && length == SHA256_HEX_SIZE - 1 &&
+         get_string(&reader, &config->host.package_list.arena, &config->host.hostclass_tag) &&
+         get_number(&reader, &host_failsafe, 1) &&
+         get_packages(&reader, &config->host.package_list) &&
+         get_string(&reader, &config->hostclass.package_list.arena, &config->hostclass.host_tag) &&
+         get_number(&reader, &hostclass_failsafe, 1) &&
+         get_os_images(&reader, &config->hostclass) &&
+         get_packages(&reader, &config->hostclass.package_list) &&
+         get_packages(&reader, &config->packages) &&
+         reader.p == reader.end;
+    if(ok) {
+        memcpy(config->hostclass_hash, s, length);
+        config->hostclass_hash[length] = '\0';
+        strlcpy(config->host_hash, host_hash, sizeof(config->host_hash));
+        config->host.has_failsafe = host_failsafe;
+        config->hostclass.has_failsafe = hostclass_failsafe;
+    }
+    buffer_free(&file);
+    if(!ok) {
+        free_resolved_config(config);
+    }
+    return ok;
+}
+
+/* save config in path, replacing any older one in one step */
+int write_config_cache(const resolved_config_t *config, const char *path) {
+    buffer_t buffer;
+    const os_image_spec_t *image;
+    int ok;
+
+    memset(&buffer, 0, sizeof(buffer_t));
+    ok = buffer_append(&buffer, CONFIG_CACHE_MAGIC, MAGIC_SIZE) &&
+         put_string(&buffer, ROLL_VERSION) &&
+         put_string(&buffer, config->host_hash) &&
+         put_string(&buffer, config->hostclass_hash) &&
+         put_string(&buffer, config->host.hostclass_tag) &&
+         put_number(&buffer, config->host.has_failsafe ? 1 : 0, 1) &&
+         put_packages(&buffer, &config->host.package_list) &&
+         put_string(&buffer, config->hostclass.host_tag) &&
+         put_number(&buffer, config->hostclass.has_failsafe ? 1 : 0, 1) &&
+         put_number(&buffer, config->hostclass.os_image_count, 4);
+    for(image = config->hostclass.os_images;
+        ok && image < config->hostclass.os_images + config->hostclass.os_image_count;
+        image++)
+    {
+        ok = put_string(&buffer, image->hardware_tag) && put_string(&buffer, image->image_name);
+    }
+    ok = ok &&
+         put_packages(&buffer, &config->hostclass.package_list) &&
+         put_packages(&buffer, &config->packages) &&
+         buffer_write_file(&buffer, path, 0644);
+    buffer_free(&buffer);
+    return ok;
+}
+
+void free_resolved_config(resolved_config_t *config) {
+    free_host_config(&config->host);
+    free_hostclass_config(&config->hostclass);
+    free_package_list(&config->packages);
+    memset(config, 0, sizeof(resolved_config_t));
+}
@@ -33,19 +33,24 @@
 
 #include "config.h"
 #include <stdlib.h>
-#ifndef HAVE_STRLCPY
-    #include "strlcpy.h"
-#endif
 #ifdef HAVE_STRING_H
     #include <string.h>
 #endif
+#include <pthread.h>
 #include <yaml.h>
 #include "config_parse.h"
+#include "arena.h"
+#include "hash.h"
 #include "log.h"
 
 #define MAX_ERROR_LENGTH 8192
 #define MAX_KEY_SIZE 1024
 
+/* group names seen so far; group n is bit 1 << n */
+static char *group_names[MAX_PACKAGE_GROUPS];
+static size_t group_count = 0;
+static pthread_mutex_t group_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void log_parse_error(const yaml_parser_t *parser, const char *type) {
     char msg[MAX_ERROR_LENGTH];
     int length = 0;
@@ -85,20 +90,30 @@ static void log_parse_error(const yaml_parser_t *parser, const char *type) {
     log_error(msg);
 }
 
+/* the value of a scalar event, kept in arena */
+static const char *scalar_string(arena_t *arena, const yaml_event_t *event) {
+    const char *s;
+
+    if( !(s = arena_intern(arena, (const char *)event->data.scalar.value, event->data.scalar.length)) ) {
+        log_error("Fatal error: out of memory.");
+    }
+    return s;
+}
+
 void free_host_config(host_config_t *host_config) {
-    free_package_list(host_config->package_list);
-    host_config->package_list = NULL;
+    free_package_list(&host_config->package_list);
+    memset(host_config, 0, sizeof(host_config_t));
 }
 
-int parse_host_config(host_config_t *host_config, FILE *host_file) {
+/* parse the host config in the length bytes at data */
+int parse_host_config(host_config_t *host_config, const char *data, size_t length) {
     yaml_parser_t parser;
     yaml_event_t event;
     int ok = 1;
     int done = 0;
     int current_depth = 0;
-    unsigned char last_package_group[MAX_VALUE_SIZE];
-    package_spec_t *package_spec = NULL;
-    package_spec_t *last_package_spec = NULL;
+    const char *last_package_group = NULL;
+    package_spec_t *package_spec;
 
     enum {
         STATE_START,
@@ -117,7 +132,7 @@ int parse_host_config(host_config_t *host_config, FILE *host_file) {
         return 0;
     }
 
-    yaml_parser_set_input_file(&parser, host_file);
+    yaml_parser_set_input_string(&parser, (const unsigned char *)(data ? data : ""), length);
 
     while(!done) {
         /* get next parser event */
@@ -150,44 +165,33 @@ int parse_host_config(host_config_t *host_config, FILE *host_file) {
                         }
                         break;
                     case STATE_HOSTCLASS_TAG:
-                        strlcpy((char *)host_config->hostclass_tag,
-                                (char *)event.data.scalar.value,
-                                MAX_VALUE_SIZE);
+                        host_config->hostclass_tag =
+                            scalar_string(&host_config->package_list.arena, &event);
+                        if(!host_config->hostclass_tag) {
+                            goto error;
+                        }
                         parse_state = STATE_START;
                         break;
                     case STATE_PACKAGES_GROUP:
-                        strlcpy((char *)last_package_group,
-                                (char *)event.data.scalar.value,
-                                MAX_VALUE_SIZE);
+                        last_package_group =
+                            scalar_string(&host_config->package_list.arena, &event);
+                        if(!last_package_group) {
+                            goto error;
+                        }
                         parse_state = STATE_PACKAGES_NAME;
                         break;
                     case STATE_PACKAGES_NAME:
                         package_spec =
-                            (package_spec_t *)malloc(sizeof(package_spec_t));
+                            add_package_spec(&host_config->package_list,
+                                             last_package_group,
+                                             (char *)event.data.scalar.value);
                         if(!package_spec) {
-                            log_error("Fatal error: out of memory.");
                             goto error;
                         }
-                        memset(package_spec, 0, sizeof(package_spec_t));
-                        strlcpy((char *)package_spec->group,
-                                (char *)last_package_group,
-                                MAX_VALUE_SIZE);
-                        strlcpy((char *)package_spec->package_name,
-                                (char *)event.data.scalar.value,
-                                MAX_VALUE_SIZE);
-                        if(!last_package_spec) {
-                            host_config->package_list =
-                                package_spec;
-                        } else {
-                            last_package_spec->next =
-                                package_spec;
-                        }
-                        last_package_spec = package_spec;
                         if(!host_config->has_failsafe &&
-                           !strcmp((char *)package_spec->group, FAILSAFE_GROUP_NAME)) {
+                           !strcmp(package_spec->group, FAILSAFE_GROUP_NAME)) {
                             host_config->has_failsafe = 1;
                         }
-                        package_spec = NULL;
                         break;
                 }
                 break;
@@ -235,28 +239,26 @@ int parse_host_config(host_config_t *host_config, FILE *host_file) {
  parser_error:
     log_parse_error(&parser, "host");
  error:
+    yaml_event_delete(&event);
     free_host_config(host_config);
-    memset(host_config, 0, sizeof(host_config_t));
     ok = 0;
  done:
-    if(package_spec) {
-        free(package_spec);
-    }
     yaml_parser_delete(&parser);
     return ok;
 }
 
-int parse_hostclass_config(hostclass_config_t *hostclass_config, FILE *hostclass_file) {
+/* parse the hostclass config in the length bytes at data */
+int parse_hostclass_config(hostclass_config_t *hostclass_config, const char *data, size_t length) {
     yaml_parser_t parser;
     yaml_event_t event;
     int ok = 1;
     int done = 0;
     int current_depth = 0;
-    unsigned char last_package_group[MAX_VALUE_SIZE];
-    package_spec_t *package_spec = NULL;
-    package_spec_t *last_package_spec = NULL;
-    os_image_spec_t *os_image_spec = NULL;
-    os_image_spec_t *last_os_image_spec = NULL;
+    const char *last_package_group = NULL;
+    const char *last_hardware_tag = NULL;
+    package_spec_t *package_spec;
+    os_image_spec_t *os_images;
+    arena_t *arena = &hostclass_config->package_list.arena;
 
     enum {
         STATE_START,
@@ -276,7 +278,7 @@ int parse_hostclass_config(hostclass_config_t *hostclass_config, FILE *hostclass
         return 0;
     }
 
-    yaml_parser_set_input_file(&parser, hostclass_file);
+    yaml_parser_set_input_string(&parser, (const unsigned char *)(data ? data : ""), length);
 
     while(!done) {
         /* get next parser event */
@@ -309,66 +311,55 @@ int parse_hostclass_config(hostclass_config_t *hostclass_config, FILE *hostclass
                         }
                         break;
                     case STATE_IMAGES_HARDWARE:
-                        os_image_spec =
-                            (os_image_spec_t *)malloc(sizeof(os_image_spec_t));
-                        if(!os_image_spec) {
-                            log_error("Fatal error: out of memory.");
+                        last_hardware_tag = scalar_string(arena, &event);
+                        if(!last_hardware_tag) {
                             goto error;
                         }
-                        memset(os_image_spec, 0, sizeof(os_image_spec_t));
-                        strlcpy((char *)os_image_spec->hardware_tag,
-                                (char *)event.data.scalar.value,
-                                MAX_VALUE_SIZE);
                         parse_state = STATE_IMAGES_IMAGE;
                         break;
                     case STATE_IMAGES_IMAGE:
-                        strlcpy((char *)os_image_spec->image_name,
-                                (char *)event.data.scalar.value,
-                                MAX_VALUE_SIZE);
-                        if(!last_os_image_spec) {
-                            hostclass_config->os_image_list =
-                                os_image_spec;
-                        } else {
-                            last_os_image_spec->next =
-                                os_image_spec;
+                        if(hostclass_config->os_image_count == hostclass_config->os_images_allocated) {
+                            hostclass_config->os_images_allocated =
+                                hostclass_config->os_images_allocated ?
+                                2 * hostclass_config->os_images_allocated : 4;
+                            os_images = (os_image_spec_t *)
+                                arena_grow(arena,
+                                           hostclass_config->os_images,
+                                           hostclass_config->os_image_count * sizeof(os_image_spec_t),
+                                           hostclass_config->os_images_allocated * sizeof(os_image_spec_t));
+                            if(!os_images) {
+                                log_error("Fatal error: out of memory.");
+                                goto error;
+                            }
+                            hostclass_config->os_images = os_images;
+                        }
+                        os_images = &hostclass_config->os_images[hostclass_config->os_image_count];
+                        os_images->hardware_tag = last_hardware_tag;
+                        if( !(os_images->image_name = scalar_string(arena, &event)) ) {
+                            goto error;
                         }
-                        last_os_image_spec = os_image_spec;
-                        os_image_spec = NULL;
+                        hostclass_config->os_image_count++;
                         parse_state = STATE_IMAGES_HARDWARE;
                         break;
                     case STATE_PACKAGES_GROUP:
-                        strlcpy((char *)last_package_group,
-                                (char *)event.data.scalar.value,
-                                MAX_VALUE_SIZE);
+                        last_package_group = scalar_string(arena, &event);
+                        if(!last_package_group) {
+                            goto error;
+                        }
                         parse_state = STATE_PACKAGES_NAME;
                         break;
                     case STATE_PACKAGES_NAME:
                         package_spec =
-                            (package_spec_t *)malloc(sizeof(package_spec_t));
+                            add_package_spec(&hostclass_config->package_list,
+                                             last_package_group,
+                                             (char *)event.data.scalar.value);
                         if(!package_spec) {
-                            log_error("Fatal error: out of memory.");
                             goto error;
                         }
-                        memset(package_spec, 0, sizeof(package_spec_t));
-                        strlcpy((char *)package_spec->group,
-                                (char *)last_package_group,
-                                MAX_VALUE_SIZE);
-                        strlcpy((char *)package_spec->package_name,
-                                (char *)event.data.scalar.value,
-                                MAX_VALUE_SIZE);
-                        if(!last_package_spec) {
-                            hostclass_config->package_list =
-                                package_spec;
-                        } else {
-                            last_package_spec->next =
-                                package_spec;
-                        }
-                        last_package_spec = package_spec;
                         if(!hostclass_config->has_failsafe &&
-                           !strcmp((char *)package_spec->group, FAILSAFE_GROUP_NAME)) {
+                           !strcmp(package_spec->group, FAILSAFE_GROUP_NAME)) {
                             hostclass_config->has_failsafe = 1;
                         }
-                        package_spec = NULL;
                         break;
                 }
                 break;
@@ -418,57 +409,133 @@ int parse_hostclass_config(hostclass_config_t *hostclass_config, FILE *hostclass
  parser_error:
     log_parse_error(&parser, "hostclass");
  error:
+    yaml_event_delete(&event);
     free_hostclass_config(hostclass_config);
-    memset(hostclass_config, 0, sizeof(hostclass_config_t));
     ok = 0;
  done:
-    if(os_image_spec) {
-        free(os_image_spec);
-    }
-    if(package_spec) {
-        free(package_spec);
-    }
     yaml_parser_delete(&parser);
     return ok;
 }
 
 void free_hostclass_config(hostclass_config_t *hostclass_config) {
-    os_image_spec_t *os_image_spec, *os_image_spec_temp;
+    free_package_list(&hostclass_config->package_list);
+    memset(hostclass_config, 0, sizeof(hostclass_config_t));
+}
 
-    os_image_spec = hostclass_config->os_image_list;
-    while(os_image_spec) {
-        os_image_spec_temp = os_image_spec;
-        os_image_spec = os_image_spec->next;
-        free(os_image_spec_temp);
+/*
+ * package_group_bit() of a group name interned in list's arena. A list
+ * has few groups, so they are remembered by address, and the shared table
+ * and its lock are only needed the first time the list sees each one.
+ */
+static unsigned long list_group_bit(package_list_t *list, const char *group) {
+    unsigned long bit;
+    size_t i;
+
+    for(i = 0; i < list->cached_count; i++) {
+        if(list->cached_groups[i] == group) {
+            return list->cached_bits[i];
+        }
     }
-    hostclass_config->os_image_list = NULL;
+    bit = package_group_bit(group);
+    if(list->cached_count < GROUP_CACHE_SIZE) {
+        list->cached_groups[list->cached_count] = group;
+        list->cached_bits[list->cached_count++] = bit;
+    }
+    return bit;
+}
 
-    free_package_list(hostclass_config->package_list);
-    hostclass_config->package_list = NULL;
+/*
+ * Append a package to list, keeping the strings in the list's arena.
+ * Returns the new entry, valid until the list next grows, or NULL if
+ * out of memory.
+ */
+package_spec_t *add_package_spec(package_list_t *list, const char *group, const char *package_name) {
+    package_spec_t *packages, *package_spec;
+    size_t allocated;
+
+    if(list->count == list->allocated) {
+        allocated = list->allocated ? 2 * list->allocated : 16;
+        packages = (package_spec_t *)arena_grow(&list->arena,
+                                                list->packages,
+                                                list->count * sizeof(package_spec_t),
+                                                allocated * sizeof(package_spec_t));
+        if(!packages) {
+            log_error("Fatal error: out of memory.");
+            return NULL;
+        }
+        list->packages = packages;
+        list->allocated = allocated;
+    }
+    package_spec = &list->packages[list->count];
+    package_spec->group = arena_string(&list->arena, group);
+    package_spec->package_name = arena_string(&list->arena, package_name);
+    if(!package_spec->group || !package_spec->package_name) {
+        log_error("Fatal error: out of memory.");
+        return NULL;
+    }
+    package_spec->group_bit = list_group_bit(list, package_spec->group);
+    list->count++;
+    return package_spec;
 }
 
-static package_spec_t *package_spec_dup(package_spec_t *package_spec_src) {
-    package_spec_t *package_spec_dst;
+void free_package_list(package_list_t *list) {
+    arena_free(&list->arena);
+    memset(list, 0, sizeof(package_list_t));
+}
 
-    package_spec_dst = (package_spec_t *)malloc(sizeof(package_spec_t));
-    if(!package_spec_dst) {
-        log_error("Fatal error: out of memory.");
-        goto error;
+/*
+ * The bit that stands for group, so that a package can be checked
+ * against a set of groups with one AND. Group names are interned as they
+ * are first seen; past MAX_PACKAGE_GROUPS of them, 0 is returned and the
+ * names have to be compared.
+ */
+unsigned long package_group_bit(const char *group) {
+    unsigned long bit = 0;
+    size_t i;
+
+    pthread_mutex_lock(&group_lock);
+    for(i = 0; i < group_count; i++) {
+        if(!strcmp(group_names[i], group)) {
+            bit = 1UL << i;
+            break;
+        }
+    }
+    if(!bit && group_count < MAX_PACKAGE_GROUPS && (group_names[group_count] = strdup(group))) {
+        bit = 1UL << group_count++;
+    }
+    pthread_mutex_unlock(&group_lock);
+    return bit;
+}
+
+/* the bits of the NULL terminated list of group names */
+unsigned long package_groups_mask(const char *groups[]) {
+    unsigned long mask = 0;
+    int g;
+
+    for(g = 0; groups[g] != NULL; g++) {
+        mask |= package_group_bit(groups[g]);
+    }
+    return mask;
+}
+
+/* is package in one of groups, whose package_groups_mask() is mask? */
+int package_in_groups(const package_spec_t *package, const char *groups[], unsigned long mask) {
+    int g;
+
+    /* groups with bits of their own are different from groups without */
+    if(package->group_bit) {
+        return 0 != (package->group_bit & mask);
+    }
+    for(g = 0; groups[g] != NULL; g++) {
+        if(!strcmp(groups[g], (char *)package->group)) {
+            return 1;
+        }
     }
-    memset(package_spec_dst, 0, sizeof(package_spec_t));
-    strlcpy((char *)package_spec_dst->group,
-            (char *)package_spec_src->group,
-            MAX_VALUE_SIZE);
-    strlcpy((char *)package_spec_dst->package_name,
-            (char *)package_spec_src->package_name,
-            MAX_VALUE_SIZE);
-    package_spec_dst->next = NULL;
-
-error:
-    return package_spec_dst;
+    return 0;
 }
 
-/* do package names match up to the first hyphen (foo-1.2.3 and foo-2.3.4)?
+/* key under which merge_package_lists() files a package: its group and
+ * its name up to the first hyphen, so that the same key means
  * should match:
  * - apache-1.3.19 apache-2.2.27
  * - apache apache-2.2.27
@@ -478,80 +545,119 @@ error:
  * - apache nginx
  * - apache-1.3.19 apache_ant-1.8.2
  * - apache apache_ant-1.8.2
+ * The key is made in arena; NULL if out of memory.
  */
-static int package_basename_match(package_spec_t *a, package_spec_t *b) {
-    int i;
+static const char *package_merge_key(arena_t *arena, const package_spec_t *package) {
+    size_t group_length = strlen(package->group),
+           name_length = strcspn(package->package_name, "-");
+    char *key;
 
-    /* if groups don't match, return false */
-    if(strcmp((char *)a->group, (char *)b->group)) return 0;
-
-    for(i = 0; ; i++) {
-        /* if all match up until end of string or hyphen, return true */
-        if((a->package_name[i] == 0 || a->package_name[i] == '-') &&
-           (b->package_name[i] == 0 || b->package_name[i] == '-')) {
-            return 1;
-        /* if any mismatch, including end of either string, return false */
-        } else if(a->package_name[i] != b->package_name[i]) {
-            return 0;
-        }
+    if( !(key = (char *)arena_alloc(arena, group_length + name_length + 2)) ) {
+        return NULL;
     }
+    memcpy(key, package->group, group_length);
+    key[group_length] = '\n';   /* cannot be part of a YAML plain scalar */
+    memcpy(key + group_length + 1, package->package_name, name_length);
+    key[group_length + 1 + name_length] = '\0';
+    return key;
 }
 
-/* merge or append a single package_spec_t onto existing package_spec_t list */
-void append_package_spec(package_spec_t **list, package_spec_t *addition) {
-    package_spec_t *package_spec, *new_package_spec, *last_package_spec = NULL;
-    int replaced = 0;
-
-    /* try to merge package addition into existing list */
-    for(package_spec = *list; package_spec; package_spec = package_spec->next) {
-        if(package_basename_match(package_spec, addition)) {
-            log_info("  Overriding %s package %s with %s",
-                     package_spec->group,
-                     package_spec->package_name,
-                     addition->package_name);
-             strlcpy((char *)package_spec->package_name,
-                     (char *)addition->package_name,
-                     MAX_VALUE_SIZE);
-             replaced = 1;
-        }
-        last_package_spec = package_spec;
+/*
+ * Merge two package lists into merged, the second overriding the first.
+ * The result keeps the order in which packages first appear. Each
+ * package replaced along the way is passed to report, which may be NULL.
+ * Nothing else is logged, so this is safe for any thread to use.
+ * Returns 0 if out of memory.
+ */
+int merge_package_lists_reporting(package_list_t *merged, const package_list_t *base,
+                                  const package_list_t *override,
+                                  package_change_report_t report, void *report_data)
+{
+    const package_list_t *lists[2];
+    const package_spec_t *addition;
+    package_spec_t *package_spec;
+    hash_table_t index;
+    arena_t keys;
+    const char *key;
+    size_t i, entry, position;
+    int l;
+
+    memset(merged, 0, sizeof(package_list_t));
+    memset(&keys, 0, sizeof(arena_t));
+    if(!hash_init(&index, base->count + override->count)) {
+        log_error("Fatal error: out of memory.");
+        return 0;
     }
-
-    /* if we did not replace a package, insert new package at end */
-    if(!replaced) {
-        new_package_spec = package_spec_dup(addition);
-        log_info("  Adding %s package %s",
-                 new_package_spec->group,
-                 new_package_spec->package_name);
-        if(!*list) *list = new_package_spec;
-        if(last_package_spec) last_package_spec->next = new_package_spec;
+    lists[0] = base;
+    lists[1] = override;
+    for(l = 0; l < 2; l++) {
+        for(i = 0; i < lists[l]->count; i++) {
+            addition = &lists[l]->packages[i];
+            if( !(key = package_merge_key(&keys, addition)) ) {
+                log_error("Fatal error: out of memory.");
+                goto error;
+            }
+
+            /* positions are kept, not pointers, as the list may move as it
+               grows; the low bit says which list the package last came from,
+               even if that list only named it again */
+            if( (entry = (size_t)hash_get(&index, key)) ) {
+                position = entry >> 1;
+                package_spec = &merged->packages[position - 1];
+                if(strcmp(package_spec->package_name, addition->package_name)) {
+                    if(report) {
+                        report(report_data,
+                               (entry & 1) != (size_t)l ? PACKAGE_OVERRIDDEN :
+                               l ? PACKAGE_OVERRIDE_CONFLICT : PACKAGE_BASE_CONFLICT,
+                               package_spec->group,
+                               package_spec->package_name,
+                               addition->package_name);
+                    }
+                    if( !(package_spec->package_name = arena_string(&merged->arena, addition->package_name)) ) {
+                        log_error("Fatal error: out of memory.");
+                        goto error;
+                    }
+                }
+                if(!hash_put(&index, key, (void *)((position << 1) | l))) {
+                    log_error("Fatal error: out of memory.");
+                    goto error;
+                }
+            } else if(!add_package_spec(merged, addition->group, addition->package_name)) {
+                goto error;
+            } else if(!hash_put(&index, key, (void *)((merged->count << 1) | l))) {
+                log_error("Fatal error: out of memory.");
+                goto error;
+            }
+        }
     }
+    hash_free(&index);
+    arena_free(&keys);
+    return 1;
+ error:
+    hash_free(&index);
+    arena_free(&keys);
+    free_package_list(merged);
+    return 0;
 }
 
-/* merge two package_spec_t linked lists, second overrides first */
-package_spec_t *merge_package_lists(package_spec_t *base, package_spec_t *override) {
-    package_spec_t *merged_package_list, *package_spec;
-
-    /* merge base packages into merged package list */
-    merged_package_list = NULL;
-    for(package_spec = base; package_spec; package_spec = package_spec->next) {
-        append_package_spec(&merged_package_list, package_spec);
+static void log_package_change(void *data, package_change_t change, const char *group,
+                               const char *replaced, const char *replacement)
+{
+    if(PACKAGE_OVERRIDDEN == change) {
+        (*(int *)data)++;
+        log_info("  Overriding %s package %s with %s", group, replaced, replacement);
+    } else {
+        log_info("  Conflicting %s packages %s and %s; using the latter", group, replaced, replacement);
     }
-
-    /* merge override packages into merged package list */
-    for(package_spec = override; package_spec; package_spec = package_spec->next) {
-        append_package_spec(&merged_package_list, package_spec);
-    }
-
-    return merged_package_list;
 }
 
-void free_package_list(package_spec_t *package_list) {
-    package_spec_t *package_spec_temp;
+/* merge_package_lists_reporting(), logging what is replaced */
+int merge_package_lists(package_list_t *merged, const package_list_t *base, const package_list_t *override) {
+    int overridden = 0;
 
-    while(package_list) {
-        package_spec_temp = package_list;
-        package_list = package_list->next;
-        free(package_spec_temp);
+    if(!merge_package_lists_reporting(merged, base, override, log_package_change, &overridden)) {
+        return 0;
     }
+    log_info("  %lu packages, %d overridden", (unsigned long)merged->count, overridden);
+    return 1;
 }
@@ -34,44 +34,76 @@
 #ifndef CONFIG_PARSE_H
 #define CONFIG_PARSE_H
 
+#include "arena.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define FAILSAFE_GROUP_NAME "failsafe"
-#define MAX_VALUE_SIZE 256
+#define MAX_PACKAGE_GROUPS (8 * sizeof(unsigned long))
+#define GROUP_CACHE_SIZE 8
 
 typedef struct package_spec_s {
-    unsigned char group[MAX_VALUE_SIZE];
-    unsigned char package_name[MAX_VALUE_SIZE];
-    struct package_spec_s *next;
+    const char *group;          /* strings are interned in the list's arena */
+    const char *package_name;
+    unsigned long group_bit;    /* package_group_bit() of group; 0 if not known */
 } package_spec_t;
 
+/* packages in the order given; a zeroed package_list_t is an empty list */
+typedef struct package_list_s {
+    package_spec_t *packages;
+    size_t count;
+    size_t allocated;
+    arena_t arena;              /* holds the packages and their strings */
+    const char *cached_groups[GROUP_CACHE_SIZE];    /* interned group names seen, and */
+    unsigned long cached_bits[GROUP_CACHE_SIZE];    /* their package_group_bit() */
+    size_t cached_count;
+} package_list_t;
+
 typedef struct host_config_s {
-    unsigned char hostclass_tag[MAX_VALUE_SIZE];
-    package_spec_t *package_list;
+    package_list_t package_list;    /* its arena holds the whole config */
+    const char *hostclass_tag;
     int has_failsafe;
 } host_config_t;
 
 typedef struct os_image_spec_s {
-    unsigned char hardware_tag[MAX_VALUE_SIZE];
-    unsigned char image_name[MAX_VALUE_SIZE];
-    struct os_image_spec_s *next;
+    const char *hardware_tag;
+    const char *image_name;
 } os_image_spec_t;
 
 typedef struct hostclass_config_s {
-    unsigned char host_tag[MAX_VALUE_SIZE];
-    os_image_spec_t *os_image_list;
-    package_spec_t *package_list;
+    package_list_t package_list;    /* its arena holds the whole config */
+    const char *host_tag;
+    os_image_spec_t *os_images;
+    size_t os_image_count;
+    size_t os_images_allocated;
     int has_failsafe;
 } hostclass_config_t;
 
-int parse_host_config(host_config_t *host_config, FILE *host_file);
+/* why merging package lists replaced a package */
+typedef enum {
+    PACKAGE_OVERRIDDEN,         /* a package of the overriding list replaced it */
+    PACKAGE_BASE_CONFLICT,      /* a later package of the base list did */
+    PACKAGE_OVERRIDE_CONFLICT   /* a later package of the overriding list did */
+} package_change_t;
+
+typedef void (*package_change_report_t)(void *data, package_change_t change, const char *group,
+                                        const char *replaced, const char *replacement);
+
+int parse_host_config(host_config_t *host_config, const char *data, size_t length);
 void free_host_config(host_config_t *host_config);
-int parse_hostclass_config(hostclass_config_t *hostclass_config, FILE *hostclass_file);
+int parse_hostclass_config(hostclass_config_t *hostclass_config, const char *data, size_t length);
 void free_hostclass_config(hostclass_config_t *hostclass_config);
-package_spec_t *merge_package_lists(package_spec_t *a, package_spec_t *b);
-void free_package_list(package_spec_t *package_list);
+package_spec_t *add_package_spec(package_list_t *list, const char *group, const char *package_name);
+int merge_package_lists(package_list_t *merged, const package_list_t *base, const package_list_t *override);
+int merge_package_lists_reporting(package_list_t *merged, const package_list_t *base,
+                                  const package_list_t *override,
+                                  package_change_report_t report, void *report_data);
+void free_package_list(package_list_t *list);
+unsigned long package_group_bit(const char *group);
+unsigned long package_groups_mask(const char *groups[]);
+int package_in_groups(const package_spec_t *package, const char *groups[], unsigned long mask);
 
 #ifdef __cplusplus
 }
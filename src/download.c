@@ -33,10 +33,116 @@
 
 #include "config.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#ifdef HAVE_UNISTD_H
+    #include <unistd.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+    #include <sys/stat.h>
+#endif
+#ifdef HAVE_LIMITS_H
+    #include <limits.h>
+#endif
 #include <curl/curl.h>
 #include "download.h"
+#include "buffer.h"
 #include "log.h"
+#if !defined(HAVE_STRLCPY) && !HAVE_DECL_STRLCPY
+    #include "strlcpy.h"
+#endif
+
+#define ERROR_BUFFER_SIZE 1024
+#define VALIDATOR_SUFFIX ".validator"
+
+/* per-transfer state for download_all() */
+typedef struct transfer_s {
+    download_job_t *job;
+    CURL *curl;
+    FILE *fp;
+    curl_off_t offset;              /* bytes already on disk when resuming */
+    struct curl_slist *headers;
+    download_validator_t validator; /* from the response being received */
+    int discard;                    /* response is not the file; drop it */
+    char validator_file[PATH_MAX];
+    char error_buffer[ERROR_BUFFER_SIZE];
+} transfer_t;
+
+/* copy the value of header "name: value" into value, if that is what line is */
+static int header_value(const char *line, size_t length, const char *name, char *value, size_t size) {
+    size_t n = strlen(name);
+
+    if(length <= n || strncasecmp(line, name, n) || line[n] != ':') {
+        return 0;
+    }
+    line += n + 1;
+    length -= n + 1;
+    while(length > 0 && isspace((unsigned char)line[0])) {
+        line++;
+        length--;
+    }
+    while(length > 0 && isspace((unsigned char)line[length - 1])) {
+        length--;
+    }
+    if(length >= size) {
+        length = 0;  /* too long to be of use */
+    }
+    memcpy(value, line, length);
+    value[length] = '\0';
+    return 1;
+}
+
+/* pick the validators out of a response header line; 1 if it was one */
+static int capture_validator(const char *line, size_t length, download_validator_t *validator) {
+    if(length >= 5 && !strncmp(line, "HTTP/", 5)) {
+        /* each response of a redirect chain has its own */
+        memset(validator->etag, 0, MAX_VALIDATOR_SIZE);
+        memset(validator->last_modified, 0, MAX_VALIDATOR_SIZE);
+        return 1;
+    }
+    return header_value(line, length, "ETag", validator->etag, MAX_VALIDATOR_SIZE) ||
+           header_value(line, length, "Last-Modified", validator->last_modified, MAX_VALIDATOR_SIZE);
+}
+
+/* validators are kept in a small file of "Name: value" lines */
+int download_load_validator(const char *path, download_validator_t *validator) {
+    FILE *fp;
+    char line[PATH_MAX + 32];
+
+    memset(validator, 0, sizeof(download_validator_t));
+    if( !(fp = fopen(path, "r")) ) {
+        return 0;
+    }
+    while(fgets(line, sizeof(line), fp)) {
+        if(!capture_validator(line, strlen(line), validator)) {
+            header_value(line, strlen(line), "URL", validator->url, PATH_MAX);
+        }
+    }
+    fclose(fp);
+    return validator->etag[0] || validator->last_modified[0];
+}
+
+/* a validator without ETag or Last-Modified is useless; its file is removed */
+int download_save_validator(const char *path, const download_validator_t *validator) {
+    FILE *fp;
+
+    if(!validator->etag[0] && !validator->last_modified[0]) {
+        unlink(path);
+        return 1;
+    }
+    if( !(fp = fopen(path, "w")) ) {
+        return 0;
+    }
+    if(validator->url[0])
+        fprintf(fp, "URL: %s\n", validator->url);
+    if(validator->etag[0])
+        fprintf(fp, "ETag: %s\n", validator->etag);
+    if(validator->last_modified[0])
+        fprintf(fp, "Last-Modified: %s\n", validator->last_modified);
+    return 0 == fclose(fp);
+}
 
 static size_t write_data(void *ptr, size_t size, size_t nmemb, FILE *stream) {
     size_t written;
@@ -44,59 +150,496 @@ static size_t write_data(void *ptr, size_t size, size_t nmemb, FILE *stream) {
     return written;
 }
 
+static size_t write_buffer(void *ptr, size_t size, size_t nmemb, buffer_t *buffer) {
+    if(!buffer_append(buffer, ptr, size * nmemb)) {
+        return 0;
+    }
+    return size * nmemb;
+}
+
+static size_t write_file(void *ptr, size_t size, size_t nmemb, transfer_t *transfer) {
+    if(transfer->discard) {
+        return size * nmemb;
+    }
+    return fwrite(ptr, size, nmemb, transfer->fp) * size;
+}
+
+/* all headers of a response are in: decide what to do with its body */
+static void headers_complete(transfer_t *transfer) {
+    long status = 0;
+
+    curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &status);
+    if(status >= 300 && status < 400) {
+        return;  /* a redirect; the real response follows */
+    }
+    transfer->discard = !(200 == status || 206 == status);
+    if(transfer->discard || !transfer->job->resume) {
+        return;
+    }
+
+    /* If-Range did not match: the partial file is stale, start over */
+    if(200 == status && transfer->offset > 0) {
+        log_info("  Partial download of %s is out of date; starting over", transfer->job->label);
+        if(0 != ftruncate(fileno(transfer->fp), 0) || 0 != fseek(transfer->fp, 0, SEEK_SET)) {
+            transfer->discard = 1;
+        }
+        transfer->offset = 0;
+    }
+    strlcpy(transfer->validator.url, transfer->job->url, PATH_MAX);
+    if(!download_save_validator(transfer->validator_file, &transfer->validator)) {
+        log_error("  Cannot write %s", transfer->validator_file);
+    }
+}
+
+static size_t read_header(char *buffer, size_t size, size_t nitems, transfer_t *transfer) {
+    size_t length = size * nitems;
+
+    if(!capture_validator(buffer, length, &transfer->validator) &&
+       length <= 2 && (buffer[0] == '\r' || buffer[0] == '\n'))
+    {
+        headers_complete(transfer);
+    }
+    return length;
+}
+
+static size_t read_validator(char *buffer, size_t size, size_t nitems, download_validator_t *validator) {
+    capture_validator(buffer, size * nitems, validator);
+    return size * nitems;
+}
+
+static size_t write_sink(void *ptr, size_t size, size_t nmemb, transfer_t *transfer) {
+    download_job_t *job = transfer->job;
+    if(transfer->discard) {
+        return size * nmemb;
+    }
+    if(!job->sink(job->sink_data, ptr, size * nmemb)) {
+        return 0;
+    }
+    return size * nmemb;
+}
+
 /*
  * proxy is optional: if NULL then don't set the proxy option
  *                    if non-NULL, then it should be a string of the
  *                    form: "proxyhostname[:portnumber]"
  */
-int download(const char *source_url, const char *dest_file, const char *proxy) {
-    CURL *curl = NULL;
-    CURLcode rc;
-    FILE *fp = NULL;
-    long status;
-    int result = 0;
-    char error_buffer[1024] = { 0 };
+int download_context_init(download_context_t *context, const char *proxy) {
+    memset(context, 0, sizeof(download_context_t));
+    context->proxy = proxy;
 
-    if( !(fp = fopen(dest_file, "wb")) ) {
-        log_error("  Cannot open %s for writing.", dest_file);
-        goto error;
+    if(CURLE_OK != curl_global_init(CURL_GLOBAL_ALL)) {
+        log_error("Cannot initialze curl.");
+        return 0;
     }
+    context->initialized = 1;
 
-    curl = curl_easy_init();
-    if(!curl) {
-        log_error("  Cannot initialze curl.");
-        goto error;
+    /* DNS lookups, connections and TLS sessions are shared by every
+       request made through this context, so later requests to the same
+       server skip the lookup and handshakes */
+    if( !(context->share = curl_share_init()) ) {
+        log_error("Cannot initialze curl share handle.");
+        return 0;
     }
+    curl_share_setopt(context->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(context->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    curl_share_setopt(context->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+    return 1;
+}
 
-    if (proxy && strlen(proxy) > 0) {
-      curl_easy_setopt(curl, CURLOPT_PROXY, proxy);
+void download_context_cleanup(download_context_t *context) {
+    if(context->curl)
+        curl_easy_cleanup(context->curl);
+    if(context->multi)
+        curl_multi_cleanup(context->multi);
+    if(context->share)
+        curl_share_cleanup(context->share);
+    if(context->initialized)
+        curl_global_cleanup();
+    memset(context, 0, sizeof(download_context_t));
+}
+
+static void setup_curl_handle(download_context_t *context, CURL *curl, const char *source_url,
+                              curl_write_callback writer, void *writer_data, char *error_buffer)
+{
+    if (context->proxy && strlen(context->proxy) > 0) {
+      curl_easy_setopt(curl, CURLOPT_PROXY, context->proxy);
     }
+    curl_easy_setopt(curl, CURLOPT_SHARE, context->share);
     curl_easy_setopt(curl, CURLOPT_URL, source_url);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writer);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, writer_data);
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
     curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error_buffer);
-    rc = curl_easy_perform(curl);
+}
+
+static CURL *new_curl_handle(download_context_t *context, const char *source_url,
+                             curl_write_callback writer, void *writer_data, char *error_buffer)
+{
+    CURL *curl;
+
+    curl = curl_easy_init();
+    if(!curl) {
+        log_error("  Cannot initialze curl.");
+        return NULL;
+    }
+    setup_curl_handle(context, curl, source_url, writer, writer_data, error_buffer);
+    return curl;
+}
+
+/* check the outcome of a finished transfer, logging why it failed */
+static int transfer_succeeded(CURL *curl, CURLcode rc, const char *source_url, const char *error_buffer) {
+    long status;
+
     if(CURLE_OK == rc) {
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
-        if(200 == status ||
+        if(200 == status || 206 == status ||
            (strncmp(source_url, "file:", strlen("file:")) == 0 && 0 == status))
         {
-            result = 1;
+            return 1;
         } else {
             log_error("  Download failed with %d HTTP result code.", status);
         }
     } else {
-        log_error("  Download failed with %d return code from curl_easy_perform().", rc);
+        log_error("  Download failed with %d return code from curl.", rc);
         log_error("  Error recorded by libcurl: %s\n", error_buffer);
         if (CURLE_WRITE_ERROR == rc) {
             log_error("  The disk might be full.\n");
         }
     }
+    return 0;
+}
+
+/* ask for the file only if it differs from the copy validator describes */
+static struct curl_slist *conditional_headers(const download_validator_t *validator) {
+    struct curl_slist *headers = NULL;
+    char header[MAX_VALIDATOR_SIZE + 32];
+
+    if(validator->etag[0]) {
+        snprintf(header, sizeof(header), "If-None-Match: %s", validator->etag);
+        headers = curl_slist_append(headers, header);
+    }
+    if(validator->last_modified[0]) {
+        snprintf(header, sizeof(header), "If-Modified-Since: %s", validator->last_modified);
+        headers = curl_slist_append(headers, header);
+    }
+    return headers;
+}
+
+/*
+ * Fetch source_url with the shared easy handle, handing the body to
+ * writer. See download_buffer_if_modified() for validator and modified.
+ */
+static int fetch_if_modified(download_context_t *context, const char *source_url,
+                             curl_write_callback writer, void *writer_data,
+                             download_validator_t *validator, int *modified)
+{
+    CURLcode rc;
+    int result = 0;
+    long status = 0;
+    struct curl_slist *headers = NULL;
+    download_validator_t received;
+    char error_buffer[ERROR_BUFFER_SIZE] = { 0 };
+
+    if(modified) {
+        *modified = 1;
+    }
+    memset(&received, 0, sizeof(download_validator_t));
+
+    /* keep one easy handle around for sequential requests */
+    if(context->curl) {
+        curl_easy_reset(context->curl);
+        setup_curl_handle(context, context->curl, source_url, writer, writer_data, error_buffer);
+    } else if( !(context->curl = new_curl_handle(context, source_url, writer, writer_data, error_buffer)) ) {
+        goto error;
+    }
+
+    if(validator) {
+        headers = conditional_headers(validator);
+        curl_easy_setopt(context->curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(context->curl, CURLOPT_HEADERFUNCTION, read_validator);
+        curl_easy_setopt(context->curl, CURLOPT_HEADERDATA, &received);
+    }
+
+    rc = curl_easy_perform(context->curl);
+    if(validator && CURLE_OK == rc &&
+       CURLE_OK == curl_easy_getinfo(context->curl, CURLINFO_RESPONSE_CODE, &status) &&
+       304 == status && modified)
+    {
+        *modified = 0;
+        result = 1;
+    } else if( (result = transfer_succeeded(context->curl, rc, source_url, error_buffer)) && validator ) {
+        memcpy(validator, &received, sizeof(download_validator_t));
+        strlcpy(validator->url, source_url, PATH_MAX);
+    }
+    curl_easy_setopt(context->curl, CURLOPT_ERRORBUFFER, NULL);
+    curl_easy_setopt(context->curl, CURLOPT_HTTPHEADER, NULL);
 error:
-    if(fp)
-        fclose(fp);
-    if(curl)
-        curl_easy_cleanup(curl);
+    if(headers)
+        curl_slist_free_all(headers);
     return result;
 }
+
+int download(download_context_t *context, const char *source_url, const char *dest_file) {
+    FILE *fp;
+    int result;
+
+    if( !(fp = fopen(dest_file, "wb")) ) {
+        log_error("  Cannot open %s for writing.", dest_file);
+        return 0;
+    }
+    result = fetch_if_modified(context, source_url, (curl_write_callback)write_data, fp, NULL, NULL);
+    if(0 != fclose(fp)) {
+        result = 0;
+    }
+    return result;
+}
+
+/*
+ * Fetch source_url into buffer, replacing what it held. When validator
+ * holds the ETag or Last-Modified of a copy the caller already has, the
+ * server is asked to send the file only if it has changed since.
+ * *modified is set to 0 if it has not, in which case buffer is left
+ * empty. Otherwise validator is replaced by that of the file just
+ * downloaded.
+ */
+int download_buffer_if_modified(download_context_t *context, const char *source_url, buffer_t *buffer,
+                                download_validator_t *validator, int *modified)
+{
+    buffer_free(buffer);
+    if(!fetch_if_modified(context, source_url, (curl_write_callback)write_buffer, buffer,
+                          validator, modified))
+    {
+        buffer_free(buffer);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Pick up a partial download where it left off. The request carries
+ * If-Range, so a server whose copy has changed since sends the whole
+ * file instead of the rest of a different one. CURLOPT_RANGE is used
+ * rather than CURLOPT_RESUME_FROM_LARGE, because the latter makes curl
+ * fail outright on exactly that full-file reply.
+ */
+static int resume_transfer(transfer_t *transfer) {
+    download_job_t *job = transfer->job;
+    download_validator_t validator;
+    struct stat st;
+    char range[64], if_range[MAX_VALIDATOR_SIZE + 16];
+
+    if(0 != stat(job->dest_file, &st) || st.st_size == 0 ||
+       !download_load_validator(transfer->validator_file, &validator) ||
+       (validator.url[0] && strcmp(validator.url, job->url)))
+    {
+        return 0;
+    }
+
+    /* weak entity tags may not be used with If-Range */
+    if(validator.etag[0] && strncmp(validator.etag, "W/", 2)) {
+        snprintf(if_range, sizeof(if_range), "If-Range: %s", validator.etag);
+    } else if(validator.last_modified[0]) {
+        snprintf(if_range, sizeof(if_range), "If-Range: %s", validator.last_modified);
+    } else {
+        return 0;
+    }
+    if( !(transfer->headers = curl_slist_append(NULL, if_range)) ) {
+        return 0;
+    }
+
+    transfer->offset = (curl_off_t)st.st_size;
+    snprintf(range, sizeof(range), "%" CURL_FORMAT_CURL_OFF_T "-", transfer->offset);
+    curl_easy_setopt(transfer->curl, CURLOPT_RANGE, range);
+    curl_easy_setopt(transfer->curl, CURLOPT_HTTPHEADER, transfer->headers);
+    log_info("  Resuming %s at byte %" CURL_FORMAT_CURL_OFF_T, job->label, transfer->offset);
+    return 1;
+}
+
+static int start_transfer(download_context_t *context, transfer_t *transfer, download_job_t *job) {
+    memset(transfer, 0, sizeof(transfer_t));
+    transfer->job = job;
+
+    if( !(transfer->curl = new_curl_handle(context, job->url, NULL, NULL, transfer->error_buffer)) ) {
+        return 0;
+    }
+    if(job->sink) {
+        curl_easy_setopt(transfer->curl, CURLOPT_WRITEFUNCTION, write_sink);
+        /* the status decides whether the body goes to the sink at all */
+        curl_easy_setopt(transfer->curl, CURLOPT_HEADERFUNCTION, read_header);
+        curl_easy_setopt(transfer->curl, CURLOPT_HEADERDATA, transfer);
+        if(job->validator) {
+            job->modified = 1;
+            transfer->headers = conditional_headers(job->validator);
+            curl_easy_setopt(transfer->curl, CURLOPT_HTTPHEADER, transfer->headers);
+        }
+    } else {
+        if(job->resume) {
+            snprintf(transfer->validator_file, PATH_MAX, "%s%s", job->dest_file, VALIDATOR_SUFFIX);
+        }
+        if(job->resume && resume_transfer(transfer)) {
+            transfer->fp = fopen(job->dest_file, "ab");
+        } else {
+            transfer->fp = fopen(job->dest_file, "wb");
+        }
+        if(!transfer->fp) {
+            log_error("  Cannot open %s for writing.", job->dest_file);
+            return 0;
+        }
+        curl_easy_setopt(transfer->curl, CURLOPT_WRITEFUNCTION, write_file);
+        curl_easy_setopt(transfer->curl, CURLOPT_HEADERFUNCTION, read_header);
+        curl_easy_setopt(transfer->curl, CURLOPT_HEADERDATA, transfer);
+    }
+    curl_easy_setopt(transfer->curl, CURLOPT_WRITEDATA, transfer);
+    curl_easy_setopt(transfer->curl, CURLOPT_PRIVATE, transfer);
+    if(CURLM_OK != curl_multi_add_handle(context->multi, transfer->curl)) {
+        log_error("  Cannot start download of %s.", job->label);
+        return 0;
+    }
+    return 1;
+}
+
+static void finish_transfer(CURLM *multi, transfer_t *transfer) {
+    if(transfer->curl) {
+        curl_multi_remove_handle(multi, transfer->curl);
+        curl_easy_cleanup(transfer->curl);
+    }
+    if(transfer->headers)
+        curl_slist_free_all(transfer->headers);
+    if(transfer->fp)
+        fclose(transfer->fp);
+    memset(transfer, 0, sizeof(transfer_t));
+}
+
+/*
+ * Run the given downloads concurrently, with at most max_parallel
+ * transfers in flight. Once any download fails, no new transfers are
+ * started, but those already running are allowed to complete. Each
+ * job's done callback, if any, runs as soon as that job is over. Returns
+ * 1 if every job succeeded; each job's ok flag says how it went.
+ */
+int download_all(download_context_t *context, download_job_t *jobs, int njobs, int max_parallel) {
+    CURLM *multi;
+    CURLMsg *msg;
+    transfer_t *transfers = NULL, *transfer;
+    download_job_t *job;
+    long status;
+    int next = 0, active = 0, running, pending, i;
+    int failed = 0;
+
+    for(i = 0; i < njobs; i++) {
+        jobs[i].ok = 0;
+    }
+    if(njobs == 0) {
+        return 1;
+    }
+    if(max_parallel < 1) {
+        max_parallel = 1;
+    }
+    if(max_parallel > njobs) {
+        max_parallel = njobs;
+    }
+
+    /* the multi handle lives as long as the context, so that any
+       connections it keeps open can be reused by later batches */
+    if(!context->multi && !(context->multi = curl_multi_init())) {
+        log_error("  Cannot initialze curl.");
+        return 0;
+    }
+    multi = context->multi;
+    if( !(transfers = (transfer_t *)calloc(max_parallel, sizeof(transfer_t))) ) {
+        log_error("Fatal error: out of memory.");
+        return 0;
+    }
+
+    do {
+        /* fill idle slots with queued jobs */
+        for(i = 0; i < max_parallel && next < njobs && !failed; i++) {
+            if(transfers[i].job) continue;
+            if(!start_transfer(context, &transfers[i], &jobs[next])) {
+                log_error("  Download of %s failed from %s", jobs[next].label, jobs[next].url);
+                finish_transfer(multi, &transfers[i]);
+                if(jobs[next].done) jobs[next].done(&jobs[next]);
+                failed = 1;
+            } else {
+                active++;
+            }
+            next++;
+        }
+
+        if(CURLM_OK != curl_multi_perform(multi, &running)) {
+            log_error("  Download failed in curl_multi_perform().");
+            failed = 1;
+            break;
+        }
+
+        /* collect finished transfers */
+        while( (msg = curl_multi_info_read(multi, &pending)) ) {
+            if(CURLMSG_DONE != msg->msg) continue;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&transfer);
+            if(transfer->offset > 0 && CURLE_OK == msg->data.result &&
+               CURLE_OK == curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &status) &&
+               416 == status)
+            {
+                /* the partial file does not fit the remote one; start over */
+                job = transfer->job;
+                log_info("  Cannot resume %s; downloading it again", job->label);
+                finish_transfer(multi, transfer);
+                unlink(job->dest_file);
+                if(!start_transfer(context, transfer, job)) {
+                    log_error("  Download of %s failed from %s", job->label, job->url);
+                    finish_transfer(multi, transfer);
+                    active--;
+                    if(job->done) job->done(job);
+                    failed = 1;
+                }
+                continue;
+            } else if(transfer->job->validator && CURLE_OK == msg->data.result &&
+                      CURLE_OK == curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &status) &&
+                      304 == status)
+            {
+                transfer->job->ok = 1;
+                transfer->job->modified = 0;
+            } else if(transfer_succeeded(transfer->curl, msg->data.result,
+                                         transfer->job->url, transfer->error_buffer) &&
+                      (!transfer->fp || 0 == fflush(transfer->fp)))
+            {
+                transfer->job->ok = 1;
+                if(transfer->validator_file[0]) {
+                    unlink(transfer->validator_file);
+                }
+                if(transfer->job->validator) {
+                    memcpy(transfer->job->validator, &transfer->validator, sizeof(download_validator_t));
+                    strlcpy(transfer->job->validator->url, transfer->job->url, PATH_MAX);
+                }
+                log_info("  Downloaded %s", transfer->job->label);
+            } else {
+                log_error("  Download of %s failed from %s", transfer->job->label, transfer->job->url);
+                failed = 1;
+            }
+            job = transfer->job;
+            finish_transfer(multi, transfer);
+            active--;
+            if(job->done && !job->done(job)) {
+                job->ok = 0;
+                failed = 1;
+            }
+        }
+
+        if(active > 0 && CURLM_OK != curl_multi_wait(multi, NULL, 0, 1000, NULL)) {
+            log_error("  Download failed in curl_multi_wait().");
+            failed = 1;
+            break;
+        }
+    } while(active > 0 || (next < njobs && !failed));
+
+    for(i = 0; i < max_parallel; i++) {
+        if( (job = transfers[i].job) ) {
+            finish_transfer(multi, &transfers[i]);
+            if(job->done) job->done(job);
+        }
+    }
+    free(transfers);
+    return !failed;
+}
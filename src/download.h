@@ -34,11 +34,63 @@
 #ifndef DOWNLOAD_H
 #define DOWNLOAD_H
 
+#include <limits.h>
+#include <curl/curl.h>
+#include "buffer.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-int download(const char *source_url, const char *dest_file, const char *proxy);
+#define MAX_VALIDATOR_SIZE 256
+
+/* HTTP cache validators identifying one version of a remote file */
+typedef struct download_validator_s {
+    char url[PATH_MAX];     /* where the file came from */
+    char etag[MAX_VALIDATOR_SIZE];
+    char last_modified[MAX_VALIDATOR_SIZE];
+} download_validator_t;
+
+/* state shared by every HTTP request made during a roll */
+typedef struct download_context_s {
+    const char *proxy;      /* optional "proxyhostname[:portnumber]" */
+    int initialized;
+    CURLSH *share;          /* DNS cache, connection pool, TLS sessions */
+    CURL *curl;             /* reused by download() */
+    CURLM *multi;           /* reused by download_all() */
+} download_context_t;
+
+/* receives downloaded data as it arrives; returns 0 to abort the transfer */
+typedef int (*download_sink_t)(void *sink_data, const void *data, size_t length);
+
+struct download_job_s;
+
+/* called as soon as a job finishes; returns 0 if the job should count as failed */
+typedef int (*download_done_t)(struct download_job_s *job);
+
+/* one file to fetch with download_all() */
+typedef struct download_job_s {
+    const char *label;      /* what is being downloaded, for error messages */
+    const char *url;
+    const char *dest_file;  /* where to save it, unless sink is set */
+    int resume;             /* continue a partial dest_file, keep it on failure */
+    download_sink_t sink;
+    void *sink_data;
+    download_validator_t *validator;    /* optional, with sink: fetch only if changed */
+    int modified;           /* set to 0 if validator still describes the file */
+    download_done_t done;   /* optional */
+    void *data;             /* for use by done */
+    int ok;                 /* set to 1 once the file is completely saved */
+} download_job_t;
+
+int download_context_init(download_context_t *context, const char *proxy);
+void download_context_cleanup(download_context_t *context);
+int download(download_context_t *context, const char *source_url, const char *dest_file);
+int download_buffer_if_modified(download_context_t *context, const char *source_url, buffer_t *buffer,
+                                download_validator_t *validator, int *modified);
+int download_all(download_context_t *context, download_job_t *jobs, int njobs, int max_parallel);
+int download_load_validator(const char *path, download_validator_t *validator);
+int download_save_validator(const char *path, const download_validator_t *validator);
 
 #ifdef __cplusplus
 }
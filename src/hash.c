@@ -0,0 +1,153 @@
+/* hash.c - String-keyed hash table.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+
+/* FNV-1a */
+unsigned long hash_string(const char *key, size_t length) {
+    unsigned long hash = 2166136261UL;
+    size_t i;
+
+    for(i = 0; i < length; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+int hash_init(hash_table_t *table, size_t expected) {
+    size_t size = 16;
+
+    while(size < 2 * expected) {
+        size *= 2;
+    }
+    table->count = 0;
+    table->size = size;
+    table->entries = (hash_entry_t *)calloc(size, sizeof(hash_entry_t));
+    return table->entries != NULL;
+}
+
+void hash_free(hash_table_t *table) {
+    size_t i;
+
+    if(table->entries) {
+        for(i = 0; i < table->size; i++) {
+            free(table->entries[i].key);
+        }
+        free(table->entries);
+    }
+    memset(table, 0, sizeof(hash_table_t));
+}
+
+static hash_entry_t *find_entry(const hash_table_t *table, const char *key, size_t length,
+                                unsigned long hash)
+{
+    size_t i = hash & (table->size - 1);
+    hash_entry_t *entry;
+
+    for(;;) {
+        entry = &table->entries[i];
+        if(!entry->key ||
+           (entry->hash == hash && !strncmp(entry->key, key, length) && !entry->key[length]))
+        {
+            return entry;
+        }
+        i = (i + 1) & (table->size - 1);
+    }
+}
+
+void *hash_get_n(const hash_table_t *table, const char *key, size_t length) {
+    hash_entry_t *entry;
+
+    if(!table->entries) {
+        return NULL;
+    }
+    entry = find_entry(table, key, length, hash_string(key, length));
+    return entry->key ? entry->value : NULL;
+}
+
+void *hash_get(const hash_table_t *table, const char *key) {
+    return hash_get_n(table, key, strlen(key));
+}
+
+static int grow(hash_table_t *table) {
+    hash_table_t bigger;
+    hash_entry_t *entry;
+    size_t i;
+
+    bigger.size = table->size * 2;
+    bigger.count = table->count;
+    if( !(bigger.entries = (hash_entry_t *)calloc(bigger.size, sizeof(hash_entry_t))) ) {
+        return 0;
+    }
+    for(i = 0; i < table->size; i++) {
+        if(table->entries[i].key) {
+            entry = find_entry(&bigger, table->entries[i].key,
+                               strlen(table->entries[i].key), table->entries[i].hash);
+            *entry = table->entries[i];
+        }
+    }
+    free(table->entries);
+    *table = bigger;
+    return 1;
+}
+
+/* add key, or replace its value; returns 0 if out of memory */
+int hash_put(hash_table_t *table, const char *key, void *value) {
+    size_t length = strlen(key);
+    unsigned long hash = hash_string(key, length);
+    hash_entry_t *entry;
+
+    if(!table->entries && !hash_init(table, 0)) {
+        return 0;
+    }
+    entry = find_entry(table, key, length, hash);
+    if(!entry->key) {
+        if(4 * (table->count + 1) > 3 * table->size) {
+            if(!grow(table)) {
+                return 0;
+            }
+            entry = find_entry(table, key, length, hash);
+        }
+        if( !(entry->key = strdup(key)) ) {
+            return 0;
+        }
+        entry->hash = hash;
+        table->count++;
+    }
+    entry->value = value;
+    return 1;
+}
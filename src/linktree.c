@@ -0,0 +1,489 @@
+/* linktree.c - Build a tree of symlinks into unpacked packages.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Implements the linking part of the Encap package format, as done by
+ * "epkg -i -a -p -R -S", without running a program per package: every
+ * file of encap/<package> gets an absolute symlink at the same place in
+ * the target tree, and directories are created as real directories so
+ * that several packages can share them. The top level encapinfo file
+ * and package scripts are not linked, and encapinfo may name further
+ * paths to exclude, or directories to link as a whole ("linkdir").
+ * What a package contains comes from its manifest, and which package
+ * put what where is kept in memory, so neither the packages nor the
+ * tree need to be looked at to find conflicts.
+ *
+ * A tree can also start out as a copy of an earlier one, less the links
+ * of packages that are gone, so that only new packages need linking.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#ifdef HAVE_UNISTD_H
+    #include <unistd.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+    #include <sys/stat.h>
+#endif
+#include "linktree.h"
+#include "manifest.h"
+#include "log.h"
+
+#define ENCAPINFO "encapinfo"
+
+/* marks directories in linktree_t.paths, which all packages may share */
+static char directory[] = "(directory)";
+
+/* what a package's encapinfo says about its paths */
+static char exclude[] = "exclude";
+static char linkdir[] = "linkdir";
+
+/* never linked from the top of a package */
+static const char *reserved_names[] = {
+    ENCAPINFO, "preinstall", "postinstall", "preremove", "postremove", NULL
+};
+
+typedef struct package_link_s {
+    const char *name;
+    hash_table_t special;       /* relative path -> exclude or linkdir */
+    int conflicts;
+} package_link_t;
+
+int linktree_open(linktree_t *tree, const char *source_dir, const char *manifest_dir,
+                  const char *target_dir)
+{
+    memset(tree, 0, sizeof(linktree_t));
+    tree->source_dir = source_dir;
+    tree->manifest_dir = manifest_dir;
+    tree->target_dir = target_dir;
+    tree->target_fd = open(target_dir, O_RDONLY | O_DIRECTORY);
+    if(tree->target_fd < 0) {
+        log_error("Cannot open %s: %s", target_dir, strerror(errno));
+        return 0;
+    }
+    if(!hash_init(&tree->paths, 4096) || !hash_init(&tree->names, 256)) {
+        log_error("Fatal error: out of memory.");
+        linktree_close(tree);
+        return 0;
+    }
+    return 1;
+}
+
+void linktree_close(linktree_t *tree) {
+    int i;
+
+    if(tree->target_fd >= 0)
+        close(tree->target_fd);
+    hash_free(&tree->paths);
+    hash_free(&tree->names);
+    for(i = 0; i < tree->npackages; i++) {
+        free(tree->packages[i]);
+    }
+    free(tree->packages);
+    memset(tree, 0, sizeof(linktree_t));
+    tree->target_fd = -1;
+}
+
+/* one copy of each package name, for use as a value in paths */
+static const char *intern_package(linktree_t *tree, const char *name) {
+    char **packages, *copy;
+
+    if( (copy = (char *)hash_get(&tree->names, name)) ) {
+        return copy;
+    }
+    if( !(packages = (char **)realloc(tree->packages, (tree->npackages + 1) * sizeof(char *))) ) {
+        return NULL;
+    }
+    tree->packages = packages;
+    if( !(copy = strdup(name)) ) {
+        return NULL;
+    }
+    if(!hash_put(&tree->names, name, copy)) {
+        free(copy);
+        return NULL;
+    }
+    packages[tree->npackages++] = copy;
+    return copy;
+}
+
+/* read "exclude" and "linkdir" directives from encap/<package>/encapinfo */
+static int read_encapinfo(package_link_t *package, const char *path) {
+    FILE *fp;
+    char line[PATH_MAX], *word, *save;
+    void *kind;
+    int i;
+
+    for(i = 0; reserved_names[i] != NULL; i++) {
+        if(!hash_put(&package->special, reserved_names[i], exclude)) {
+            return 0;
+        }
+    }
+    if( !(fp = fopen(path, "r")) ) {
+        return ENOENT == errno;
+    }
+    while(fgets(line, sizeof(line), fp)) {
+        if( !(word = strtok_r(line, " \t\r\n", &save)) ) {
+            continue;
+        }
+        if(!strcmp(word, "exclude")) {
+            kind = exclude;
+        } else if(!strcmp(word, "linkdir")) {
+            kind = linkdir;
+        } else {
+            continue;   /* prerequisites and scripts are not roll's business */
+        }
+        while( (word = strtok_r(NULL, " \t\r\n", &save)) ) {
+            while(word[0] == '/') {
+                word++;
+            }
+            if(word[0] && !hash_put(&package->special, word, kind)) {
+                fclose(fp);
+                return 0;
+            }
+        }
+    }
+    fclose(fp);
+    return 1;
+}
+
+static void conflict(package_link_t *package, const char *path, const char *owner) {
+    log_error("  Conflict: %s of %s is already provided by %s", path, package->name, owner);
+    package->conflicts++;
+}
+
+/* link encap/<package> into the tree; fails if it clashes with what is there */
+int linktree_add(linktree_t *tree, const char *package_name) {
+    package_link_t package;
+    manifest_t manifest;
+    const manifest_entry_t *entry, *end;
+    const char *owner, *skip = NULL;
+    void *special;
+    char source[PATH_MAX], manifest_path[PATH_MAX];
+    size_t skip_length = 0;
+    int is_dir, n;
+    int ok = 0;
+
+    memset(&package, 0, sizeof(package_link_t));
+    memset(&manifest, 0, sizeof(manifest_t));
+    if( !(package.name = intern_package(tree, package_name)) ) {
+        log_error("Fatal error: out of memory.");
+        return 0;
+    }
+
+    n = snprintf(source, PATH_MAX, "%s/%s/%s", tree->source_dir, package_name, ENCAPINFO);
+    if(n >= PATH_MAX ||
+       snprintf(manifest_path, PATH_MAX, "%s/%s", tree->manifest_dir, package_name) >= PATH_MAX)
+    {
+        log_error("  Path name too long for %s", package_name);
+        return 0;
+    }
+    if(!hash_init(&package.special, 0) || !read_encapinfo(&package, source)) {
+        log_error("  Cannot read %s: %s", source, strerror(errno));
+        goto error;
+    }
+
+    /* source holds "<source_dir>/<package>", and each link adds a relative path */
+    n -= strlen(ENCAPINFO) + 1;
+    source[n] = '\0';
+    if(!manifest_load(&manifest, manifest_path, source)) {
+        goto error;
+    }
+
+    for(entry = manifest.entries, end = entry + manifest.count; entry < end; entry++) {
+        /* the contents of a directory follow it; skip them along with it */
+        if(skip && !strncmp(entry->path, skip, skip_length) && entry->path[skip_length] == '/') {
+            continue;
+        }
+        skip = NULL;
+        is_dir = MANIFEST_DIRECTORY == entry->type;
+        special = hash_get(&package.special, entry->path);
+        owner = (const char *)hash_get(&tree->paths, entry->path);
+        if(is_dir && (exclude == special || linkdir == special || (owner && directory != owner))) {
+            skip = entry->path;
+            skip_length = strlen(skip);
+        }
+        if(exclude == special) {
+            continue;
+        }
+
+        if(is_dir && linkdir != special) {
+            /* a directory shared with other packages */
+            if(owner && directory != owner) {
+                conflict(&package, entry->path, owner);
+            } else if(!owner) {
+                if(0 != mkdirat(tree->target_fd, entry->path, 0755) && EEXIST != errno) {
+                    log_error("  Cannot create %s/%s: %s", tree->target_dir, entry->path, strerror(errno));
+                    goto error;
+                }
+                if(!hash_put(&tree->paths, entry->path, directory)) {
+                    log_error("Fatal error: out of memory.");
+                    goto error;
+                }
+            }
+            continue;
+        }
+
+        /* anything else is linked, and belongs to this package alone */
+        if(owner) {
+            conflict(&package, entry->path, directory == owner ? "a directory" : owner);
+            continue;
+        }
+        if(n + 1 + strlen(entry->path) >= PATH_MAX) {
+            log_error("  Path name too long in %s", package_name);
+            goto error;
+        }
+        source[n] = '/';
+        strcpy(source + n + 1, entry->path);
+        if(0 != symlinkat(source, tree->target_fd, entry->path)) {
+            if(EEXIST == errno) {
+                conflict(&package, entry->path, "an existing file");
+                continue;
+            }
+            log_error("  Cannot link %s/%s: %s", tree->target_dir, entry->path, strerror(errno));
+            goto error;
+        }
+        if(!hash_put(&tree->paths, entry->path, (void *)package.name)) {
+            log_error("Fatal error: out of memory.");
+            goto error;
+        }
+    }
+    ok = 0 == package.conflicts;
+ error:
+    manifest_free(&manifest);
+    hash_free(&package.special);
+    return ok;
+}
+
+/* copy the directories and package links of one directory of an earlier tree */
+static int clone_directory(linktree_t *tree, const hash_table_t *keep,
+                           int from_fd, int target_fd, char *path, size_t length)
+{
+    DIR *dp;
+    struct dirent *entry;
+    struct stat st;
+    const char *owner, *package;
+    char target[PATH_MAX];
+    size_t prefix = strlen(tree->source_dir), name_length;
+    ssize_t target_length;
+    char separator;
+    int type, child_from_fd, child_target_fd, n;
+    int ok = 1;
+
+    if( !(dp = fdopendir(from_fd)) ) {
+        close(from_fd);
+        close(target_fd);
+        return 0;
+    }
+    while(ok && (entry = readdir(dp))) {
+        if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+        n = snprintf(path + length, PATH_MAX - length, "%s%s", length ? "/" : "", entry->d_name);
+        if(n >= (int)(PATH_MAX - length)) {
+            ok = 0;
+            break;
+        }
+        type = entry->d_type;
+        if(DT_UNKNOWN == type) {
+            if(0 != fstatat(dirfd(dp), entry->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+        }
+
+        if(DT_DIR == type) {
+            if((0 != mkdirat(target_fd, entry->d_name, 0755) && EEXIST != errno) ||
+               !hash_put(&tree->paths, path, directory))
+            {
+                log_error("  Cannot create %s/%s: %s", tree->target_dir, path, strerror(errno));
+                ok = 0;
+                break;
+            }
+            child_from_fd = openat(dirfd(dp), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            child_target_fd = openat(target_fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if(child_from_fd < 0 || child_target_fd < 0) {
+                log_error("  Cannot open %s: %s", path, strerror(errno));
+                if(child_from_fd >= 0) close(child_from_fd);
+                if(child_target_fd >= 0) close(child_target_fd);
+                ok = 0;
+                break;
+            }
+            ok = clone_directory(tree, keep, child_from_fd, child_target_fd, path, length + n);
+            continue;
+        }
+        if(DT_LNK != type) {
+            continue;   /* not a package link, e.g. generated config */
+        }
+
+        /* keep links into "<source_dir>/<package>/" for packages that stay */
+        target_length = readlinkat(dirfd(dp), entry->d_name, target, sizeof(target) - 1);
+        if(target_length < 0 || (size_t)target_length <= prefix + 1 ||
+           strncmp(target, tree->source_dir, prefix) || target[prefix] != '/')
+        {
+            continue;
+        }
+        target[target_length] = '\0';
+        package = target + prefix + 1;
+        name_length = strcspn(package, "/");
+        if(!hash_get_n(keep, package, name_length)) {
+            continue;
+        }
+        separator = package[name_length];
+        target[prefix + 1 + name_length] = '\0';
+        owner = intern_package(tree, package);
+        target[prefix + 1 + name_length] = separator;
+
+        /* a hard link to the old symlink saves creating a new inode */
+        if(0 != linkat(dirfd(dp), entry->d_name, target_fd, entry->d_name, 0) &&
+           0 != symlinkat(target, target_fd, entry->d_name))
+        {
+            log_error("  Cannot link %s/%s: %s", tree->target_dir, path, strerror(errno));
+            ok = 0;
+            break;
+        }
+        if(!owner || !hash_put(&tree->paths, path, (void *)owner)) {
+            log_error("Fatal error: out of memory.");
+            ok = 0;
+            break;
+        }
+    }
+    path[length] = '\0';
+    closedir(dp);
+    close(target_fd);
+    return ok;
+}
+
+/*
+ * Start the tree as a copy of from_dir holding only the links of the
+ * packages named in keep; directories are copied as they are, and
+ * linktree_prune() can drop those left empty once all is linked.
+ */
+int linktree_clone(linktree_t *tree, const char *from_dir, const hash_table_t *keep) {
+    char path[PATH_MAX] = "";
+    int from_fd, target_fd;
+
+    if( (from_fd = open(from_dir, O_RDONLY | O_DIRECTORY)) < 0 ) {
+        log_error("Cannot open %s: %s", from_dir, strerror(errno));
+        return 0;
+    }
+    if( (target_fd = dup(tree->target_fd)) < 0 ) {
+        close(from_fd);
+        return 0;
+    }
+    if(!clone_directory(tree, keep, from_fd, target_fd, path, 0)) {
+        log_error("Cannot copy symlink tree %s", from_dir);
+        return 0;
+    }
+    return 1;
+}
+
+/* remove directories left empty that no package has; returns 1 if this one is now empty */
+static int prune_directory(linktree_t *tree, const hash_table_t *needed,
+                           int fd, char *path, size_t length, int *removed)
+{
+    DIR *dp;
+    struct dirent *entry;
+    int child_fd, n;
+    int empty = 1;
+
+    if( !(dp = fdopendir(fd)) ) {
+        close(fd);
+        return 0;
+    }
+    while( (entry = readdir(dp)) ) {
+        if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+        n = snprintf(path + length, PATH_MAX - length, "%s%s", length ? "/" : "", entry->d_name);
+        if(n >= (int)(PATH_MAX - length) || directory != hash_get(&tree->paths, path)) {
+            empty = 0;  /* a link, or something that was not cloned */
+            continue;
+        }
+        child_fd = openat(dirfd(dp), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if(child_fd >= 0 && prune_directory(tree, needed, child_fd, path, length + n, removed) &&
+           !hash_get(needed, path) &&
+           0 == unlinkat(dirfd(dp), entry->d_name, AT_REMOVEDIR))
+        {
+            hash_put(&tree->paths, path, NULL);
+            (*removed)++;
+        } else {
+            empty = 0;
+        }
+    }
+    path[length] = '\0';
+    closedir(dp);
+    return empty;
+}
+
+/* drop directories that only packages no longer in the tree needed */
+int linktree_prune(linktree_t *tree) {
+    hash_table_t needed;
+    manifest_t manifest;
+    char path[PATH_MAX] = "", manifest_path[PATH_MAX];
+    size_t i;
+    int p, fd, ok, removed = 0;
+
+    /* directories of the packages in the tree stay, even if empty */
+    if(!hash_init(&needed, tree->paths.count)) {
+        return 0;
+    }
+    for(p = 0; p < tree->npackages; p++) {
+        snprintf(path, PATH_MAX, "%s/%s", tree->source_dir, tree->packages[p]);
+        snprintf(manifest_path, PATH_MAX, "%s/%s", tree->manifest_dir, tree->packages[p]);
+        if(!manifest_load(&manifest, manifest_path, path)) {
+            hash_free(&needed);
+            return 0;
+        }
+        for(i = 0, ok = 1; ok && i < manifest.count; i++) {
+            ok = MANIFEST_DIRECTORY != manifest.entries[i].type ||
+                 hash_put(&needed, manifest.entries[i].path, directory);
+        }
+        manifest_free(&manifest);
+        if(!ok) {
+            hash_free(&needed);
+            return 0;
+        }
+    }
+
+    path[0] = '\0';
+    if( (fd = dup(tree->target_fd)) >= 0 ) {
+        prune_directory(tree, &needed, fd, path, 0, &removed);
+    }
+    hash_free(&needed);
+    return removed;
+}
@@ -0,0 +1,67 @@
+/* linktree.h - Build a tree of symlinks into unpacked packages.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LINKTREE_H
+#define LINKTREE_H
+
+#include <limits.h>
+#include "hash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a symlink tree being built, linking packages in the manner of epkg */
+typedef struct linktree_s {
+    const char *source_dir;     /* where packages are unpacked */
+    const char *manifest_dir;   /* where their manifests are kept */
+    const char *target_dir;     /* where their links go */
+    int target_fd;
+    hash_table_t paths;         /* relative path -> owning package name */
+    hash_table_t names;         /* package name -> its entry in packages */
+    char **packages;            /* names of packages linked so far */
+    int npackages;
+} linktree_t;
+
+int linktree_open(linktree_t *tree, const char *source_dir, const char *manifest_dir,
+                  const char *target_dir);
+int linktree_add(linktree_t *tree, const char *package);
+int linktree_clone(linktree_t *tree, const char *from_dir, const hash_table_t *keep);
+int linktree_prune(linktree_t *tree);
+void linktree_close(linktree_t *tree);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef LINKTREE_H */
@@ -49,6 +49,7 @@
 #include <errno.h>
 #include <time.h>
 #include <assert.h>
+#include <pthread.h>
 #include "log.h"
 
 #define LOG_FILE_FORMAT "roll-%04d%02d%02dT%02d%02d%02d.log"
@@ -57,7 +58,11 @@
 static FILE *logfile = NULL;
 static char log_filename[PATH_MAX] = "";
 
-static void log_timestamp() {
+/* package extraction logs from worker threads; keep lines whole */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* stamp the line about to be written to stream, and to the log file */
+static void log_timestamp(FILE *stream) {
     time_t t;
     struct tm ltm;
 
@@ -74,7 +79,7 @@ static void log_timestamp() {
                 ltm.tm_min,
                 ltm.tm_sec,
                 ltm.tm_zone);
-    fprintf(stdout,
+    fprintf(stream,
             "[%04d-%02d-%02d %02d:%02d:%02d %s] ",
             ltm.tm_year + 1900,
             ltm.tm_mon + 1,
@@ -83,7 +88,7 @@ static void log_timestamp() {
             ltm.tm_min,
             ltm.tm_sec,
             ltm.tm_zone);
-    fflush(stdout);
+    fflush(stream);
 }
 
 int log_init(char *filename, char *linkname) {
@@ -184,6 +189,7 @@ void log_close() {
 
 void log_message(const char *format, ...) {
     va_list ap, ap2;
+    pthread_mutex_lock(&log_lock);
     va_start(ap, format);
     va_copy(ap2, ap);
     if(logfile)
@@ -191,11 +197,13 @@ void log_message(const char *format, ...) {
     vfprintf(stdout, format, ap2);
     va_end(ap);
     va_end(ap2);
+    pthread_mutex_unlock(&log_lock);
 }
 
 void log_info(const char *format, ...) {
     va_list ap, ap2;
-    log_timestamp();
+    pthread_mutex_lock(&log_lock);
+    log_timestamp(stdout);
     va_start(ap, format);
     va_copy(ap2, ap);
     if(logfile) {
@@ -207,11 +215,13 @@ void log_info(const char *format, ...) {
     fflush(stdout);
     va_end(ap);
     va_end(ap2);
+    pthread_mutex_unlock(&log_lock);
 }
 
 void log_error(const char *format, ...) {
     va_list ap, ap2;
-    log_timestamp();
+    pthread_mutex_lock(&log_lock);
+    log_timestamp(stderr);
     va_start(ap, format);
     va_copy(ap2, ap);
     if(logfile) {
@@ -222,12 +232,14 @@ void log_error(const char *format, ...) {
     fprintf(stderr, "\n");
     va_end(ap);
     va_end(ap2);
+    pthread_mutex_unlock(&log_lock);
 }
 
 void log_header(const char *message, int failsafe_mode) {
     char buf[256];
     int i, length;
 
+    pthread_mutex_lock(&log_lock);
     if(failsafe_mode) {
         length = snprintf(buf, 256, "== FAILSAFE MODE %s ", message);
     } else {
@@ -250,5 +262,6 @@ void log_header(const char *message, int failsafe_mode) {
         fprintf(logfile, "\n");
     fprintf(stdout, "\n");
     fflush(stdout);
+    pthread_mutex_unlock(&log_lock);
 }
 
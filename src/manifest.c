@@ -0,0 +1,318 @@
+/* manifest.c - Lists of what an unpacked package contains.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * An unpacked package never changes, so what it contains is recorded
+ * once, when it is unpacked, and linking it later needs to read just
+ * that one file instead of every directory of the package. The file is
+ * kept outside the package, so that epkg never links it.
+ *
+ * The file is "ROLLMAN1", a 32 bit entry count, then per entry a type
+ * byte, a 16 bit path length and the path, numbers little endian.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#ifdef HAVE_UNISTD_H
+    #include <unistd.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+    #include <sys/stat.h>
+#endif
+#ifdef HAVE_LIMITS_H
+    #include <limits.h>
+#endif
+#include "manifest.h"
+#include "log.h"
+
+#define MANIFEST_MAGIC "ROLLMAN1"
+#define MAGIC_SIZE 8
+
+/* manifest under construction */
+typedef struct builder_s {
+    manifest_entry_t *entries;
+    size_t count, allocated;
+} builder_t;
+
+void manifest_free(manifest_t *manifest) {
+    free(manifest->entries);
+    free(manifest->paths);
+    memset(manifest, 0, sizeof(manifest_t));
+}
+
+/* order paths by component, so "a/b" comes before "a-b" and right after "a" */
+static int compare_paths(const char *a, const char *b) {
+    unsigned char ca, cb;
+
+    for(;; a++, b++) {
+        ca = (*a == '/') ? 1 : (unsigned char)*a;
+        cb = (*b == '/') ? 1 : (unsigned char)*b;
+        if(ca != cb || ca == '\0') {
+            return (int)ca - (int)cb;
+        }
+    }
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return compare_paths(((const manifest_entry_t *)a)->path, ((const manifest_entry_t *)b)->path);
+}
+
+static int add_entry(builder_t *builder, char type, const char *path) {
+    manifest_entry_t *entries;
+
+    if(builder->count == builder->allocated) {
+        builder->allocated = builder->allocated ? 2 * builder->allocated : 256;
+        entries = (manifest_entry_t *)realloc(builder->entries,
+                                              builder->allocated * sizeof(manifest_entry_t));
+        if(!entries) {
+            return 0;
+        }
+        builder->entries = entries;
+    }
+    if( !(builder->entries[builder->count].path = strdup(path)) ) {
+        return 0;
+    }
+    builder->entries[builder->count++].type = type;
+    return 1;
+}
+
+static int walk_directory(builder_t *builder, int fd, char *path, size_t length) {
+    DIR *dp;
+    struct dirent *entry;
+    struct stat st;
+    int type, child_fd, n;
+    int ok = 1;
+
+    if( !(dp = fdopendir(fd)) ) {
+        close(fd);
+        return 0;
+    }
+    while(ok && (entry = readdir(dp))) {
+        if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+        n = snprintf(path + length, PATH_MAX - length, "%s%s", length ? "/" : "", entry->d_name);
+        if(n >= (int)(PATH_MAX - length)) {
+            ok = 0;
+            break;
+        }
+        type = entry->d_type;
+        if(DT_UNKNOWN == type) {
+            if(0 != fstatat(dirfd(dp), entry->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+                ok = 0;
+                break;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+        }
+        if(DT_DIR == type) {
+            ok = add_entry(builder, MANIFEST_DIRECTORY, path) &&
+                 (child_fd = openat(dirfd(dp), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) >= 0 &&
+                 walk_directory(builder, child_fd, path, length + n);
+        } else {
+            ok = add_entry(builder, DT_LNK == type ? MANIFEST_SYMLINK : MANIFEST_FILE, path);
+        }
+    }
+    path[length] = '\0';
+    closedir(dp);
+    return ok;
+}
+
+/* move the builder's strings into one block, the way manifest_read() leaves them */
+static int finish_manifest(manifest_t *manifest, builder_t *builder) {
+    size_t i, size = 0;
+    char *p;
+
+    for(i = 0; i < builder->count; i++) {
+        size += strlen(builder->entries[i].path) + 1;
+    }
+    if( !(manifest->paths = (char *)malloc(size ? size : 1)) ) {
+        return 0;
+    }
+    for(i = 0, p = manifest->paths; i < builder->count; i++) {
+        size = strlen(builder->entries[i].path) + 1;
+        memcpy(p, builder->entries[i].path, size);
+        free((char *)builder->entries[i].path);
+        builder->entries[i].path = p;
+        p += size;
+    }
+    manifest->entries = builder->entries;
+    manifest->count = builder->count;
+    memset(builder, 0, sizeof(builder_t));
+    return 1;
+}
+
+/* list what is in package_dir by looking at it */
+int manifest_build(manifest_t *manifest, const char *package_dir) {
+    builder_t builder;
+    char path[PATH_MAX] = "";
+    size_t i;
+    int fd;
+
+    memset(manifest, 0, sizeof(manifest_t));
+    memset(&builder, 0, sizeof(builder_t));
+    if( (fd = open(package_dir, O_RDONLY | O_DIRECTORY)) < 0 ) {
+        log_error("  Cannot open %s: %s", package_dir, strerror(errno));
+        return 0;
+    }
+    if(walk_directory(&builder, fd, path, 0)) {
+        qsort(builder.entries, builder.count, sizeof(manifest_entry_t), compare_entries);
+        if(finish_manifest(manifest, &builder)) {
+            return 1;
+        }
+    }
+    log_error("  Cannot list the contents of %s", package_dir);
+    for(i = 0; i < builder.count; i++) {
+        free((char *)builder.entries[i].path);
+    }
+    free(builder.entries);
+    return 0;
+}
+
+/* read the manifest saved at path; 0 if there is none or it is damaged */
+int manifest_read(manifest_t *manifest, const char *path) {
+    FILE *fp;
+    struct stat st;
+    unsigned char *data = NULL, *p, *end;
+    size_t i, count, length;
+    char *out;
+
+    memset(manifest, 0, sizeof(manifest_t));
+    if( !(fp = fopen(path, "rb")) ) {
+        return 0;
+    }
+    if(0 != fstat(fileno(fp), &st) || st.st_size < MAGIC_SIZE + 4 ||
+       !(data = (unsigned char *)malloc(st.st_size)) ||
+       1 != fread(data, st.st_size, 1, fp) ||
+       memcmp(data, MANIFEST_MAGIC, MAGIC_SIZE))
+    {
+        goto error;
+    }
+    p = data + MAGIC_SIZE;
+    end = data + st.st_size;
+    count = p[0] | (p[1] << 8) | (p[2] << 16) | ((size_t)p[3] << 24);
+    p += 4;
+
+    /* every entry is at least three bytes, so count cannot be huge */
+    if(count > (size_t)(end - p) / 3 ||
+       !(manifest->entries = (manifest_entry_t *)malloc((count ? count : 1) * sizeof(manifest_entry_t))) ||
+       !(manifest->paths = (char *)malloc(end - p)))
+    {
+        goto error;
+    }
+    out = manifest->paths;
+    for(i = 0; i < count; i++) {
+        if(end - p < 3) {
+            goto error;
+        }
+        length = p[1] | (p[2] << 8);
+        if(length == 0 || (size_t)(end - p - 3) < length) {
+            goto error;
+        }
+        manifest->entries[i].type = (char)p[0];
+        manifest->entries[i].path = out;
+        memcpy(out, p + 3, length);
+        out[length] = '\0';
+        out += length + 1;
+        p += 3 + length;
+    }
+    manifest->count = count;
+    free(data);
+    fclose(fp);
+    return 1;
+ error:
+    free(data);
+    fclose(fp);
+    manifest_free(manifest);
+    return 0;
+}
+
+/* save the manifest at path, replacing any older one in one step */
+int manifest_write(const manifest_t *manifest, const char *path) {
+    FILE *fp;
+    unsigned char header[4];
+    char temp_path[PATH_MAX];
+    size_t i, length;
+    int ok, fd;
+
+    /* a temp name of its own, as two threads may save the same manifest at once */
+    if(snprintf(temp_path, PATH_MAX, "%s.XXXXXX", path) >= PATH_MAX ||
+       (fd = mkstemp(temp_path)) < 0)
+    {
+        return 0;
+    }
+    if( !(fp = fdopen(fd, "wb")) ) {
+        close(fd);
+        unlink(temp_path);
+        return 0;
+    }
+    header[0] = manifest->count & 0xff;
+    header[1] = (manifest->count >> 8) & 0xff;
+    header[2] = (manifest->count >> 16) & 0xff;
+    header[3] = (manifest->count >> 24) & 0xff;
+    ok = 1 == fwrite(MANIFEST_MAGIC, MAGIC_SIZE, 1, fp) &&
+         1 == fwrite(header, 4, 1, fp);
+    for(i = 0; ok && i < manifest->count; i++) {
+        length = strlen(manifest->entries[i].path);
+        header[0] = (unsigned char)manifest->entries[i].type;
+        header[1] = length & 0xff;
+        header[2] = (length >> 8) & 0xff;
+        ok = 1 == fwrite(header, 3, 1, fp) &&
+             1 == fwrite(manifest->entries[i].path, length, 1, fp);
+    }
+    ok = (0 == fclose(fp)) && ok;
+    if(!ok || 0 != rename(temp_path, path)) {
+        unlink(temp_path);
+        return 0;
+    }
+    chmod(path, 0644); /* ignore error */
+    return 1;
+}
+
+/* read the manifest of package_dir saved at path, making it first if there is none yet */
+int manifest_load(manifest_t *manifest, const char *path, const char *package_dir) {
+    if(manifest_read(manifest, path)) {
+        return 1;
+    }
+    if(!manifest_build(manifest, package_dir)) {
+        return 0;
+    }
+    if(!manifest_write(manifest, path)) {
+        log_info("  Cannot save a manifest to %s; ignoring error", path);
+    }
+    return 1;
+}
@@ -0,0 +1,69 @@
+/* manifest.h - Lists of what an unpacked package contains.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MANIFEST_DIRECTORY 'd'
+#define MANIFEST_FILE      'f'
+#define MANIFEST_SYMLINK   'l'
+
+typedef struct manifest_entry_s {
+    char type;              /* MANIFEST_DIRECTORY, _FILE or _SYMLINK */
+    const char *path;       /* relative to the package directory */
+} manifest_entry_t;
+
+/* entries are sorted so that each directory is directly followed by its contents */
+typedef struct manifest_s {
+    manifest_entry_t *entries;
+    size_t count;
+    char *paths;            /* storage for the entries' paths */
+} manifest_t;
+
+int manifest_build(manifest_t *manifest, const char *package_dir);
+int manifest_read(manifest_t *manifest, const char *path);
+int manifest_write(const manifest_t *manifest, const char *path);
+int manifest_load(manifest_t *manifest, const char *path, const char *package_dir);
+void manifest_free(manifest_t *manifest);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef MANIFEST_H */
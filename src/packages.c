@@ -50,34 +50,36 @@
 #include <ctype.h>
 #include <limits.h>
 #include <errno.h>
+#include <pthread.h>
+#if !defined(HAVE_STRLCPY) && !HAVE_DECL_STRLCPY
+    #include "strlcpy.h"
+#endif
 #include "packages.h"
 #include "log.h"
-#include "spawn.h"
+#include "run.h"
 #include "download.h"
 #include "rmrf.h"
+#include "trash.h"
+#include "snapshot.h"
+#include "untar.h"
+#include "linktree.h"
+#include "manifest.h"
 
 static int extract_package(const char *package_archive,
-                           const char *extract_dir)
+                           const char *extract_dir,
+                           int use_system_tar)
 {
-    char cwd[PATH_MAX];
     int exit_code;
 
-    if(!getcwd(cwd, PATH_MAX)) {
-        log_error("  Could not get current working directory");
-        return 0;
-    }
-
-    if(0 != chdir(extract_dir)) {
-        log_error("  Failed to change directory to %s: %s",
-                  extract_dir,
-                  strerror(errno));
-        return 0;
+    if(!use_system_tar) {
+        return untar_file(package_archive, extract_dir);
     }
 
     exit_code =
         run_command("/bin/tar",
                     "xzf",              /* eXtract gZipped File */
                     package_archive,
+                    "-C", extract_dir,  /* into the temp directory */
                     "-p",               /* preserve permissions */
                     "-o",               /* strip ownership */
                     NULL                /* no more args */
@@ -87,119 +89,378 @@ static int extract_package(const char *package_archive,
         return 0;
     }
 
-    if(0 != chdir(cwd)) {
-        log_error("  Failed to change directory to %s: %s",
-                  cwd,
+    return 1;
+}
+
+struct extract_pool_s;
+
+/* paths used while fetching and unpacking a single package */
+typedef struct package_fetch_s {
+    const package_spec_t *package;
+    int needs_download;
+    const char *package_temp_dir;
+    untar_t *untar;         /* streaming extraction in progress */
+    struct extract_pool_s *pool;
+    int streamed;           /* unpacked during download */
+    char downtemp[PATH_MAX],
+         down[PATH_MAX],
+         temp[PATH_MAX],
+         final[PATH_MAX],
+         manifest[PATH_MAX],
+         url[PATH_MAX];
+} package_fetch_t;
+
+/* extraction workers, fed with tarballs as their downloads complete */
+typedef struct extract_pool_s {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    package_fetch_t **queue;
+    int head, tail;
+    int closed;
+    int failed;
+    int extracted;
+    int system_tar;
+    pthread_t *threads;
+    int nthreads;
+} extract_pool_t;
+
+/* called from extraction and download workers, which already run one per package */
+static int rmrf_if_exists(const char *path) {
+    struct stat st;
+
+    if(0 != lstat(path, &st)) {
+        return ENOENT == errno;
+    }
+    return rmrf_parallel(path, 1, NULL);
+}
+
+/* record what an unpacked package contains, so that linking it need not look */
+static void save_manifest(const package_fetch_t *fetch) {
+    manifest_t manifest;
+
+    if(!manifest_build(&manifest, fetch->temp)) {
+        unlink(fetch->manifest); /* made when first needed, then */
+        return;
+    }
+    if(!manifest_write(&manifest, fetch->manifest)) {
+        log_info("  Cannot save a manifest to %s; ignoring error", fetch->manifest);
+        unlink(fetch->manifest); /* ignore error */
+    }
+    manifest_free(&manifest);
+}
+
+/* unpack a downloaded tarball and move the result into the stow directory */
+static int unpack_package(package_fetch_t *fetch, int system_tar) {
+    log_info("Extracting %s", fetch->package->package_name);
+    if(!rmrf_if_exists(fetch->temp)) {
+        log_error("  Cannot remove stale directory %s", fetch->temp);
+        return 0;
+    }
+    if(!extract_package(fetch->down, fetch->package_temp_dir, system_tar)) {
+        rmrf_if_exists(fetch->temp); /* ignore error */
+        return 0;
+    }
+
+    /* remove original download */
+    unlink(fetch->down); /* ignore error */
+
+    save_manifest(fetch);
+
+    /* rename extracted copy */
+    if(0 != rename(fetch->temp, fetch->final)) {
+        log_error("  Failed to rename %s to %s: %s",
+                  fetch->temp,
+                  fetch->final,
                   strerror(errno));
         return 0;
     }
+    return 1;
+}
+
+static void *extract_worker(void *arg) {
+    extract_pool_t *pool = (extract_pool_t *)arg;
+    package_fetch_t *fetch;
+    int skip, ok;
+
+    for(;;) {
+        pthread_mutex_lock(&pool->lock);
+        while(pool->head == pool->tail && !pool->closed) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        if(pool->head == pool->tail) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        fetch = pool->queue[pool->head++];
+        skip = pool->failed;
+        pthread_mutex_unlock(&pool->lock);
+
+        /* once anything has failed, the roll is over; don't bother */
+        if(skip) continue;
+
+        ok = unpack_package(fetch, pool->system_tar);
+        pthread_mutex_lock(&pool->lock);
+        if(ok) {
+            pool->extracted++;
+        } else {
+            pool->failed = 1;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+static int start_extract_pool(extract_pool_t *pool, int nthreads, int queue_size, int system_tar) {
+    int rc = 0;
 
+    memset(pool, 0, sizeof(extract_pool_t));
+    pool->system_tar = system_tar;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+
+    pool->queue = (package_fetch_t **)calloc(queue_size ? queue_size : 1, sizeof(package_fetch_t *));
+    pool->threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    if(!pool->queue || !pool->threads) {
+        log_error("Fatal error: out of memory.");
+        return 0;
+    }
+    for(pool->nthreads = 0; pool->nthreads < nthreads; pool->nthreads++) {
+        if(0 != (rc = pthread_create(&pool->threads[pool->nthreads], NULL, extract_worker, pool))) {
+            break;
+        }
+    }
+    if(pool->nthreads == 0) {
+        log_error("Cannot start package extraction threads: %s", strerror(rc));
+        return 0;
+    }
     return 1;
 }
 
-int download_packages(const package_spec_t *package_list,
+static void queue_extraction(extract_pool_t *pool, package_fetch_t *fetch) {
+    pthread_mutex_lock(&pool->lock);
+    pool->queue[pool->tail++] = fetch;
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* wait for queued extractions to finish; returns 1 if all went well */
+static int stop_extract_pool(extract_pool_t *pool) {
+    int i;
+
+    if(pool->nthreads > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pool->closed = 1;
+        pthread_cond_broadcast(&pool->ready);
+        pthread_mutex_unlock(&pool->lock);
+        for(i = 0; i < pool->nthreads; i++) {
+            pthread_join(pool->threads[i], NULL);
+        }
+    }
+    pthread_cond_destroy(&pool->ready);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->queue);
+    free(pool->threads);
+    pool->queue = NULL;
+    pool->threads = NULL;
+    pool->nthreads = 0;
+    return !pool->failed;
+}
+
+/* download sink for streaming mode: unpack the tarball as it arrives */
+static int stream_package(void *sink_data, const void *data, size_t length) {
+    package_fetch_t *fetch = (package_fetch_t *)sink_data;
+
+    if(!fetch->untar &&
+       !(fetch->untar = untar_open(fetch->package_temp_dir, (char *)fetch->package->package_name)))
+    {
+        return 0;
+    }
+    return untar_write(fetch->untar, data, length);
+}
+
+/* finish a streamed package: move it into place, or clean up after it */
+static int finish_streamed_package(package_fetch_t *fetch, int downloaded) {
+    untar_t *untar = fetch->untar;
+
+    fetch->untar = NULL;
+    if(downloaded && !untar) {
+        log_error("  Archive %s is empty", fetch->package->package_name);
+        downloaded = 0;
+    } else if(downloaded) {
+        if( (downloaded = untar_finish(untar)) ) {
+            save_manifest(fetch);
+        }
+    } else if(untar) {
+        untar_abort(untar);
+    }
+
+    if(downloaded && 0 != rename(fetch->temp, fetch->final)) {
+        log_error("  Failed to rename %s to %s: %s",
+                  fetch->temp,
+                  fetch->final,
+                  strerror(errno));
+        downloaded = 0;
+    }
+    if(!downloaded && !rmrf_if_exists(fetch->temp)) {
+        log_info("  Cannot remove directory %s; ignoring error", fetch->temp);
+    }
+    return downloaded;
+}
+
+/* called as each download completes, while the others are still running */
+static int package_downloaded(download_job_t *job) {
+    package_fetch_t *fetch = (package_fetch_t *)job->data;
+
+    if(job->sink) {
+        fetch->streamed = finish_streamed_package(fetch, job->ok);
+        return fetch->streamed;
+    }
+    if(!job->ok) {
+        return 0;  /* keep what arrived; the next roll resumes from there */
+    }
+    if(0 != rename(fetch->downtemp, fetch->down)) {
+        log_error("  Failed to rename %s to %s: %s",
+                  fetch->downtemp, fetch->down, strerror(errno));
+        unlink(fetch->downtemp);
+        return 0;
+    }
+    queue_extraction(fetch->pool, fetch);
+    return 1;
+}
+
+int download_packages(const package_list_t *package_list,
                       const char *package_groups[],
                       const char *download_url_format,
                       const char *package_stow_dir,
+                      const char *package_manifest_dir,
                       const char *package_download_dir,
                       const char *package_temp_dir,
-                      const char *proxy)
+                      download_context_t *download_context,
+                      const fetch_options_t *fetch_options)
 {
     const package_spec_t *current_package;
+    package_fetch_t *fetches = NULL, *fetch;
+    download_job_t *jobs = NULL;
+    extract_pool_t pool;
     struct stat st;
-    char downtemp[PATH_MAX],
-         down[PATH_MAX],
-         temp[PATH_MAX],
-         final[PATH_MAX],
-         url[PATH_MAX];
-    int g, in_group;
+    unsigned long group_mask = package_groups_mask(package_groups);
+    int i, nfetches = 0, njobs = 0, downloaded, extracted;
     int n = 0, result = 0;
 
-    for(current_package = package_list;
-        current_package;
-        current_package = current_package->next) {
-
-        for(g = 0, in_group = 0; package_groups[g] != NULL && !in_group; g++) {
-            if(!strcmp(package_groups[g], (char *)current_package->group)) {
-                in_group = 1;
-            }
-        }
+    memset(&pool, 0, sizeof(extract_pool_t));
+    nfetches = (int)package_list->count;
+    fetches = (package_fetch_t *)calloc(nfetches ? nfetches : 1, sizeof(package_fetch_t));
+    jobs = (download_job_t *)calloc(nfetches ? nfetches : 1, sizeof(download_job_t));
+    if(!fetches || !jobs) {
+        log_error("Fatal error: out of memory.");
+        goto error;
+    }
 
-        if(in_group) {
-            snprintf(downtemp,
+    /* figure out what is missing, and queue downloads for it */
+    nfetches = 0;
+    for(current_package = package_list->packages;
+        current_package < package_list->packages + package_list->count;
+        current_package++) {
+
+        if(package_in_groups(current_package, package_groups, group_mask)) {
+            fetch = &fetches[nfetches];
+            fetch->package = current_package;
+            fetch->package_temp_dir = package_temp_dir;
+            fetch->pool = &pool;
+            /* a stable name lets an interrupted download be resumed */
+            snprintf(fetch->downtemp,
                      PATH_MAX,
-                     "%s/%s.tar.gz.%ld",
+                     "%s/%s.tar.gz.part",
                      package_download_dir,
-                     current_package->package_name,
-                     (long)getpid());
-            snprintf(down,
+                     current_package->package_name);
+            snprintf(fetch->down,
                      PATH_MAX,
                      "%s/%s.tar.gz",
                      package_download_dir,
                      current_package->package_name);
-            snprintf(temp,
+            snprintf(fetch->temp,
                      PATH_MAX,
                      "%s/%s",
                      package_temp_dir,
                      current_package->package_name);
-            snprintf(final,
+            snprintf(fetch->final,
                      PATH_MAX,
                      "%s/%s",
                      package_stow_dir,
                      current_package->package_name);
+            snprintf(fetch->manifest,
+                     PATH_MAX,
+                     "%s/%s",
+                     package_manifest_dir,
+                     current_package->package_name);
 
-            if(0 == stat(final, &st) && S_ISDIR(st.st_mode)) {
+            if(0 == stat(fetch->final, &st) && S_ISDIR(st.st_mode)) {
                 log_info("Skipping %s; already exists", current_package->package_name);
+                continue;
+            }
+            nfetches++;
+
+            if(0 == stat(fetch->down, &st) && S_ISREG(st.st_mode)) {
+                log_info("Found pre-deployed copy of %s", current_package->package_name);
             } else {
                 log_info("Downloading %s", current_package->package_name);
-                if(0 == stat(down, &st) && S_ISREG(st.st_mode)) {
-                    log_info("  Found pre-deployed copy");
-                } else {
-                    snprintf(url,
-                             PATH_MAX,
-                             download_url_format,
-                             current_package->package_name);
-                    unlink(downtemp); /* ignore error */
-                    if(!download(url, downtemp, proxy)) {
-                        log_error("  Download failed from %s", url);
-                        unlink(downtemp);
+                snprintf(fetch->url,
+                         PATH_MAX,
+                         download_url_format,
+                         current_package->package_name);
+                fetch->needs_download = 1;
+                jobs[njobs].label = (char *)current_package->package_name;
+                jobs[njobs].url = fetch->url;
+                jobs[njobs].done = package_downloaded;
+                jobs[njobs].data = fetch;
+                if(fetch_options->stream) {
+                    /* unpack on the fly into a clean temp directory */
+                    if(!rmrf_if_exists(fetch->temp)) {
+                        log_error("  Cannot remove stale directory %s", fetch->temp);
                         goto error;
                     }
-
-                    log_info("  Download complete.");
-                    if(0 != rename(downtemp, down)) {
-                        log_error("  Failed to rename %s to %s: %s",
-                                  downtemp, down, strerror(errno));
-                        unlink(downtemp);
-                        goto error;
-                    }
-                }
-
-                /* untar */
-                log_info("  Extracting %s", current_package->package_name);
-                if(!extract_package(down, package_temp_dir)) {
-                    goto error;
-                }
-                n++;
-
-                /* remove original download */
-                unlink(down); /* ignore error */
-
-                /* rename extracted copy */
-                if(0 != rename(temp, final)) {
-                    log_error("  Failed to rename %s to %s: %s",
-                              temp,
-                              final,
-                              strerror(errno));
-                    goto error;
+                    jobs[njobs].sink = stream_package;
+                    jobs[njobs].sink_data = fetch;
+                } else {
+                    jobs[njobs].dest_file = fetch->downtemp;
+                    jobs[njobs].resume = 1;
                 }
+                njobs++;
             }
         }
     }
 
+    /* unpack tarballs on every core while the rest are still downloading */
+    if(!start_extract_pool(&pool, fetch_options->extract_jobs, nfetches, fetch_options->system_tar)) {
+        stop_extract_pool(&pool);
+        goto error;
+    }
+    for(i = 0; i < nfetches; i++) {
+        if(!fetches[i].needs_download) {
+            queue_extraction(&pool, &fetches[i]);
+        }
+    }
+    downloaded = download_all(download_context, jobs, njobs, fetch_options->download_jobs);
+    extracted = stop_extract_pool(&pool);
+
+    for(i = 0; i < nfetches; i++) {
+        if(fetches[i].streamed) n++;
+    }
+    n += pool.extracted;
+    if(!downloaded || !extracted) {
+        goto error;
+    }
+    if(njobs > 0) {
+        log_info("Downloaded %d package%s.", njobs, njobs == 1 ? "" : "s");
+    }
+
     result = 1;
  error:
     log_info("Extracted %d package%s.", n, n == 1 ? "" : "s");
+    if(fetches)
+        free(fetches);
+    if(jobs)
+        free(jobs);
     return result;
 }
 
@@ -231,95 +492,269 @@ static int stow_package(const char *epkg,
     return 1;
 }
 
-static int find_epkg_path(const package_spec_t *package_list,
+static int find_epkg_path(const package_list_t *package_list,
                           const char *package_groups[],
                           const char *source_dir,
                           char *epkg_path)
 {
     const package_spec_t *current_package;
-    int g, n;
+    unsigned long group_mask = package_groups_mask(package_groups);
+    int n;
     int found = 0;
 
-    for(current_package = package_list;
-        current_package;
-        current_package = current_package->next) {
-        for(g = 0; package_groups[g] != NULL; g++) {
-            if(!strcmp(package_groups[g], (char *)current_package->group)) {
-                if(strstr((char *)current_package->package_name, "epkg-") ==
-                   (char *)current_package->package_name)
-                {
-                    n = snprintf(epkg_path,
-                                 PATH_MAX,
-                                 "%s/%s/bin/epkg",
-                                 source_dir,
-                                 current_package->package_name);
-                    if(n == PATH_MAX)
-                        return 0;
-                    found = 1;
-                }
-                break;
-            }
+    for(current_package = package_list->packages;
+        current_package < package_list->packages + package_list->count;
+        current_package++) {
+        if(package_in_groups(current_package, package_groups, group_mask) &&
+           strstr((char *)current_package->package_name, "epkg-") ==
+           (char *)current_package->package_name)
+        {
+            n = snprintf(epkg_path,
+                         PATH_MAX,
+                         "%s/%s/bin/epkg",
+                         source_dir,
+                         current_package->package_name);
+            if(n == PATH_MAX)
+                return 0;
+            found = 1;
         }
     }
     return found;
 }
 
-int create_package_tree(const package_spec_t *package_list,
+/*
+ * Start a tree from the links of the previous one that are still
+ * wanted: those of packages both in previous_packages and in the new
+ * list. The names of those packages are put in keep.
+ */
+static int clone_package_tree(linktree_t *tree,
+                              const package_list_t *package_list,
+                              const char *package_groups[],
+                              const char *previous_dir,
+                              const package_list_t *previous_packages,
+                              hash_table_t *keep)
+{
+    hash_table_t wanted;
+    const package_spec_t *current_package;
+    unsigned long group_mask = package_groups_mask(package_groups);
+    int kept = 0, dropped = 0;
+    int ok = 0;
+
+    if(!hash_init(&wanted, 256) || !hash_init(keep, 256)) {
+        log_error("Fatal error: out of memory.");
+        goto error;
+    }
+    for(current_package = package_list->packages;
+        current_package < package_list->packages + package_list->count;
+        current_package++) {
+        if(package_in_groups(current_package, package_groups, group_mask) &&
+           !hash_put(&wanted, (char *)current_package->package_name, (void *)current_package))
+        {
+            log_error("Fatal error: out of memory.");
+            goto error;
+        }
+    }
+    for(current_package = previous_packages->packages;
+        current_package < previous_packages->packages + previous_packages->count;
+        current_package++) {
+        if(!hash_get(&wanted, (char *)current_package->package_name)) {
+            log_info("Unlinking (%s): %s", current_package->group, current_package->package_name);
+            dropped++;
+        } else if(!hash_put(keep, (char *)current_package->package_name, (void *)current_package)) {
+            log_error("Fatal error: out of memory.");
+            goto error;
+        } else {
+            kept++;
+        }
+    }
+
+    log_info("Copying links of %d unchanged package%s from %s", kept, kept == 1 ? "" : "s", previous_dir);
+    ok = linktree_clone(tree, previous_dir, keep);
+ error:
+    hash_free(&wanted);
+    return ok;
+}
+
+/*
+ * Links the packages of the given groups into target_dir. Unless
+ * use_epkg is set this is done in process; otherwise the epkg of an
+ * epkg-* package in the list is run once per package.
+ *
+ * If previous_dir is given, it is a tree built earlier from
+ * previous_packages. The new tree then starts as a copy of it, minus the
+ * packages that were dropped, and only packages new to the list are
+ * linked. The result is the same as linking everything from scratch.
+ */
+int create_package_tree(const package_list_t *package_list,
                         const char *package_groups[],
                         const char *source_dir,
-                        const char *target_dir)
+                        const char *manifest_dir,
+                        const char *target_dir,
+                        int use_epkg,
+                        const char *previous_dir,
+                        const package_list_t *previous_packages)
 {
     const package_spec_t *current_package;
-    int g, in_group;
+    linktree_t tree;
+    hash_table_t keep;
+    unsigned long group_mask = package_groups_mask(package_groups);
+    int in_group;
     char epkg_path[PATH_MAX];
-    int n = 0;
-
-    /* find epkg path */
-    if(!find_epkg_path(package_list, package_groups, source_dir, epkg_path)) {
-        log_error("Cannot locate epkg in %s; did you include it in your package list?", source_dir);
+    int n = 0, pruned;
+    int ok = 1;
+
+    memset(&keep, 0, sizeof(hash_table_t));
+    if(use_epkg) {
+        /* find epkg path */
+        if(!find_epkg_path(package_list, package_groups, source_dir, epkg_path)) {
+            log_error("Cannot locate epkg in %s; did you include it in your package list?", source_dir);
+            return 0;
+        }
+        previous_dir = NULL;    /* epkg keeps no record of what it linked */
+    } else if(!linktree_open(&tree, source_dir, manifest_dir, target_dir)) {
+        return 0;
+    }
+    if(previous_dir &&
+       !clone_package_tree(&tree, package_list, package_groups, previous_dir, previous_packages, &keep))
+    {
+        linktree_close(&tree);
+        hash_free(&keep);
         return 0;
     }
 
     /* link packages */
-    for(current_package = package_list;
-        current_package;
-        current_package = current_package->next) {
+    for(current_package = package_list->packages;
+        current_package < package_list->packages + package_list->count;
+        current_package++) {
 
-        for(g = 0, in_group = 0; package_groups[g] != NULL && !in_group; g++) {
-            if(!strcmp(package_groups[g], (char *)current_package->group)) {
-                in_group = 1;
-            }
+        in_group = package_in_groups(current_package, package_groups, group_mask);
+        if(in_group && hash_get(&keep, (char *)current_package->package_name)) {
+            continue;   /* already in the copied tree */
         }
-
         if(in_group) {
             log_info("Linking (%s): %s",
                      current_package->group,
                      current_package->package_name);
 
-            if(!stow_package(epkg_path,
-                             (char *)current_package->package_name,
-                             source_dir,
-                             target_dir))
-            {
-                return 0;
+            if(use_epkg) {
+                if(!stow_package(epkg_path,
+                                 (char *)current_package->package_name,
+                                 source_dir,
+                                 target_dir))
+                {
+                    return 0;
+                }
+            } else if(!linktree_add(&tree, (char *)current_package->package_name)) {
+                log_error("Failed to link package %s", current_package->package_name);
+                ok = 0;  /* go on, to report every conflict at once */
+                continue;
             }
             n++;
         }
     }
 
-    log_info("Linked %d package%s.", n, n == 1 ? "" : "s");
+    if(previous_dir && ok && (pruned = linktree_prune(&tree)) > 0) {
+        log_info("Removed %d director%s left empty", pruned, pruned == 1 ? "y" : "ies");
+    }
+    if(!use_epkg) {
+        linktree_close(&tree);
+    }
+    hash_free(&keep);
+    if(ok) {
+        log_info("Linked %d package%s.", n, n == 1 ? "" : "s");
+    }
+    return ok;
+}
+
+static void *build_package_tree(void *arg) {
+    package_tree_build_t *build = arg;
+
+    build->result = create_package_tree(build->package_list,
+                                        build->package_groups,
+                                        build->source_dir,
+                                        build->manifest_dir,
+                                        build->target_dir,
+                                        build->use_epkg,
+                                        build->previous_dir,
+                                        build->previous_packages);
+    return NULL;
+}
+
+/*
+ * Start create_package_tree() on a thread of its own. The arguments must
+ * stay valid until finish_package_tree() has been called.
+ */
+int start_package_tree(package_tree_build_t *build,
+                       const package_list_t *package_list,
+                       const char *package_groups[],
+                       const char *source_dir,
+                       const char *manifest_dir,
+                       const char *target_dir,
+                       int use_epkg,
+                       const char *previous_dir,
+                       const package_list_t *previous_packages)
+{
+    memset(build, 0, sizeof(package_tree_build_t));
+    build->package_list = package_list;
+    build->package_groups = package_groups;
+    build->source_dir = source_dir;
+    build->manifest_dir = manifest_dir;
+    build->target_dir = target_dir;
+    build->use_epkg = use_epkg;
+    build->previous_dir = previous_dir;
+    build->previous_packages = previous_packages;
+    if(0 != pthread_create(&build->thread, NULL, build_package_tree, build)) {
+        return 0;
+    }
+    build->started = 1;
     return 1;
 }
 
+/* wait for a tree started with start_package_tree(); return 1 if it was built */
+int finish_package_tree(package_tree_build_t *build) {
+    if(!build->started) {
+        return 0;
+    }
+    pthread_join(build->thread, NULL);
+    build->started = 0;
+    return build->result;
+}
+
+/* a symlink tree that might be kept */
+typedef struct old_tree_s {
+    char name[NAME_MAX + 1];
+    time_t mtime;
+} old_tree_t;
+
+/* newest first */
+static int compare_old_trees(const void *a, const void *b) {
+    const old_tree_t *x = a, *y = b;
+
+    return (x->mtime < y->mtime) - (x->mtime > y->mtime);
+}
+
+/*
+ * Remove the symlink trees of prior installations, except the one in
+ * use before this roll, the failsafe tree built ahead of time and, up to
+ * keep_trees trees in all, the newest ones that have a snapshot to roll
+ * back to.
+ */
 int clean_previous_package_trees(const char *package_target_dir,
                                  const char *package_link_dir,
-                                 const char *previous_package_link_dir)
+                                 const char *previous_package_link_dir,
+                                 const char *prebuilt_dir,
+                                 int keep_trees,
+                                 const char *snapshot_dir,
+                                 const char *trash_dir)
 {
     int result = 0;
     DIR *dp = NULL;
     struct dirent *entry;
     struct stat st;
     char full_pathname[PATH_MAX];
+    old_tree_t *trees = NULL, *grown;
+    size_t ntrees = 0, size = 0, i;
+    int kept = 1; /* the tree just installed */
 
     if(!(dp = opendir(package_target_dir))) {
        log_error("Failed to open hostclass symlink tree directory %s: %s",
@@ -342,24 +777,55 @@ int clean_previous_package_trees(const char *package_target_dir,
         {
             if(0 == strcmp(full_pathname, previous_package_link_dir)) {
                 log_info("  Saving %s", entry->d_name);
+                kept++;
+            } else if(0 == strcmp(full_pathname, prebuilt_dir)) {
+                /* not installed, so it does not count */
+                log_info("  Saving %s", entry->d_name);
             } else {
-                log_info("  Removing %s", entry->d_name);
-                if(!rmrf(full_pathname)) {
-                    log_info("    Cannot remove directory %s; ignoring error", full_pathname);
+                if(ntrees == size) {
+                    size = size ? 2 * size : 16;
+                    if(!(grown = realloc(trees, size * sizeof(old_tree_t)))) {
+                        log_error("Out of memory");
+                        goto error;
+                    }
+                    trees = grown;
                 }
+                strlcpy(trees[ntrees].name, entry->d_name, sizeof(trees[ntrees].name));
+                trees[ntrees].mtime = st.st_mtime;
+                ntrees++;
             }
         }
     }
 
+    qsort(trees, ntrees, sizeof(old_tree_t), compare_old_trees);
+    for(i = 0; i < ntrees; i++) {
+        if(kept < keep_trees && snapshot_exists(snapshot_dir, trees[i].name)) {
+            log_info("  Keeping %s", trees[i].name);
+            kept++;
+            continue;
+        }
+        log_info("  Removing %s", trees[i].name);
+        snprintf(full_pathname, PATH_MAX, "%s/%s", package_target_dir, trees[i].name);
+        if(!trash_move(trash_dir, full_pathname)) {
+            log_info("    Cannot remove directory %s; ignoring error", full_pathname);
+        }
+    }
+    snapshot_prune(snapshot_dir, package_target_dir, trash_dir);
+
     result = 1;
  error:
     if(dp)
         closedir(dp);
+    free(trees);
     return result;
 }
 
-int clean_previous_packages(const package_spec_t *package_list,
-                            const char *package_stow_dir)
+/* kept_packages are those the kept symlink trees link to */
+int clean_previous_packages(const package_list_t *package_list,
+                            const package_list_t *kept_packages,
+                            const char *package_stow_dir,
+                            const char *package_manifest_dir,
+                            const char *trash_dir)
 {
     const package_spec_t *cp;
     int included = 0;
@@ -372,7 +838,7 @@ int clean_previous_packages(const package_spec_t *package_list,
 
         while(NULL != (package = readdir(existing_packages))) {
            included = 0;
-           for(cp = package_list; cp; cp = cp->next) {
+           for(cp = package_list->packages; cp < package_list->packages + package_list->count; cp++) {
                if(0 == strcmp(package->d_name, (char *)cp->package_name) &&
                    package->d_name[0] != '.')
                {
@@ -380,14 +846,24 @@ int clean_previous_packages(const package_spec_t *package_list,
                    break;
                }
            }
+           for(cp = kept_packages->packages;
+               cp < kept_packages->packages + kept_packages->count && !included;
+               cp++)
+           {
+               if(0 == strcmp(package->d_name, (char *)cp->package_name)) {
+                   included = 1;
+               }
+           }
 
            if(!included && package->d_name[0] != '.') {
                snprintf(full_pathname, PATH_MAX, "%s/%s", package_stow_dir, package->d_name);
                log_info("    Removing package %s", package->d_name);
-               if(!rmrf(full_pathname)) {
+               if(!trash_move(trash_dir, full_pathname)) {
                    log_info("    Cannot remove directory %s; ignoring error",
                        full_pathname);
                }
+               snprintf(full_pathname, PATH_MAX, "%s/%s", package_manifest_dir, package->d_name);
+               unlink(full_pathname); /* ignore error */
            }
         }
     }
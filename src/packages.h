@@ -34,31 +34,80 @@
 #ifndef PACKAGES_H
 #define PACKAGES_H
 
+#include <pthread.h>
 #include "config_parse.h"
+#include "download.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-int download_packages(const package_spec_t *package_list,
+/* knobs controlling how download_packages() fetches and unpacks */
+typedef struct fetch_options_s {
+    int download_jobs;      /* number of concurrent downloads */
+    int stream;             /* unpack while downloading, no tarball on disk */
+    int system_tar;         /* unpack with /bin/tar instead of in process */
+    int extract_jobs;       /* number of packages to unpack at once */
+} fetch_options_t;
+
+int download_packages(const package_list_t *package_list,
                       const char *package_groups[],
                       const char *download_url_format,
                       const char *package_stow_dir,
+                      const char *package_manifest_dir,
                       const char *package_download_dir,
                       const char *package_temp_dir,
-                      const char *proxy);
+                      download_context_t *download_context,
+                      const fetch_options_t *fetch_options);
 
-int create_package_tree(const package_spec_t *package_list,
+int create_package_tree(const package_list_t *package_list,
                         const char *package_groups[],
                         const char *source_dir,
-                        const char *target_dir);
+                        const char *manifest_dir,
+                        const char *target_dir,
+                        int use_epkg,
+                        const char *previous_dir,
+                        const package_list_t *previous_packages);
+
+/* a symlink tree being built on a thread of its own */
+typedef struct package_tree_build_s {
+    pthread_t thread;
+    int started;
+    int result;
+    const package_list_t *package_list;
+    const char **package_groups;
+    const char *source_dir;
+    const char *manifest_dir;
+    const char *target_dir;
+    int use_epkg;
+    const char *previous_dir;
+    const package_list_t *previous_packages;
+} package_tree_build_t;
+
+int start_package_tree(package_tree_build_t *build,
+                       const package_list_t *package_list,
+                       const char *package_groups[],
+                       const char *source_dir,
+                       const char *manifest_dir,
+                       const char *target_dir,
+                       int use_epkg,
+                       const char *previous_dir,
+                       const package_list_t *previous_packages);
+int finish_package_tree(package_tree_build_t *build);
 
 int clean_previous_package_trees(const char *package_target_dir,
                                  const char *package_link_dir,
-                                 const char *previous_package_link_dir);
+                                 const char *previous_package_link_dir,
+                                 const char *prebuilt_dir,
+                                 int keep_trees,
+                                 const char *snapshot_dir,
+                                 const char *trash_dir);
 
-int clean_previous_packages(const package_spec_t *package_list,
-                            const char *package_stow_dir);
+int clean_previous_packages(const package_list_t *package_list,
+                            const package_list_t *kept_packages,
+                            const char *package_stow_dir,
+                            const char *package_manifest_dir,
+                            const char *trash_dir);
 
 #ifdef __cplusplus
 }
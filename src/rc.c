@@ -0,0 +1,217 @@
+/* rc.c - Start and stop the services in /usr/local/etc/rc.d.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Does what local_initd does, without a shell: runs S[0-9][0-9]* scripts
+ * with "start" or K[0-9][0-9]* scripts with "stop", in name order. The
+ * scripts of one two-digit priority do not depend on each other, so they
+ * are run at once, and the next priority starts when they have all
+ * finished. Each line of output is prefixed with the script's name.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#ifdef HAVE_SYS_TYPES_H
+    #include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+    #include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+    #include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+    #include <fcntl.h>
+#endif
+#ifdef HAVE_LIMITS_H
+    #include <limits.h>
+#endif
+#include "rc.h"
+#include "run.h"
+#include "log.h"
+
+#define RC_USAGE "usage: roll rc {start|stop} [dir]\n"
+
+static char *const RC_ENV[] = {
+    RC_PATH,
+    NULL
+};
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * The scripts for action in dir, sorted; *count is set to how many. If
+ * only is given, just the scripts of the services in it.
+ */
+static char **find_scripts(const char *dir, char prefix, const hash_table_t *only, int *count) {
+    DIR *dp;
+    struct dirent *entry;
+    char **names = NULL, **grown;
+    int size = 0;
+
+    *count = 0;
+    if(!(dp = opendir(dir))) {
+        return NULL;
+    }
+    while(NULL != (entry = readdir(dp))) {
+        /* like the shell pattern <prefix>[0-9][0-9]?* */
+        if(entry->d_name[0] != prefix ||
+           !isdigit((unsigned char)entry->d_name[1]) ||
+           !isdigit((unsigned char)entry->d_name[2]) ||
+           entry->d_name[3] == '\0' ||
+           (only && !hash_get(only, entry->d_name + 1)))
+        {
+            continue;
+        }
+        if(*count == size) {
+            size = size ? 2 * size : 32;
+            if(!(grown = realloc(names, size * sizeof(char *)))) {
+                break;
+            }
+            names = grown;
+        }
+        if(!(names[*count] = strdup(entry->d_name))) {
+            break;
+        }
+        (*count)++;
+    }
+    closedir(dp);
+    qsort(names, *count, sizeof(char *), compare_names);
+    return names;
+}
+
+/*
+ * Run the scripts in dir for action, "start" or "stop", of all services
+ * or of only those in only. A service is a script's name without the
+ * S or K, such as "10nginx". Returns the sum of their exit codes, plus
+ * one for each that could not be run, as local_initd adds them up.
+ */
+int run_rc_scripts(const char *dir, const char *action, const hash_table_t *only) {
+    char **names;
+    spawn_child_t *children = NULL;
+    char path[PATH_MAX], prefix[MAX_PREFIX_SIZE];
+    char *argv[3];
+    struct stat st;
+    int count, first, last, i, n;
+    int status = 0;
+
+    names = find_scripts(dir, (0 == strcmp(action, "start") ? 'S' : 'K'), only, &count);
+    if(count > 0 && !(children = calloc(count, sizeof(spawn_child_t)))) {
+        log_error("Fatal error: out of memory.");
+        status = count;
+        goto done;
+    }
+
+    for(first = 0; first < count; first = last) {
+        /* one priority level */
+        for(last = first + 1;
+            last < count && 0 == strncmp(names[first], names[last], 3);
+            last++) ;
+
+        for(i = first, n = 0; i < last; i++) {
+            snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+            if(0 != stat(path, &st) || S_ISDIR(st.st_mode) || 0 != access(path, X_OK)) {
+                log_error("%s: not an executable file: %s", "local_initd", path);
+                status++;
+                continue;
+            }
+            snprintf(prefix, sizeof(prefix), "%s: ", names[i]);
+            argv[0] = path;
+            argv[1] = (char *)action;
+            argv[2] = NULL;
+            if(!spawn_command(&children[n], prefix, 0, RC_WORKING_DIR, RC_ENV, argv)) {
+                status++;
+                continue;
+            }
+            n++;
+        }
+        spawn_wait(children, n);
+        for(i = 0; i < n; i++) {
+            status += (children[i].exit_code >= 0) ? children[i].exit_code : 1;
+        }
+    }
+
+ done:
+    for(i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+    free(children);
+    return status;
+}
+
+/*
+ * What local_initd {start|stop} does: run the scripts, and keep the lock
+ * file that tells CentOS that local_initd is running. Returns what
+ * run_rc_scripts() does.
+ */
+int run_rc(const char *dir, const char *action, const hash_table_t *only) {
+    struct stat st;
+    int fd, status;
+
+    if(0 == strcmp(action, "start")) {
+        if(0 == stat(RC_LOCK_DIR, &st) && (fd = open(RC_LOCK_FILE, O_WRONLY | O_CREAT, 0644)) >= 0) {
+            close(fd);
+        }
+        status = run_rc_scripts(dir, action, only);
+    } else {
+        status = run_rc_scripts(dir, action, only);
+        unlink(RC_LOCK_FILE); /* ignore error */
+    }
+    if(status) {
+        log_error("Scripts in %s exited with a total status of %d", dir, status);
+    }
+    return status;
+}
+
+/* roll rc {start|stop} [dir] */
+int rc_main(int argc, char *argv[]) {
+    int status;
+
+    if(argc < 2 || argc > 3 ||
+       (strcmp(argv[1], "start") && strcmp(argv[1], "stop")))
+    {
+        fprintf(stderr, RC_USAGE);
+        return 1;
+    }
+    /* local_initd exits with the total status; an exit code holds up to 255 */
+    status = run_rc(argc > 2 ? argv[2] : RC_DIR, argv[1], NULL);
+    return status > 255 ? 255 : status;
+}
@@ -0,0 +1,58 @@
+/* rc.h - Start and stop the services in /usr/local/etc/rc.d.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RC_H
+#define RC_H
+
+#include "hash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the same scripts, environment and lock file as local_initd uses */
+#define RC_DIR "/usr/local/etc/rc.d"
+#define RC_PATH "PATH=/usr/local/bin:/usr/bin:/bin"
+#define RC_WORKING_DIR "/var/tmp"
+#define RC_LOCK_DIR "/var/lock/subsys"
+#define RC_LOCK_FILE RC_LOCK_DIR "/local_initd"
+
+int run_rc_scripts(const char *dir, const char *action, const hash_table_t *only);
+int run_rc(const char *dir, const char *action, const hash_table_t *only);
+int rc_main(int argc, char *argv[]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef RC_H */
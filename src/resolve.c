@@ -0,0 +1,469 @@
+/* resolve.c - Resolve a tree of host configs offline.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Resolves every host config in a directory laid out like the config
+ * server, DIR/hostclass/NAME and DIR/host/NAME, with the same parsing
+ * and merging code a roll uses, so that a config change can be checked
+ * before it is published. Each hostclass is parsed once; then a pool of
+ * threads parses the hosts and merges their package lists. One JSON
+ * object per host is printed, in name order:
+ *
+ *   {"host":"web1","hostclass":"web",
+ *    "packages":{"production":["nginx-1.4","app-2.0"],"failsafe":[...]},
+ *    "overrides":[{"group":"production","package":"app-1.9","with":"app-2.0"}],
+ *    "conflicts":[{"in":"hostclass","group":...,"package":...,"with":...}]}
+ *
+ * or {"host":"web1","error":"..."} if it cannot be resolved. A conflict
+ * is one list naming two versions of a package, of which the last wins.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_STAT_H
+    #include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+    #include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+    #include <fcntl.h>
+#endif
+#ifdef HAVE_LIMITS_H
+    #include <limits.h>
+#endif
+#include "resolve.h"
+#include "config_parse.h"
+#include "buffer.h"
+#include "hash.h"
+#include "log.h"
+
+#define RESOLVE_USAGE "usage: roll resolve [-j jobs] dir\n"
+#define MAX_ERROR_SIZE 256
+
+typedef struct hostclass_entry_s {
+    const char *name;
+    hostclass_config_t config;
+    int ok;                     /* config was parsed */
+} hostclass_entry_t;
+
+typedef struct host_result_s {
+    const char *name;
+    buffer_t line;              /* what is printed for the host */
+    int ok;                     /* it was resolved */
+} host_result_t;
+
+typedef struct resolver_s resolver_t;
+typedef void (*resolve_job_t)(resolver_t *resolver, size_t i);
+
+struct resolver_s {
+    const char *dir;
+    char **hostclass_names;
+    size_t hostclass_count;
+    hostclass_entry_t *hostclasses;
+    hash_table_t hostclass_index;   /* name to hostclass_entry_t */
+    char **host_names;
+    size_t host_count;
+    host_result_t *hosts;
+
+    /* the jobs being run by run_jobs() */
+    resolve_job_t job;
+    size_t next_job;
+    size_t job_count;
+    pthread_mutex_t lock;
+};
+
+/* what merging one host's package lists replaced */
+typedef struct changes_s {
+    buffer_t overrides;
+    buffer_t conflicts;
+    int ok;
+} changes_t;
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* the names of the regular files in dir, sorted; dotfiles are left out */
+static int list_files(const char *dir, char ***names, size_t *count) {
+    DIR *dp;
+    struct dirent *entry;
+    struct stat st;
+    size_t allocated = 0;
+    char **grown;
+    int ok = 1;
+
+    *names = NULL;
+    *count = 0;
+    if( !(dp = opendir(dir)) ) {
+        log_error("Cannot open %s: %s", dir, strerror(errno));
+        return 0;
+    }
+    while(ok && (entry = readdir(dp))) {
+        if('.' == entry->d_name[0]) {
+            continue;
+        }
+        if(DT_REG != entry->d_type &&
+           !(DT_UNKNOWN == entry->d_type &&
+             0 == fstatat(dirfd(dp), entry->d_name, &st, 0) && S_ISREG(st.st_mode)))
+        {
+            continue;
+        }
+        if(*count == allocated) {
+            allocated = allocated ? 2 * allocated : 256;
+            if( !(grown = (char **)realloc(*names, allocated * sizeof(char *))) ) {
+                ok = 0;
+                break;
+            }
+            *names = grown;
+        }
+        if( !((*names)[*count] = strdup(entry->d_name)) ) {
+            ok = 0;
+            break;
+        }
+        (*count)++;
+    }
+    closedir(dp);
+    if(!ok) {
+        log_error("Fatal error: out of memory.");
+        return 0;
+    }
+    qsort(*names, *count, sizeof(char *), compare_names);
+    return 1;
+}
+
+static void free_names(char **names, size_t count) {
+    size_t i;
+
+    for(i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+static void *job_worker(void *arg) {
+    resolver_t *resolver = (resolver_t *)arg;
+    size_t i;
+
+    for(;;) {
+        pthread_mutex_lock(&resolver->lock);
+        i = resolver->next_job++;
+        pthread_mutex_unlock(&resolver->lock);
+        if(i >= resolver->job_count) {
+            break;
+        }
+        resolver->job(resolver, i);
+    }
+    return NULL;
+}
+
+/* run job for 0 to count - 1 on up to nthreads threads */
+static int run_jobs(resolver_t *resolver, resolve_job_t job, size_t count, int nthreads) {
+    pthread_t *threads;
+    int i, started, rc = 0;
+
+    resolver->job = job;
+    resolver->next_job = 0;
+    resolver->job_count = count;
+    if((size_t)nthreads > count) {
+        nthreads = count ? (int)count : 1;
+    }
+    if( !(threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t))) ) {
+        log_error("Fatal error: out of memory.");
+        return 0;
+    }
+    for(started = 0; started < nthreads; started++) {
+        if(0 != (rc = pthread_create(&threads[started], NULL, job_worker, resolver))) {
+            break;
+        }
+    }
+    if(started == 0) {
+        /* no threads to be had; do the work here */
+        log_error("Cannot start resolver threads: %s", strerror(rc));
+        job_worker(resolver);
+    }
+    for(i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return 1;
+}
+
+static void parse_hostclass(resolver_t *resolver, size_t i) {
+    hostclass_entry_t *entry = &resolver->hostclasses[i];
+    buffer_t file;
+    char path[PATH_MAX];
+
+    entry->name = resolver->hostclass_names[i];
+    snprintf(path, sizeof(path), "%s/hostclass/%s", resolver->dir, entry->name);
+    if(!buffer_map_file(&file, path)) {
+        log_error("Cannot read %s: %s", path, strerror(errno));
+        return;
+    }
+    if( !(entry->ok = parse_hostclass_config(&entry->config, file.data, file.length)) ) {
+        log_error("Cannot parse %s", path);
+    }
+    buffer_free(&file);
+}
+
+static int put(buffer_t *buffer, const char *s) {
+    return buffer_append(buffer, s, strlen(s));
+}
+
+static int put_json_string(buffer_t *buffer, const char *s) {
+    char escape[8];
+    const char *run;
+    int ok = put(buffer, "\"");
+
+    while(ok && *s) {
+        for(run = s; *s && '"' != *s && '\\' != *s && (unsigned char)*s >= 0x20; s++)
+            ;
+        ok = buffer_append(buffer, run, s - run);
+        if(ok && *s) {
+            if('"' == *s || '\\' == *s) {
+                snprintf(escape, sizeof(escape), "\\%c", *s);
+            } else {
+                snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char)*s);
+            }
+            ok = put(buffer, escape);
+            s++;
+        }
+    }
+    return ok && put(buffer, "\"");
+}
+
+static void collect_change(void *data, package_change_t change, const char *group,
+                           const char *replaced, const char *replacement)
+{
+    changes_t *changes = (changes_t *)data;
+    buffer_t *list = (PACKAGE_OVERRIDDEN == change) ? &changes->overrides : &changes->conflicts;
+
+    changes->ok = changes->ok &&
+        put(list, list->length ? ",{" : "{") &&
+        (PACKAGE_OVERRIDDEN == change ||
+         put(list, PACKAGE_BASE_CONFLICT == change ? "\"in\":\"hostclass\"," : "\"in\":\"host\",")) &&
+        put(list, "\"group\":") && put_json_string(list, group) &&
+        put(list, ",\"package\":") && put_json_string(list, replaced) &&
+        put(list, ",\"with\":") && put_json_string(list, replacement) &&
+        put(list, "}");
+}
+
+/* the packages of list as an object of arrays, one per group, in order */
+static int put_packages(buffer_t *buffer, const package_list_t *list) {
+    const package_spec_t *package, *member, *earlier;
+    unsigned long seen = 0;
+    int ok = put(buffer, "{");
+
+    for(package = list->packages; ok && package < list->packages + list->count; package++) {
+        /* group names are interned in the list, so one name is one pointer */
+        if(package->group_bit) {
+            if(seen & package->group_bit) {
+                continue;
+            }
+            seen |= package->group_bit;
+        } else {
+            for(earlier = list->packages; earlier < package && earlier->group != package->group; earlier++)
+                ;
+            if(earlier < package) {
+                continue;
+            }
+        }
+        ok = (package == list->packages || put(buffer, ",")) &&
+             put_json_string(buffer, package->group) && put(buffer, ":[");
+        for(member = package; ok && member < list->packages + list->count; member++) {
+            if(member->group == package->group) {
+                ok = (member == package || put(buffer, ",")) &&
+                     put_json_string(buffer, member->package_name);
+            }
+        }
+        ok = ok && put(buffer, "]");
+    }
+    return ok && put(buffer, "}");
+}
+
+static void resolve_host(resolver_t *resolver, size_t i) {
+    host_result_t *result = &resolver->hosts[i];
+    hostclass_entry_t *hostclass = NULL;
+    host_config_t host;
+    package_list_t merged;
+    changes_t changes;
+    buffer_t file;
+    char path[PATH_MAX], error[MAX_ERROR_SIZE] = "";
+    int ok;
+
+    memset(&host, 0, sizeof(host_config_t));
+    memset(&merged, 0, sizeof(package_list_t));
+    memset(&changes, 0, sizeof(changes_t));
+    changes.ok = 1;
+    result->name = resolver->host_names[i];
+    snprintf(path, sizeof(path), "%s/host/%s", resolver->dir, result->name);
+
+    if(!buffer_map_file(&file, path)) {
+        snprintf(error, sizeof(error), "cannot read host config: %s", strerror(errno));
+    } else {
+        if(!parse_host_config(&host, file.data, file.length)) {
+            snprintf(error, sizeof(error), "cannot parse host config");
+        } else if(!host.hostclass_tag) {
+            snprintf(error, sizeof(error), "host config does not name a hostclass");
+        } else if( !(hostclass = (hostclass_entry_t *)hash_get(&resolver->hostclass_index, host.hostclass_tag)) ) {
+            snprintf(error, sizeof(error), "no hostclass config for %s", host.hostclass_tag);
+        } else if(!hostclass->ok) {
+            snprintf(error, sizeof(error), "cannot parse hostclass config %s", host.hostclass_tag);
+        } else if(!merge_package_lists_reporting(&merged, &hostclass->config.package_list,
+                                                 &host.package_list, collect_change, &changes) ||
+                  !changes.ok)
+        {
+            snprintf(error, sizeof(error), "out of memory");
+        }
+        buffer_free(&file);
+    }
+
+    result->ok = !error[0];
+    ok = put(&result->line, "{\"host\":") && put_json_string(&result->line, result->name);
+    if(result->ok) {
+        ok = ok &&
+             put(&result->line, ",\"hostclass\":") && put_json_string(&result->line, host.hostclass_tag) &&
+             put(&result->line, ",\"packages\":") && put_packages(&result->line, &merged) &&
+             put(&result->line, ",\"overrides\":[") &&
+             buffer_append(&result->line, changes.overrides.data, changes.overrides.length) &&
+             put(&result->line, "],\"conflicts\":[") &&
+             buffer_append(&result->line, changes.conflicts.data, changes.conflicts.length) &&
+             put(&result->line, "]");
+    } else {
+        ok = ok && put(&result->line, ",\"error\":") && put_json_string(&result->line, error);
+    }
+    if(!(ok && put(&result->line, "}\n"))) {
+        log_error("Fatal error: out of memory.");
+        buffer_free(&result->line);
+        result->ok = 0;
+    }
+    buffer_free(&changes.overrides);
+    buffer_free(&changes.conflicts);
+    free_package_list(&merged);
+    free_host_config(&host);
+}
+
+/* roll resolve [-j jobs] dir */
+int resolve_main(int argc, char *argv[]) {
+    resolver_t resolver;
+    char path[PATH_MAX];
+    size_t i, resolved = 0;
+    int c, nthreads, exit_code = 1;
+    static struct option long_options[] = {
+        { "jobs", required_argument, NULL, 'j' },
+        { 0, 0, 0, 0 }
+    };
+
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    while(-1 != (c = getopt_long(argc, argv, "j:", long_options, NULL))) {
+        if('j' == c && atoi(optarg) > 0) {
+            nthreads = atoi(optarg);
+        } else {
+            fprintf(stderr, RESOLVE_USAGE);
+            return 1;
+        }
+    }
+    if(optind != argc - 1) {
+        fprintf(stderr, RESOLVE_USAGE);
+        return 1;
+    }
+    if(nthreads < 1) {
+        nthreads = 1;
+    }
+
+    memset(&resolver, 0, sizeof(resolver_t));
+    resolver.dir = argv[optind];
+    pthread_mutex_init(&resolver.lock, NULL);
+
+    /* every hostclass once, before any host needs it */
+    snprintf(path, sizeof(path), "%s/hostclass", resolver.dir);
+    if(!list_files(path, &resolver.hostclass_names, &resolver.hostclass_count)) {
+        goto done;
+    }
+    snprintf(path, sizeof(path), "%s/host", resolver.dir);
+    if(!list_files(path, &resolver.host_names, &resolver.host_count)) {
+        goto done;
+    }
+    resolver.hostclasses = (hostclass_entry_t *)calloc(resolver.hostclass_count + 1, sizeof(hostclass_entry_t));
+    resolver.hosts = (host_result_t *)calloc(resolver.host_count + 1, sizeof(host_result_t));
+    if(!resolver.hostclasses || !resolver.hosts ||
+       !hash_init(&resolver.hostclass_index, resolver.hostclass_count))
+    {
+        log_error("Fatal error: out of memory.");
+        goto done;
+    }
+    if(!run_jobs(&resolver, parse_hostclass, resolver.hostclass_count, nthreads)) {
+        goto done;
+    }
+    for(i = 0; i < resolver.hostclass_count; i++) {
+        if(!hash_put(&resolver.hostclass_index, resolver.hostclasses[i].name, &resolver.hostclasses[i])) {
+            log_error("Fatal error: out of memory.");
+            goto done;
+        }
+    }
+
+    /* then the hosts, printed in order once they are all done */
+    if(!run_jobs(&resolver, resolve_host, resolver.host_count, nthreads)) {
+        goto done;
+    }
+    for(i = 0; i < resolver.host_count; i++) {
+        fwrite(resolver.hosts[i].line.data, 1, resolver.hosts[i].line.length, stdout);
+        resolved += resolver.hosts[i].ok;
+    }
+    if(0 != fflush(stdout)) {
+        log_error("Cannot write the results: %s", strerror(errno));
+        goto done;
+    }
+    exit_code = (resolved == resolver.host_count) ? 0 : 1;
+
+ done:
+    for(i = 0; resolver.hosts && i < resolver.host_count; i++) {
+        buffer_free(&resolver.hosts[i].line);
+    }
+    for(i = 0; resolver.hostclasses && i < resolver.hostclass_count; i++) {
+        free_hostclass_config(&resolver.hostclasses[i].config);
+    }
+    free(resolver.hosts);
+    free(resolver.hostclasses);
+    hash_free(&resolver.hostclass_index);
+    free_names(resolver.host_names, resolver.host_count);
+    free_names(resolver.hostclass_names, resolver.hostclass_count);
+    pthread_mutex_destroy(&resolver.lock);
+    return exit_code;
+}
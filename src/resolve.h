@@ -1,4 +1,4 @@
-/* spawn.h - Spawns a child process.
+/* resolve.h - Resolve a tree of host configs offline.
  *
  * Copyright (c) 2013, Groupon, Inc.
  * All rights reserved.
@@ -31,17 +31,17 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#ifndef SPAWN_H
-#define SPAWN_H
+#ifndef RESOLVE_H
+#define RESOLVE_H
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-int run_command(const char *command, ...);
+int resolve_main(int argc, char *argv[]);
 
 #ifdef __cplusplus
 }
 #endif
 
-#endif /* #ifndef SPAWN_H */
+#endif /* #ifndef RESOLVE_H */
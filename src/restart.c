@@ -0,0 +1,381 @@
+/* restart.c - Work out which services a roll has to restart.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A roll normally stops every service before switching /usr/local and
+ * starts them all afterwards. Most services are untouched by a roll,
+ * though, so this tells which ones are not:
+ *
+ * A service's package is the one its script is linked from. If that
+ * differs between the tree in use and the new tree, including a script
+ * that comes or goes, the service is stopped before the switch with
+ * the old script and started with the new one.
+ *
+ * The regular files in the config directory, which configurate writes,
+ * are hashed before the switch and after configurate. A file that
+ * changed belongs to a service if its first path component, up to a
+ * ".", is the service's name ("nginx" for "10nginx") or the name of
+ * its package without the version ("nginx" for "nginx-1.4.1"). Those
+ * services are stopped and started after configurate. A changed file
+ * that belongs to no service could be anyone's, so then every service
+ * is restarted.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#ifdef HAVE_SYS_STAT_H
+    #include <sys/stat.h>
+#endif
+#ifdef HAVE_LIMITS_H
+    #include <limits.h>
+#endif
+#include "restart.h"
+#include "sha256.h"
+#include "log.h"
+#if !defined(HAVE_STRLCPY) && !HAVE_DECL_STRLCPY
+    #include "strlcpy.h"
+#endif
+
+/* value of the entries of tables used as sets */
+static char member[] = "";
+
+/* what roll itself keeps in the config directory, which is not configurate's */
+static int is_roll_file(const char *name) {
+    return name[0] == '.' || !strcmp(name, "hostclass.yml") || !strcmp(name, "host.yml");
+}
+
+/* hash_free() leaves the values, which here are strings of their own */
+static void free_table(hash_table_t *table) {
+    size_t i;
+
+    if(!table->entries) {
+        return;
+    }
+    for(i = 0; i < table->size; i++) {
+        if(table->entries[i].key && table->entries[i].value != member) {
+            free(table->entries[i].value);
+        }
+    }
+    hash_free(table);
+}
+
+static int put_string(hash_table_t *table, const char *key, const char *value) {
+    char *copy;
+
+    if( !(copy = strdup(value)) ) {
+        return 0;
+    }
+    if(!hash_put(table, key, copy)) {
+        free(copy);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * The package that path, a script in a tree, comes from: the first
+ * component after stow_dir of where it really is. Scripts outside of
+ * stow_dir are their own package.
+ */
+static void script_owner(const char *path, const char *stow_dir, char owner[PATH_MAX]) {
+    char real[PATH_MAX];
+    size_t n = strlen(stow_dir);
+
+    if(!realpath(path, real)) {
+        strlcpy(owner, path, PATH_MAX);
+        return;
+    }
+    if(0 == strncmp(real, stow_dir, n) && real[n] == '/') {
+        strlcpy(owner, real + n + 1, PATH_MAX);
+        owner[strcspn(owner, "/")] = '\0';
+    } else {
+        strlcpy(owner, real, PATH_MAX);
+    }
+}
+
+/* map the services of the tree to the packages of their scripts */
+static int read_owners(hash_table_t *owners, const char *tree, const char *stow_dir) {
+    DIR *dp;
+    struct dirent *entry;
+    char dir[PATH_MAX], path[PATH_MAX], owner[PATH_MAX];
+    int ok = 1;
+
+    snprintf(dir, sizeof(dir), "%s/etc/rc.d", tree);
+    if( !(dp = opendir(dir)) ) {
+        return ENOENT == errno;  /* a tree without services */
+    }
+    while(ok && (entry = readdir(dp))) {
+        if((entry->d_name[0] != 'S' && entry->d_name[0] != 'K') ||
+           !isdigit((unsigned char)entry->d_name[1]) ||
+           !isdigit((unsigned char)entry->d_name[2]) ||
+           entry->d_name[3] == '\0' ||
+           hash_get(owners, entry->d_name + 1))
+        {
+            continue;
+        }
+        if(snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path)) {
+            ok = 0;
+            break;
+        }
+        script_owner(path, stow_dir, owner);
+        ok = put_string(owners, entry->d_name + 1, owner);
+    }
+    closedir(dp);
+    return ok;
+}
+
+/* hash the regular files under dir; path + length is where names go */
+static int hash_configs(hash_table_t *configs, char *path, size_t length, size_t base) {
+    DIR *dp;
+    struct dirent *entry;
+    struct stat st;
+    sha256_t ctx;
+    char hex[SHA256_HEX_SIZE];
+    int n, ok = 1;
+
+    if( !(dp = opendir(path)) ) {
+        return (length == base && ENOENT == errno);  /* no config directory yet */
+    }
+    while(ok && (entry = readdir(dp))) {
+        if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..") ||
+           (length == base && is_roll_file(entry->d_name)))
+        {
+            continue;
+        }
+        n = snprintf(path + length, PATH_MAX - length, "/%s", entry->d_name);
+        if(n >= (int)(PATH_MAX - length) || 0 != lstat(path, &st)) {
+            ok = 0;
+        } else if(S_ISDIR(st.st_mode)) {
+            ok = hash_configs(configs, path, length + n, base);
+        } else if(S_ISREG(st.st_mode)) {
+            sha256_init(&ctx);
+            ok = sha256_file(path, &ctx);
+            if(ok) {
+                sha256_final_hex(&ctx, hex);
+                ok = put_string(configs, path + base + 1, hex);
+            }
+        }
+    }
+    path[length] = '\0';
+    closedir(dp);
+    return ok;
+}
+
+static int read_configs(hash_table_t *configs, const char *config_dir) {
+    char path[PATH_MAX];
+
+    if(!hash_init(configs, 64)) {
+        return 0;
+    }
+    strlcpy(path, config_dir, sizeof(path));
+    return hash_configs(configs, path, strlen(path), strlen(path));
+}
+
+/* are the first n characters of name the name of package without its version? */
+static int is_package_name(const char *name, size_t n, const char *package) {
+    return 0 == strncmp(name, package, n) &&
+           (package[n] == '\0' || (package[n] == '-' && isdigit((unsigned char)package[n + 1])));
+}
+
+/* restart service after configurate, unless it is being restarted anyway */
+static int reconfigure(restart_plan_t *plan, const char *service) {
+    return hash_get(&plan->changed, service) || hash_put(&plan->reconfigured, service, member);
+}
+
+/*
+ * Mark the services that the changed config file path belongs to as
+ * reconfigured. Returns 0 if it belongs to none.
+ */
+static int attribute_config(restart_plan_t *plan, const char *path) {
+    const hash_entry_t *entry;
+    const char *name;
+    size_t i, n;
+    int found = 0;
+
+    /* a script that configurate made is its own service */
+    if(0 == strncmp(path, "rc.d/", 5)) {
+        name = path + 5;
+        return (name[0] == 'S' || name[0] == 'K') && name[1] && reconfigure(plan, name + 1);
+    }
+    n = strcspn(path, "./");
+    for(i = 0; i < plan->new_owners.size; i++) {
+        entry = &plan->new_owners.entries[i];
+        if(!entry->key) {
+            continue;
+        }
+        for(name = entry->key; isdigit((unsigned char)*name); name++)
+            ;
+        if((strlen(name) == n && 0 == strncmp(name, path, n)) ||
+           is_package_name(path, n, (const char *)entry->value))
+        {
+            if(!reconfigure(plan, entry->key)) {
+                return 0;
+            }
+            found = 1;
+        }
+    }
+    return found;
+}
+
+/*
+ * Find the services whose package differs between old_tree, the tree in
+ * use, and new_tree, and remember the config files as they are before
+ * configurate. Returns 0 if that cannot be told, and everything should
+ * be restarted.
+ */
+int restart_plan_init(restart_plan_t *plan, const char *old_tree, const char *new_tree,
+                      const char *stow_dir, const char *config_dir)
+{
+    const hash_table_t *tables[2];
+    const hash_entry_t *entry;
+    const char *other;
+    char real_stow_dir[PATH_MAX];
+    size_t i;
+    int t;
+
+    memset(plan, 0, sizeof(restart_plan_t));
+    if(!realpath(stow_dir, real_stow_dir) ||
+       !hash_init(&plan->old_owners, 64) ||
+       !hash_init(&plan->new_owners, 64) ||
+       !hash_init(&plan->changed, 16) ||
+       !hash_init(&plan->reconfigured, 16) ||
+       !read_owners(&plan->old_owners, old_tree, real_stow_dir) ||
+       !read_owners(&plan->new_owners, new_tree, real_stow_dir) ||
+       !read_configs(&plan->old_configs, config_dir))
+    {
+        goto error;
+    }
+
+    tables[0] = &plan->old_owners;
+    tables[1] = &plan->new_owners;
+    for(t = 0; t < 2; t++) {
+        for(i = 0; i < tables[t]->size; i++) {
+            entry = &tables[t]->entries[i];
+            if(!entry->key) {
+                continue;
+            }
+            other = (const char *)hash_get(tables[1 - t], entry->key);
+            if((!other || strcmp(other, (const char *)entry->value)) &&
+               !hash_put(&plan->changed, entry->key, member))
+            {
+                goto error;
+            }
+        }
+    }
+    return 1;
+ error:
+    log_error("  Cannot tell which services have changed: %s", strerror(errno));
+    restart_plan_free(plan);
+    return 0;
+}
+
+/* add the services in from to to */
+static int add_services(hash_table_t *to, const hash_table_t *from, const hash_table_t *except) {
+    size_t i;
+
+    for(i = 0; i < from->size; i++) {
+        if(from->entries[i].key && !(except && hash_get(except, from->entries[i].key)) &&
+           !hash_put(to, from->entries[i].key, member))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Find the services whose config files configurate changed, which have
+ * to be stopped now, and what to start then. If everything is set, all
+ * services not stopped before the switch are to be stopped, and all to
+ * be started. Returns 0 if that cannot be told, and everything should
+ * be restarted.
+ */
+int restart_plan_configured(restart_plan_t *plan, const char *config_dir) {
+    hash_table_t configs;
+    const hash_table_t *tables[2];
+    const hash_entry_t *entry;
+    const char *other;
+    size_t i;
+    int t;
+
+    memset(&configs, 0, sizeof(configs));
+    if(!read_configs(&configs, config_dir)) {
+        log_error("  Cannot tell which config files have changed: %s", strerror(errno));
+        free_table(&configs);
+        return 0;
+    }
+    /* files that are new or changed, then files that are gone */
+    tables[0] = &configs;
+    tables[1] = &plan->old_configs;
+    for(t = 0; t < 2 && !plan->everything; t++) {
+        for(i = 0; i < tables[t]->size && !plan->everything; i++) {
+            entry = &tables[t]->entries[i];
+            if(!entry->key) {
+                continue;
+            }
+            other = (const char *)hash_get(tables[1 - t], entry->key);
+            if((t == 0 && other && 0 == strcmp(other, (const char *)entry->value)) ||
+               (t == 1 && other))
+            {
+                continue;
+            }
+            if(!attribute_config(plan, entry->key)) {
+                log_info("%s/%s changed, so all services are restarted", config_dir, entry->key);
+                plan->everything = 1;
+            }
+        }
+    }
+    free_table(&configs);
+    if(plan->everything) {
+        hash_free(&plan->reconfigured);
+        if(!add_services(&plan->reconfigured, &plan->new_owners, &plan->changed)) {
+            return 0;
+        }
+    }
+    return add_services(&plan->started, &plan->changed, NULL) &&
+           add_services(&plan->started, &plan->reconfigured, NULL);
+}
+
+void restart_plan_free(restart_plan_t *plan) {
+    free_table(&plan->old_owners);
+    free_table(&plan->new_owners);
+    free_table(&plan->old_configs);
+    free_table(&plan->changed);
+    free_table(&plan->reconfigured);
+    free_table(&plan->started);
+}
@@ -0,0 +1,66 @@
+/* restart.h - Work out which services a roll has to restart.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RESTART_H
+#define RESTART_H
+
+#include "hash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Which services a roll has to stop and start. A service is an rc.d
+ * script's name without the S or K, such as "10nginx".
+ */
+typedef struct restart_plan_s {
+    hash_table_t old_owners;    /* service -> package of its script in the tree in use */
+    hash_table_t new_owners;    /* service -> package of its script in the new tree */
+    hash_table_t old_configs;   /* config file -> hash of its contents before configurate */
+    hash_table_t changed;       /* services whose package changed; stopped before the switch */
+    hash_table_t reconfigured;  /* other services whose config files changed */
+    hash_table_t started;       /* both of those; started after configurate */
+    int everything;             /* a config file changed that belongs to no service */
+} restart_plan_t;
+
+int restart_plan_init(restart_plan_t *plan, const char *old_tree, const char *new_tree,
+                      const char *stow_dir, const char *config_dir);
+int restart_plan_configured(restart_plan_t *plan, const char *config_dir);
+void restart_plan_free(restart_plan_t *plan);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef RESTART_H */
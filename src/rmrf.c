@@ -31,19 +31,484 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#define _XOPEN_SOURCE 500
+/*
+ * Directories are handed out as tasks to a pool of threads. Each thread
+ * works depth first from its own deque and steals the oldest, and so
+ * usually biggest, pending directory from another thread when it runs
+ * out. A directory is removed by whichever thread finishes its last
+ * child. Directories are opened by walking from the top with openat()
+ * one component at a time, so no descriptors are held across tasks and
+ * the depth of the tree does not matter.
+ */
+
+#define _GNU_SOURCE  /* syscall() */
+#include "config.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
 #ifdef HAVE_UNISTD_H
     #include <unistd.h>
 #endif
-#include <ftw.h>
+#ifdef HAVE_SYS_STAT_H
+    #include <sys/stat.h>
+#endif
+#if defined(__linux__)
+    #include <sys/syscall.h>
+#endif
+#include "rmrf.h"
+
+#define RMRF_MAX_THREADS 16
+#define DIRENT_BUFFER_SIZE 32768
+
+/* a directory to empty and remove */
+typedef struct rm_dir_s {
+    struct rm_dir_s *parent;
+    char *path;             /* relative to the top; "" for the top itself */
+    int pending;            /* subdirectories left, plus one until it has been read */
+} rm_dir_t;
+
+typedef struct rm_deque_s {
+    pthread_mutex_t lock;
+    rm_dir_t **tasks;
+    size_t head, tail, size;
+} rm_deque_t;
+
+typedef struct rm_job_s {
+    int top_fd;
+    rm_deque_t *deques;
+    int nthreads;
+    pthread_mutex_t lock;   /* guards everything below */
+    pthread_cond_t wake;
+    int queued;             /* tasks sitting in deques */
+    int done;
+    rmrf_stats_t stats;
+} rm_job_t;
+
+typedef struct rm_worker_s {
+    rm_job_t *job;
+    int id;
+} rm_worker_t;
+
+/* one name read from a directory */
+typedef struct rm_name_s {
+    unsigned char type;
+    char *name;
+} rm_name_t;
+
+static void count(rm_job_t *job, unsigned long *counter, int error) {
+    pthread_mutex_lock(&job->lock);
+    (*counter)++;
+    if(error && !job->stats.first_errno) {
+        job->stats.first_errno = error;
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void failed(rmrf_stats_t *stats, int error) {
+    stats->errors++;
+    if(!stats->first_errno) {
+        stats->first_errno = error;
+    }
+}
+
+/* add what one task did to the totals */
+static void add_stats(rm_job_t *job, const rmrf_stats_t *stats) {
+    pthread_mutex_lock(&job->lock);
+    job->stats.files += stats->files;
+    job->stats.directories += stats->directories;
+    job->stats.errors += stats->errors;
+    if(!job->stats.first_errno) {
+        job->stats.first_errno = stats->first_errno;
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* open a directory below the top without following any symlink */
+static int open_below(rm_job_t *job, const char *path) {
+    const char *component = path, *end;
+    char name[NAME_MAX + 1];
+    int fd = job->top_fd, next;
+
+    for(;;) {
+        while(*component == '/') {
+            component++;
+        }
+        if(!*component) {
+            break;
+        }
+        end = strchr(component, '/');
+        if(!end) {
+            end = component + strlen(component);
+        }
+        if(end - component > NAME_MAX) {
+            errno = ENAMETOOLONG;
+            next = -1;
+        } else {
+            memcpy(name, component, end - component);
+            name[end - component] = '\0';
+            next = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        }
+        if(fd != job->top_fd) {
+            close(fd);
+        }
+        if(next < 0) {
+            return -1;
+        }
+        fd = next;
+        component = end;
+    }
+    return fd == job->top_fd ? dup(fd) : fd;
+}
+
+static int push_name(rm_name_t **names, size_t *count, size_t *size, unsigned char type, const char *name) {
+    rm_name_t *bigger;
+
+    if(*count == *size) {
+        *size = *size ? 2 * *size : 64;
+        if( !(bigger = (rm_name_t *)realloc(*names, *size * sizeof(rm_name_t))) ) {
+            return 0;
+        }
+        *names = bigger;
+    }
+    if( !((*names)[*count].name = strdup(name)) ) {
+        return 0;
+    }
+    (*names)[(*count)++].type = type;
+    return 1;
+}
+
+/* read all names in a directory before anything in it is removed */
+static int read_names(int fd, rm_name_t **names, size_t *count) {
+    size_t size = 0;
+#if defined(__linux__) && defined(SYS_getdents64)
+    /* the layout the kernel uses for getdents64() */
+    struct linux_dirent64 {
+        unsigned long long d_ino;
+        long long d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    } *entry;
+    char buffer[DIRENT_BUFFER_SIZE];
+    long n, offset;
+
+    *names = NULL;
+    *count = 0;
+    while( (n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0 ) {
+        for(offset = 0; offset < n; offset += entry->d_reclen) {
+            entry = (struct linux_dirent64 *)(buffer + offset);
+            if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+                continue;
+            }
+            if(!push_name(names, count, &size, entry->d_type, entry->d_name)) {
+                return 0;
+            }
+        }
+    }
+    return 0 == n;
+#else
+    DIR *dp;
+    struct dirent *entry;
+    int ok = 1;
+
+    *names = NULL;
+    *count = 0;
+    if( (fd = dup(fd)) < 0 || !(dp = fdopendir(fd)) ) {
+        if(fd >= 0) close(fd);
+        return 0;
+    }
+    while(ok && (entry = readdir(dp))) {
+        if(strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
+            ok = push_name(names, count, &size, entry->d_type, entry->d_name);
+        }
+    }
+    closedir(dp);
+    return ok;
+#endif
+}
+
+static void push_task(rm_job_t *job, int id, rm_dir_t *dir) {
+    rm_deque_t *deque = &job->deques[id];
+    rm_dir_t **bigger;
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->tail == deque->size) {
+        if(deque->head > 0) {
+            memmove(deque->tasks, deque->tasks + deque->head,
+                    (deque->tail - deque->head) * sizeof(rm_dir_t *));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+        if(deque->tail == deque->size) {
+            deque->size = deque->size ? 2 * deque->size : 64;
+            bigger = (rm_dir_t **)realloc(deque->tasks, deque->size * sizeof(rm_dir_t *));
+            if(!bigger) {
+                abort();    /* out of memory with the tree half removed */
+            }
+            deque->tasks = bigger;
+        }
+    }
+    deque->tasks[deque->tail++] = dir;
+    pthread_mutex_unlock(&deque->lock);
+
+    pthread_mutex_lock(&job->lock);
+    job->queued++;
+    pthread_cond_signal(&job->wake);
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* newest task of our own deque, or else the oldest of somebody else's */
+static rm_dir_t *next_task(rm_job_t *job, int id) {
+    rm_deque_t *deque;
+    rm_dir_t *dir = NULL;
+    int i, victim;
+
+    for(i = 0; i < job->nthreads && !dir; i++) {
+        victim = (id + i) % job->nthreads;
+        deque = &job->deques[victim];
+        pthread_mutex_lock(&deque->lock);
+        if(deque->head < deque->tail) {
+            dir = (victim == id) ? deque->tasks[--deque->tail] : deque->tasks[deque->head++];
+            if(deque->head == deque->tail) {
+                deque->head = deque->tail = 0;
+            }
+        }
+        pthread_mutex_unlock(&deque->lock);
+    }
+    if(dir) {
+        pthread_mutex_lock(&job->lock);
+        job->queued--;
+        pthread_mutex_unlock(&job->lock);
+    }
+    return dir;
+}
+
+/* a directory has no more work pending: remove it, then maybe its parent */
+static void finish_directory(rm_job_t *job, rm_dir_t *dir) {
+    rm_dir_t *parent;
+    const char *name;
+    int fd, pending;
+
+    while(dir) {
+        pthread_mutex_lock(&job->lock);
+        pending = --dir->pending;
+        pthread_mutex_unlock(&job->lock);
+        if(pending > 0) {
+            return;
+        }
+
+        parent = dir->parent;
+        if(!parent) {
+            /* the top; its own removal is left to the caller */
+            pthread_mutex_lock(&job->lock);
+            job->done = 1;
+            pthread_cond_broadcast(&job->wake);
+            pthread_mutex_unlock(&job->lock);
+        } else {
+            name = strrchr(dir->path, '/');
+            name = name ? name + 1 : dir->path;
+            if( (fd = open_below(job, parent->path)) >= 0 &&
+                0 == unlinkat(fd, name, AT_REMOVEDIR) )
+            {
+                count(job, &job->stats.directories, 0);
+            } else if(ENOENT != errno) {
+                count(job, &job->stats.errors, errno);
+            }
+            if(fd >= 0) close(fd);
+        }
+        free(dir->path);
+        free(dir);
+        dir = parent;
+    }
+}
+
+/* remove the non-directories in a directory and queue its subdirectories */
+static void empty_directory(rm_job_t *job, int id, rm_dir_t *dir) {
+    rm_name_t *names = NULL;
+    rm_dir_t *child;
+    rmrf_stats_t stats;
+    struct stat st;
+    size_t i, n = 0, length;
+    int fd, type;
+
+    memset(&stats, 0, sizeof(rmrf_stats_t));
+    if( (fd = open_below(job, dir->path)) < 0 || !read_names(fd, &names, &n) ) {
+        if(ENOENT != errno) {
+            failed(&stats, errno);
+        }
+    }
+    for(i = 0; i < n; i++) {
+        type = names[i].type;
+        if(DT_UNKNOWN == type) {
+            if(0 != fstatat(fd, names[i].name, &st, AT_SYMLINK_NOFOLLOW)) {
+                if(ENOENT != errno) {
+                    failed(&stats, errno);
+                }
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+        }
+        if(DT_DIR != type) {
+            if(0 == unlinkat(fd, names[i].name, 0)) {
+                stats.files++;
+            } else if(ENOENT != errno) {
+                failed(&stats, errno);
+            }
+            continue;
+        }
+
+        length = strlen(dir->path);
+        child = (rm_dir_t *)calloc(1, sizeof(rm_dir_t));
+        if(!child || !(child->path = (char *)malloc(length + strlen(names[i].name) + 2))) {
+            free(child);
+            failed(&stats, ENOMEM);
+            continue;
+        }
+        sprintf(child->path, "%s%s%s", dir->path, length ? "/" : "", names[i].name);
+        child->parent = dir;
+        child->pending = 1;
+        pthread_mutex_lock(&job->lock);
+        dir->pending++;
+        pthread_mutex_unlock(&job->lock);
+        push_task(job, id, child);
+    }
+    for(i = 0; i < n; i++) {
+        free(names[i].name);
+    }
+    free(names);
+    if(fd >= 0) {
+        close(fd);
+    }
+    add_stats(job, &stats);
+    finish_directory(job, dir);
+}
+
+static void *rm_worker(void *arg) {
+    rm_worker_t *worker = (rm_worker_t *)arg;
+    rm_job_t *job = worker->job;
+    rm_dir_t *dir;
+
+    for(;;) {
+        if( (dir = next_task(job, worker->id)) ) {
+            empty_directory(job, worker->id, dir);
+            continue;
+        }
+        pthread_mutex_lock(&job->lock);
+        if(job->done) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        if(job->queued == 0) {
+            pthread_cond_wait(&job->wake, &job->lock);
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+    return NULL;
+}
+
+/* empty the directory top_fd refers to, using up to nthreads threads */
+static void empty_tree(rm_job_t *job, int nthreads) {
+    rm_worker_t *workers;
+    pthread_t *threads;
+    rm_dir_t *top;
+    int i, started = 0;
+
+    workers = (rm_worker_t *)calloc(nthreads, sizeof(rm_worker_t));
+    threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    job->deques = (rm_deque_t *)calloc(nthreads, sizeof(rm_deque_t));
+    top = (rm_dir_t *)calloc(1, sizeof(rm_dir_t));
+    if(!workers || !threads || !job->deques || !top || !(top->path = strdup(""))) {
+        count(job, &job->stats.errors, ENOMEM);
+        goto error;
+    }
+    job->nthreads = nthreads;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->wake, NULL);
+    for(i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&job->deques[i].lock, NULL);
+        workers[i].job = job;
+        workers[i].id = i;
+    }
+
+    top->pending = 1;
+    push_task(job, 0, top);
+    top = NULL;
+
+    /* this thread is worker 0; the others start only if there is work for them */
+    for(i = 1; i < nthreads; i++) {
+        if(0 != pthread_create(&threads[i], NULL, rm_worker, &workers[i])) {
+            break;
+        }
+        started = i;
+    }
+    rm_worker(&workers[0]);
+    for(i = 1; i <= started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for(i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&job->deques[i].lock);
+        free(job->deques[i].tasks);
+    }
+    pthread_cond_destroy(&job->wake);
+    pthread_mutex_destroy(&job->lock);
+ error:
+    if(top) {
+        free(top->path);
+        free(top);
+    }
+    free(job->deques);
+    free(threads);
+    free(workers);
+}
+
+int rmrf_parallel(const char *path, int nthreads, rmrf_stats_t *stats) {
+    rm_job_t job;
+    struct stat st;
+
+    memset(&job, 0, sizeof(rm_job_t));
+    if(nthreads < 1) {
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if(nthreads < 1) {
+            nthreads = 1;
+        }
+        if(nthreads > RMRF_MAX_THREADS) {
+            nthreads = RMRF_MAX_THREADS;
+        }
+    }
+
+    if(0 != lstat(path, &st)) {
+        if(ENOENT != errno) {
+            failed(&job.stats, errno);
+        }
+    } else if(!S_ISDIR(st.st_mode)) {
+        if(0 == unlink(path)) {
+            job.stats.files++;
+        } else if(ENOENT != errno) {
+            failed(&job.stats, errno);
+        }
+    } else if( (job.top_fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) < 0 ) {
+        failed(&job.stats, errno);
+    } else {
+        empty_tree(&job, nthreads);
+        close(job.top_fd);
+        if(0 == rmdir(path)) {
+            job.stats.directories++;
+        } else if(ENOENT != errno) {
+            failed(&job.stats, errno);
+        }
+    }
 
-static int rmfn(const char *fpath, const struct stat *st, int flag, struct FTW *ftw) {
-    return remove(fpath);
+    if(stats) {
+        memcpy(stats, &job.stats, sizeof(rmrf_stats_t));
+    }
+    return 0 == job.stats.errors;
 }
 
 int rmrf(const char *path) {
-    int rv;
-    rv = nftw(path, rmfn, 64, FTW_DEPTH | FTW_PHYS);
-    return (0 == rv) ? 1 : 0;
+    return rmrf_parallel(path, 0, NULL);
 }
@@ -38,7 +38,16 @@
 extern "C" {
 #endif
 
+/* what rmrf_parallel() did; a path that does not exist counts as removed */
+typedef struct rmrf_stats_s {
+    unsigned long files;        /* files, symlinks and such removed */
+    unsigned long directories;  /* directories removed */
+    unsigned long errors;       /* entries that could not be removed */
+    int first_errno;            /* why the first of those failed */
+} rmrf_stats_t;
+
 int rmrf(const char *path);
+int rmrf_parallel(const char *path, int nthreads, rmrf_stats_t *stats);
 
 #ifdef __cplusplus
 }
@@ -58,6 +58,8 @@
     #include <fcntl.h>
 #endif
 #include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
 #ifdef HAVE_LIMITS_H
     #include <limits.h>
 #endif
@@ -68,15 +70,20 @@
     #include "strlcpy.h"
 #endif
 #include "config_parse.h"
+#include "config_cache.h"
 #include "environ.h"
 #include "packages.h"
 #include "mkpath.h"
-#include "rmrf.h"
-#include "cp.h"
+#include "trash.h"
+#include "snapshot.h"
+#include "state.h"
 #include "download.h"
 #include "local_initd.h"
 #include "local_profiled.h"
-#include "spawn.h"
+#include "run.h"
+#include "rc.h"
+#include "restart.h"
+#include "resolve.h"
 
 #ifndef HOST_NAME_MAX
 #define HOST_NAME_MAX 64
@@ -93,13 +100,30 @@
 #define PACKAGE_DOWNLOAD_DIR_FORMAT "%s/download"
 #define PACKAGE_TEMP_DIR_FORMAT "%s/tmp"
 #define PACKAGE_STOW_DIR_FORMAT "%s/encap"
+#define PACKAGE_MANIFEST_DIR_FORMAT "%s/manifests"
 #define PACKAGE_TARGET_DIR_FORMAT "%s/installed"
+#define PACKAGE_TRASH_DIR_FORMAT "%s/trash"
+#define PACKAGE_SNAPSHOT_DIR_FORMAT "%s/snapshots"
 #define PACKAGE_TARGET_LINK "/usr/local"
+#define PACKAGE_TARGET_LINK_TEMP_FORMAT PACKAGE_TARGET_LINK ".roll.%ld"
+#define TREE_GENERATION_FORMAT "%s.g%lu"
+#define PREBUILT_TREE_FORMAT "%s/%s%s.prebuilt"
+#define PREBUILT_STAMP_FORMAT "%s/.roll-prebuilt"
 #define CONFIG_DIR "/usr/local/etc"
 #define CONFIGURATE "/usr/local/bin/configurate"
+#define RC_SCRIPT_DIR PACKAGE_TARGET_LINK "/etc/rc.d"
 #define PID_FILE "/var/run/roll.pid"
+#define STATE_FILE_NAME "state"
+#define STATE_FILE_FORMAT "%s/" STATE_FILE_NAME
+#define DOWNLOAD_JOBS 4
+#define KEEP_TREES 2
+
+#define STRINGIFY_VALUE(x) #x
+#define STRINGIFY(x) STRINGIFY_VALUE(x)
 
 #define USAGE "usage: roll [options] [hostclass.yml] [host.yml] \n" \
+    "       roll rc {start|stop} [dir]\n" \
+    "       roll resolve [-j jobs] dir\n" \
     "Built "BUILD_DATE", version "ROLL_VERSION"\n"
 #define FULL_USAGE USAGE \
     "  -h, --help        display this help and exit\n" \
@@ -113,6 +137,18 @@
     "  -x, --proxy       optional HTTP Proxy specified as: proxyhost[:port]\n" \
     "  -p, --pidfile     store PID here (default " PID_FILE ")\n" \
     "  -r, --prune       delete unused packages from previous installations\n" \
+    "  -F, --force       roll even if nothing changed since the last roll\n" \
+    "  -I, --incremental update a copy of the last symlink tree instead of building anew\n" \
+    "  -j, --download-jobs  number of packages to download at once (default " STRINGIFY(DOWNLOAD_JOBS) ")\n" \
+    "  -s, --stream      unpack packages while downloading, without saving tarballs\n" \
+    "  -t, --system-tar  unpack packages with /bin/tar instead of the built in extractor\n" \
+    "  -e, --extract-jobs  number of packages to unpack at once (default: one per CPU)\n" \
+    "  -E, --epkg        link packages with the epkg package in the list, not natively\n" \
+    "  -K, --keep-trees  keep this many symlink trees to roll back to, counting the one in use (default " STRINGIFY(KEEP_TREES) ")\n" \
+    "  -L, --legacy-rc   stop and start services by running local_initd, one script at a time\n" \
+    "  -S, --selective-restart  restart only services whose packages or config files changed\n" \
+    "  -R, --rollback    switch back to the newest kept symlink tree and restart services\n" \
+    "  -T, --rollback-to TREE  like --rollback, to TREE: a generation number of the tree in use, or a directory name\n" \
 /*  Don't advertise --dryrun since some steps will still do things to the system.  It's   */
 /*  still useful for testing.  So it remains as a hidden feature.                         */
 /*  "  -n, --dryrun      just print what would happen for some things\n" \                */
@@ -121,6 +157,18 @@ typedef struct options_t_s {
     int failsafe;
     int dryrun;
     int prune;
+    int force;
+    int incremental;
+    int download_jobs;
+    int stream;
+    int system_tar;
+    int extract_jobs;
+    int epkg;
+    int keep_trees;
+    int rollback;
+    int legacy_rc;
+    int selective_restart;
+    char *rollback_tree;
     char *base_url;
     char *package_dir;
     char *local_initd_file;
@@ -136,12 +184,14 @@ typedef struct options_t_s {
 static int parse_commandline (int argc, char *argv[], options_t *options) {
     int ch;
 
-    static const char shortopts[] = "hfrnu:d:i:b:c:o:p:x:";
+    static const char shortopts[] = "hfrFInstELSRu:d:i:b:c:o:p:x:j:e:K:T:";
     static struct option longopts[] = {
         { "help",         no_argument,       NULL, 'h' },
         { "failsafe",     no_argument,       NULL, 'f' },
         { "dryrun",       no_argument,       NULL, 'n' },
         { "prune",        no_argument,       NULL, 'r' },
+        { "force",        no_argument,       NULL, 'F' },
+        { "incremental",  no_argument,       NULL, 'I' },
         { "baseurl",      required_argument, NULL, 'u' },
         { "packagedir",   required_argument, NULL, 'd' },
         { "initd",        required_argument, NULL, 'i' },
@@ -150,6 +200,16 @@ static int parse_commandline (int argc, char *argv[], options_t *options) {
         { "logfile",      required_argument, NULL, 'o' },
         { "pidfile",      required_argument, NULL, 'p' },
         { "proxy",        required_argument, NULL, 'x' },
+        { "download-jobs", required_argument, NULL, 'j' },
+        { "stream",       no_argument,       NULL, 's' },
+        { "system-tar",   no_argument,       NULL, 't' },
+        { "extract-jobs", required_argument, NULL, 'e' },
+        { "epkg",         no_argument,       NULL, 'E' },
+        { "keep-trees",   required_argument, NULL, 'K' },
+        { "rollback",     no_argument,       NULL, 'R' },
+        { "rollback-to",  required_argument, NULL, 'T' },
+        { "legacy-rc",    no_argument,       NULL, 'L' },
+        { "selective-restart", no_argument,  NULL, 'S' },
         { NULL,           0,                 NULL, 0   }
     };
 
@@ -168,6 +228,48 @@ static int parse_commandline (int argc, char *argv[], options_t *options) {
         case 'r':
             options->prune = 1;
             break;
+        case 'F':
+            options->force = 1;
+            break;
+        case 'I':
+            options->incremental = 1;
+            break;
+        case 's':
+            options->stream = 1;
+            break;
+        case 'e':
+            options->extract_jobs = atoi(optarg);
+            if(options->extract_jobs < 1) {
+                fprintf(stderr, "--extract-jobs must be a positive number\n");
+                exit(1);
+            }
+            break;
+        case 't':
+            options->system_tar = 1;
+            break;
+        case 'E':
+            options->epkg = 1;
+            break;
+        case 'K':
+            options->keep_trees = atoi(optarg);
+            if(options->keep_trees < 1) {
+                fprintf(stderr, "--keep-trees must be a positive number\n");
+                exit(1);
+            }
+            break;
+        case 'L':
+            options->legacy_rc = 1;
+            break;
+        case 'S':
+            options->selective_restart = 1;
+            break;
+        case 'R':
+            options->rollback = 1;
+            break;
+        case 'T':
+            options->rollback = 1;
+            options->rollback_tree = optarg;
+            break;
         case 'u':
             options->base_url = optarg;
             break;
@@ -192,6 +294,13 @@ static int parse_commandline (int argc, char *argv[], options_t *options) {
         case 'x':
             options->proxy = optarg;
             break;
+        case 'j':
+            options->download_jobs = atoi(optarg);
+            if(options->download_jobs < 1) {
+                fprintf(stderr, "--download-jobs must be a positive number\n");
+                exit(1);
+            }
+            break;
         default:
             fprintf(stderr, USAGE);
             exit(1);
@@ -279,6 +388,529 @@ static int dir_exists(const char *path) {
     }
 }
 
+/* if suffix is ".g<number>", set generation to the number */
+static int parse_tree_generation(const char *suffix, unsigned long *generation) {
+    char *end;
+
+    if(suffix[0] != '.' || suffix[1] != 'g' || !isdigit((unsigned char)suffix[2])) {
+        return 0;
+    }
+    errno = 0;
+    *generation = strtoul(suffix + 2, &end, 10);
+    return '\0' == *end && 0 == errno;
+}
+
+/* return 1 if tree is one of the generations of the symlink tree tree_name */
+static int is_tree_generation(const char *tree, const char *tree_name) {
+    size_t n = strlen(tree_name);
+    unsigned long generation;
+
+    return 0 == strncmp(tree, tree_name, n) && parse_tree_generation(tree + n, &generation);
+}
+
+/* length of the name of the tree that tree is a generation of, or 0 */
+static size_t tree_name_length(const char *tree) {
+    const char *suffix = strrchr(tree, '.');
+    unsigned long generation;
+
+    return (suffix && parse_tree_generation(suffix, &generation)) ? (size_t)(suffix - tree) : 0;
+}
+
+/*
+ * Every symlink tree is built in a directory of its own, <name>.g<N>, so
+ * that the tree in use never has to be removed to make way for the new
+ * one. Return the generation after the highest one in package_target_dir.
+ */
+static unsigned long next_tree_generation(const char *package_target_dir, const char *tree_name) {
+    DIR *dp;
+    struct dirent *entry;
+    const char *name;
+    unsigned long generation, next = 1;
+    size_t n;
+
+    name = strrchr(tree_name, '/');
+    name = name ? name + 1 : tree_name;
+    n = strlen(name);
+    if(!(dp = opendir(package_target_dir))) {
+        return next;
+    }
+    while(NULL != (entry = readdir(dp))) {
+        if(0 == strncmp(entry->d_name, name, n) &&
+           parse_tree_generation(entry->d_name + n, &generation) &&
+           generation >= next)
+        {
+            next = generation + 1;
+        }
+    }
+    closedir(dp);
+    return next;
+}
+
+/* describe the failsafe tree package_list calls for, to compare with one built ahead of time */
+static int describe_prebuilt_tree(roll_state_t *state, const package_list_t *package_list,
+                                  const char *groups[], const char *tree, int use_epkg)
+{
+    /* the config files do not shape the tree, only the list and how it is linked */
+    hash_roll_inputs(state, "", "", package_list, (use_epkg ? "epkg" : "native"));
+    strlcpy(state->tree, tree, sizeof(state->tree));
+    return set_installed_packages(state, package_list, groups);
+}
+
+/*
+ * Return 1 if the failsafe tree built ahead of time is the one wanted.
+ * What it was built from, if known, is left in prebuilt either way.
+ */
+static int prebuilt_tree_current(const roll_state_t *wanted, roll_state_t *prebuilt) {
+    const package_spec_t *a, *b;
+    size_t i;
+    char stamp[PATH_MAX];
+
+    free_roll_state(prebuilt);
+    if(snprintf(stamp, PATH_MAX, PREBUILT_STAMP_FORMAT, wanted->tree) >= PATH_MAX ||
+       !read_roll_state(prebuilt, stamp))
+    {
+        return 0;
+    }
+    if(strcmp(prebuilt->roll_version, wanted->roll_version) ||
+       strcmp(prebuilt->settings, wanted->settings) ||
+       strcmp(prebuilt->tree, wanted->tree))
+    {
+        return 0;
+    }
+    if(wanted->installed.count != prebuilt->installed.count) {
+        return 0;
+    }
+    for(i = 0; i < wanted->installed.count; i++) {
+        a = &wanted->installed.packages[i];
+        b = &prebuilt->installed.packages[i];
+        if(strcmp(a->package_name, b->package_name) || strcmp(a->group, b->group)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* put a failsafe tree built ahead of time in place, with a stamp of what it was built from */
+static int install_prebuilt_tree(const roll_state_t *built, const char *temp_dir,
+                                 const char *trash_dir)
+{
+    char stamp[PATH_MAX];
+
+    if(snprintf(stamp, PATH_MAX, PREBUILT_STAMP_FORMAT, temp_dir) >= PATH_MAX ||
+       !write_roll_state(built, stamp) ||
+       !trash_move(trash_dir, built->tree))
+    {
+        return 0;
+    }
+    if(0 != rename(temp_dir, built->tree)) {
+        log_error("Cannot move %s to %s: %s", temp_dir, built->tree, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Stop or start services, with action "stop" or "start", all of them or
+ * only those in only. The scripts of each priority are run at once,
+ * unless --legacy-rc asks for local_initd, which runs them all. Either
+ * way, a script that fails fails the roll.
+ */
+static int run_services(const options_t *options, const char *action, const hash_table_t *only) {
+    int exit_code;
+
+    if(options->legacy_rc) {
+        exit_code = run_command(options->local_initd_file, action, NULL);
+        if(0 != exit_code) {
+            log_error("  Could not run %s %s (status = %d)", options->local_initd_file, action, exit_code);
+            return 0;
+        }
+    } else if(0 != (exit_code = run_rc(RC_SCRIPT_DIR, action, only))) {
+        log_error("  Could not %s services in %s (status = %d)", action, RC_SCRIPT_DIR, exit_code);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Point PACKAGE_TARGET_LINK at tree. A symlink to tree is made next to it
+ * and renamed over it, which switches trees in one step; the link never
+ * goes missing, and the old tree stays in place for whatever still has
+ * it open.
+ */
+static int switch_package_tree(const char *tree) {
+    char temp_link[PATH_MAX];
+
+    if(snprintf(temp_link, PATH_MAX, PACKAGE_TARGET_LINK_TEMP_FORMAT, (long)getpid()) >= PATH_MAX) {
+        log_error("Temporary package target link name is too long for buffer");
+        return 0;
+    }
+    unlink(temp_link); /* ignore error */
+    if(0 != symlink(tree, temp_link)) {
+        log_error("Cannot create symlink from %s to %s: %s", temp_link, tree, strerror(errno));
+        return 0;
+    }
+    if(0 != rename(temp_link, PACKAGE_TARGET_LINK)) {
+        log_error("Cannot rename %s to %s: %s", temp_link, PACKAGE_TARGET_LINK, strerror(errno));
+        unlink(temp_link); /* ignore error */
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Find the kept tree to roll back to. requested is a generation of the
+ * tree in use, the name of a tree, or NULL for the newest other than
+ * the one in use.
+ */
+static int find_rollback_tree(const char *package_target_dir, const char *snapshot_dir,
+                              const char *current, const char *requested,
+                              char *tree, size_t size)
+{
+    DIR *dp;
+    struct dirent *entry;
+    struct stat st;
+    char path[PATH_MAX];
+    const char *generation;
+    time_t newest = 0;
+    size_t n;
+
+    tree[0] = '\0';
+    if(requested) {
+        for(generation = requested; isdigit((unsigned char)*generation); generation++) ;
+        if(requested[0] && !*generation) {
+            /* a generation of the tree in use */
+            if(!(n = tree_name_length(current))) {
+                log_error("%s is not a generation of a symlink tree", current);
+                return 0;
+            }
+            if(snprintf(tree, size, "%.*s.g%s", (int)n, current, requested) >= (int)size) {
+                return 0;
+            }
+        } else if(snprintf(tree, size, "%s/%s", package_target_dir, requested) >= (int)size) {
+            return 0;
+        }
+        if(0 != stat(tree, &st) || !S_ISDIR(st.st_mode)) {
+            log_error("There is no symlink tree %s", tree);
+            return 0;
+        }
+    } else {
+        if(!(dp = opendir(package_target_dir))) {
+            log_error("Cannot open %s: %s", package_target_dir, strerror(errno));
+            return 0;
+        }
+        while(NULL != (entry = readdir(dp))) {
+            if(entry->d_name[0] == '.' ||
+               snprintf(path, sizeof(path), "%s/%s", package_target_dir, entry->d_name) >= (int)sizeof(path) ||
+               0 == strcmp(path, current) ||
+               0 != lstat(path, &st) || !S_ISDIR(st.st_mode) ||
+               !snapshot_exists(snapshot_dir, path))
+            {
+                continue;
+            }
+            if(!tree[0] || st.st_mtime > newest) {
+                strlcpy(tree, path, size);
+                newest = st.st_mtime;
+            }
+        }
+        closedir(dp);
+        if(!tree[0]) {
+            log_error("There is no kept symlink tree to roll back to");
+            return 0;
+        }
+    }
+
+    if(0 == strcmp(tree, current)) {
+        log_error("%s is already in use", tree);
+        return 0;
+    }
+    if(!snapshot_exists(snapshot_dir, tree)) {
+        log_error("There is no snapshot of the configuration %s was built from", tree);
+        return 0;
+    }
+    return 1;
+}
+
+/* a file roll_back() replaces, and what it held before */
+typedef struct rollback_file_s {
+    char path[PATH_MAX];
+    buffer_t saved;
+    int existed;
+} rollback_file_t;
+
+static int save_rollback_file(rollback_file_t *file, const char *dir, const char *name) {
+    memset(file, 0, sizeof(rollback_file_t));
+    if(snprintf(file->path, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX) {
+        log_error("File name %s/%s is too long for buffer", dir, name);
+        return 0;
+    }
+    if(buffer_map_file(&file->saved, file->path)) {
+        file->existed = 1;
+    } else if(ENOENT != errno) {
+        log_error("Cannot read %s: %s", file->path, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+/* put back what the file held before; one that did not exist is removed */
+static void restore_rollback_file(rollback_file_t *file) {
+    if(file->existed) {
+        if(!buffer_write_file(&file->saved, file->path, 0644)) {
+            log_error("Cannot restore %s: %s", file->path, strerror(errno));
+        }
+    } else {
+        unlink(file->path); /* ignore error */
+    }
+}
+
+/*
+ * Switch back to a kept symlink tree and the configuration it was built
+ * from, then rerun configurate and restart services. Nothing is
+ * downloaded or linked, so this takes as long as the restart. Once the
+ * services are stopped, a failure puts the tree and configuration back
+ * as they were and starts the services again.
+ */
+static int roll_back(const options_t *options, const char *package_target_dir,
+                     const char *snapshot_dir)
+{
+    char current[PATH_MAX],
+         tree[PATH_MAX],
+         host_snapshot[PATH_MAX],
+         hostclass_snapshot[PATH_MAX],
+         state_snapshot[PATH_MAX],
+         path[PATH_MAX];
+    buffer_t host_buffer,
+             hostclass_buffer,
+             state_buffer;
+    rollback_file_t host_file,
+                    hostclass_file,
+                    previous_state;
+    ssize_t n;
+    int exit_code;
+    int result = 0;
+    int switched = 0;
+    int configured = 0;
+
+    memset(&host_buffer, 0, sizeof(buffer_t));
+    memset(&hostclass_buffer, 0, sizeof(buffer_t));
+    memset(&state_buffer, 0, sizeof(buffer_t));
+    memset(&host_file, 0, sizeof(rollback_file_t));
+    memset(&hostclass_file, 0, sizeof(rollback_file_t));
+    memset(&previous_state, 0, sizeof(rollback_file_t));
+
+    log_header("Rolling back", 0);
+    memset(current, 0, sizeof(current));
+    n = readlink(PACKAGE_TARGET_LINK, current, sizeof(current) - 1);
+    if(n < 0) {
+        log_error("Cannot read %s: %s", PACKAGE_TARGET_LINK, strerror(errno));
+        return 0;
+    }
+    if(!find_rollback_tree(package_target_dir, snapshot_dir, current,
+                           options->rollback_tree, tree, sizeof(tree)))
+    {
+        return 0;
+    }
+    if(!snapshot_path(host_snapshot, PATH_MAX, snapshot_dir, tree, SNAPSHOT_HOST_FILE) ||
+       !snapshot_path(hostclass_snapshot, PATH_MAX, snapshot_dir, tree, SNAPSHOT_HOSTCLASS_FILE) ||
+       !snapshot_path(state_snapshot, PATH_MAX, snapshot_dir, tree, SNAPSHOT_STATE_FILE))
+    {
+        log_error("Snapshot file name is too long for buffer");
+        return 0;
+    }
+    log_message("Rolling back from %s to %s\n", current, tree);
+    if(options->dryrun) {
+        log_info("Skipping in dry run mode");
+        return 1;
+    }
+
+    /* read everything needed, and everything to put back, before anything stops */
+    if(!buffer_map_file(&host_buffer, host_snapshot) ||
+       !buffer_map_file(&hostclass_buffer, hostclass_snapshot))
+    {
+        log_error("Cannot read the snapshot of the configuration: %s", strerror(errno));
+        goto done;
+    }
+    if(!buffer_map_file(&state_buffer, state_snapshot)) {
+        log_info("Cannot read %s; the next roll will not be skipped", state_snapshot);
+    }
+    if(!save_rollback_file(&host_file, options->config_dir, "host.yml") ||
+       !save_rollback_file(&hostclass_file, options->config_dir, "hostclass.yml") ||
+       !save_rollback_file(&previous_state, options->package_dir, STATE_FILE_NAME))
+    {
+        goto done;
+    }
+
+    log_header("Shutting down services", 0);
+    if(!run_services(options, "stop", NULL)) {
+        goto restart;
+    }
+
+    log_header("Moving package link tree into /usr/local", 0);
+    if(0 != unlink(previous_state.path) && ENOENT != errno) {
+        log_error("Cannot remove %s: %s", previous_state.path, strerror(errno));
+        goto restart;
+    }
+    log_message("Switching %s from %s to %s\n", PACKAGE_TARGET_LINK, current, tree);
+    if(!switch_package_tree(tree)) {
+        goto restart;
+    }
+    switched = 1;
+
+    /* the saved copies are no longer what the server last sent */
+    configured = 1;
+    if(snprintf(path, PATH_MAX, "%s/.hostclass.yml.validator", options->config_dir) < PATH_MAX) {
+        unlink(path); /* ignore error */
+    }
+    if(snprintf(path, PATH_MAX, "%s/.host.yml.validator", options->config_dir) < PATH_MAX) {
+        unlink(path); /* ignore error */
+    }
+    if(!buffer_write_file(&hostclass_buffer, hostclass_file.path, 0644)) {
+        log_error("Cannot write hostclass configuration file to %s: %s", hostclass_file.path, strerror(errno));
+        goto restart;
+    }
+    if(!buffer_write_file(&host_buffer, host_file.path, 0644)) {
+        log_error("Cannot write host configuration file to %s: %s", host_file.path, strerror(errno));
+        goto restart;
+    }
+
+    log_header("Processing package configuration scripts", 0);
+    exit_code = run_command(CONFIGURATE,
+                            "--template-outdir", options->config_dir,
+                            hostclass_file.path,
+                            host_file.path,
+                            NULL
+    );
+    if(0 != exit_code) {
+        log_error("  Exit code from %s is %d", CONFIGURATE, exit_code);
+        goto restart;
+    }
+
+    log_header("Starting services", 0);
+    if(!run_services(options, "start", NULL)) {
+        goto done;
+    }
+
+    /* the state of the tree rolled back to describes what is installed again */
+    if(!state_buffer.length || !buffer_write_file(&state_buffer, previous_state.path, 0644)) {
+        log_error("Cannot restore the roll state; the next roll will not be skipped"); /* not fatal */
+    }
+    result = 1;
+    goto done;
+
+ restart:
+    /* put back what was there, and bring the services up on it */
+    log_header("Rollback failed; restoring services", 0);
+    if(switched) {
+        log_message("Switching %s back to %s\n", PACKAGE_TARGET_LINK, current);
+        switch_package_tree(current); /* nothing more to do if this fails */
+    }
+    restore_rollback_file(&previous_state);
+    if(configured) {
+        restore_rollback_file(&hostclass_file);
+        restore_rollback_file(&host_file);
+        if(hostclass_file.existed && host_file.existed) {
+            exit_code = run_command(CONFIGURATE,
+                                    "--template-outdir", options->config_dir,
+                                    hostclass_file.path,
+                                    host_file.path,
+                                    NULL
+            );
+            if(0 != exit_code) {
+                log_error("  Exit code from %s is %d", CONFIGURATE, exit_code);
+            }
+        }
+    }
+    run_services(options, "start", NULL);
+ done:
+    buffer_free(&host_buffer);
+    buffer_free(&hostclass_buffer);
+    buffer_free(&state_buffer);
+    buffer_free(&host_file.saved);
+    buffer_free(&hostclass_file.saved);
+    buffer_free(&previous_state.saved);
+    return result;
+}
+
+/* the validator of the copy of url the last roll saved to cached_file, if any */
+static void load_config_validator(const char *url, const char *cached_file,
+                                  const char *validator_file, download_validator_t *validator)
+{
+    struct stat st;
+
+    if(!(0 == stat(cached_file, &st) && S_ISREG(st.st_mode) &&
+         download_load_validator(validator_file, validator) &&
+         0 == strcmp(validator->url, url)))
+    {
+        memset(validator, 0, sizeof(download_validator_t));
+    }
+}
+
+/* a config file the server did not send again is the copy in cached_file */
+static int use_cached_config(buffer_t *buffer, int modified, const char *cached_file) {
+    if(!modified) {
+        log_info("Not modified since the last roll; using %s", cached_file);
+        if(!buffer_map_file(buffer, cached_file)) {
+            log_error("Cannot read %s: %s", cached_file, strerror(errno));
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Download a config file into buffer. If the copy that the last roll
+ * saved to cached_file is still current, the server answers "304 Not
+ * Modified" and that copy is mapped instead of the file being sent again.
+ */
+static int fetch_config_file(download_context_t *context, const char *url,
+                             buffer_t *buffer, const char *cached_file,
+                             const char *validator_file, download_validator_t *validator)
+{
+    int modified;
+
+    load_config_validator(url, cached_file, validator_file, validator);
+    if(!download_buffer_if_modified(context, url, buffer, validator, &modified)) {
+        return 0;
+    }
+    return use_cached_config(buffer, modified, cached_file);
+}
+
+static int append_to_buffer(void *buffer, const void *data, size_t length) {
+    return buffer_append((buffer_t *)buffer, data, length);
+}
+
+/* like fetch_config_file(), as a job for download_all() */
+static void config_download_job(download_job_t *job, const char *label, const char *url,
+                                buffer_t *buffer, const char *cached_file,
+                                const char *validator_file, download_validator_t *validator)
+{
+    memset(job, 0, sizeof(download_job_t));
+    load_config_validator(url, cached_file, validator_file, validator);
+    job->label = label;
+    job->url = url;
+    job->sink = append_to_buffer;
+    job->sink_data = buffer;
+    job->validator = validator;
+}
+
+/*
+ * The hostclass named in the host file the last roll saved. A host
+ * seldom changes hostclass, so the config of this one is worth fetching
+ * along with the host config, before the new host config names it.
+ */
+static const char *previous_hostclass_tag(host_config_t *previous, const char *host_file) {
+    buffer_t buffer;
+    struct stat st;
+    int ok;
+
+    if(0 != stat(host_file, &st) || !S_ISREG(st.st_mode) || !buffer_map_file(&buffer, host_file)) {
+        return NULL;
+    }
+    ok = parse_host_config(previous, buffer.data, buffer.length);
+    buffer_free(&buffer);
+    return ok ? previous->hostclass_tag : NULL;
+}
+
 int main(int argc, char *argv[]) {
     options_t options;
     int exit_code = 0;
@@ -287,17 +919,36 @@ int main(int argc, char *argv[]) {
     int failsafe_mode = 0;
     int prune_packages = 0;
     int report_errors = 0;
-    FILE *hostclass_file = NULL,
-         *host_file = NULL;
+    int have_previous_state = 0;
+    int use_prebuilt = 0;
+    int selective = 0;
     FILE *fp = NULL;
-    host_config_t host_config;
-    hostclass_config_t hostclass_config;
-    package_spec_t *merged_package_list = NULL;
+    buffer_t hostclass_buffer,
+             host_buffer;
+    const char *previous_tree = NULL;
+    const char *previous_hostclass = NULL;
+    int hostclass_prefetched = 0;
+    int compiled = 0;           /* config was read from config_cache_file */
+    resolved_config_t config;
+    host_config_t previous_host_config;
+    package_list_t kept_packages;
+    download_context_t download_context;
+    download_validator_t hostclass_validator,
+                         host_validator;
+    download_job_t config_jobs[2];
+    fetch_options_t fetch_options;
+    roll_state_t roll_state,
+                 previous_roll_state,
+                 failsafe_tree,         /* what the failsafe tree should be */
+                 prebuilt_tree;         /* what the one built ahead of time is */
+    package_tree_build_t prebuild;
+    restart_plan_t restart_plan;
     struct stat st;
-    char hostclass_file_tmpname[PATH_MAX],  /* "/tmp/hostclass.yml" */
-         hostclass_file_name[PATH_MAX],     /* "/usr/local/etc/hostclass.yml" */
-         host_file_tmpname[PATH_MAX],       /* "/tmp/host.yml" */
+    char hostclass_file_name[PATH_MAX],     /* "/usr/local/etc/hostclass.yml" */
          host_file_name[PATH_MAX],          /* "/usr/local/etc/host.yml" */
+         hostclass_validator_file[PATH_MAX],
+         host_validator_file[PATH_MAX],
+         config_cache_file[PATH_MAX],       /* "/usr/local/etc/.config.compiled" */
          hostclass_config_url[PATH_MAX],
          host_config_url[PATH_MAX],
          download_url_format[PATH_MAX],
@@ -306,11 +957,21 @@ int main(int argc, char *argv[]) {
          package_download_dir[PATH_MAX],
          package_temp_dir[PATH_MAX],
          package_stow_dir[PATH_MAX],
+         package_manifest_dir[PATH_MAX],
          package_target_dir[PATH_MAX],
+         package_link_name[PATH_MAX],
          package_link_dir[PATH_MAX],
+         prebuilt_tree_dir[PATH_MAX],
+         prebuilt_temp_dir[PATH_MAX],
+         package_trash_dir[PATH_MAX],
+         package_snapshot_dir[PATH_MAX],
          local_profiled_file_copy[PATH_MAX], *local_profiled_dir,
+         state_file_name[PATH_MAX],
+         roll_settings[4 * PATH_MAX],
          pathbuf[PATH_MAX];
     char hostname[HOST_NAME_MAX];
+    char host_hash[SHA256_HEX_SIZE],
+         hostclass_hash[SHA256_HEX_SIZE];
     const char *base_groups[] = {"production", NULL};
     const char *failsafe_groups[] = {"failsafe", NULL};
     const char *download_groups[] = {"production", "failsafe", NULL};
@@ -327,21 +988,33 @@ int main(int argc, char *argv[]) {
           if(0 != chmod((path), 0755)) { \
               log_error("Cannot chmod %s directory %s", (label), (path)); \
               goto error; } }
-    #define RMRF_OR_ERROR(label, path) \
-        { if(dir_exists(path) && !rmrf(path)) { \
+    #define TRASH_OR_ERROR(label, path) \
+        { if(dir_exists(path) && !trash_move(package_trash_dir, (path))) { \
               log_error("Cannot remove %s directory %s", (label), (path)); \
               goto error; } }
-    #define CP_OR_ERROR(label, source, dest, dest_mode)       \
-        { if(0 != cp(source, dest, dest_mode)) { \
-              log_error ("Cannot copy %s to destination %s", (label), (dest)); \
+    #define WRITE_OR_ERROR(label, buffer, dest, dest_mode)       \
+        { if(!buffer_write_file(buffer, dest, dest_mode)) { \
+              log_error ("Cannot write %s to %s: %s", (label), (dest), strerror(errno)); \
               goto error; } }
 
-    memset(&host_config, 0, sizeof(host_config_t));
-    memset(&hostclass_config, 0, sizeof(hostclass_config_t));
+    memset(&config, 0, sizeof(resolved_config_t));
+    memset(&previous_host_config, 0, sizeof(host_config_t));
     memset(&options, 0, sizeof(options_t));
-    memset(hostclass_file_tmpname, 0, sizeof(hostclass_file_tmpname));
-    memset(host_file_tmpname, 0, sizeof(host_file_tmpname));
+    memset(&download_context, 0, sizeof(download_context_t));
+    memset(&hostclass_validator, 0, sizeof(download_validator_t));
+    memset(&host_validator, 0, sizeof(download_validator_t));
+    memset(&roll_state, 0, sizeof(roll_state_t));
+    memset(&previous_roll_state, 0, sizeof(roll_state_t));
+    memset(&failsafe_tree, 0, sizeof(roll_state_t));
+    memset(&prebuilt_tree, 0, sizeof(roll_state_t));
+    memset(&prebuild, 0, sizeof(package_tree_build_t));
+    memset(&restart_plan, 0, sizeof(restart_plan_t));
+    memset(&kept_packages, 0, sizeof(package_list_t));
+    memset(prebuilt_tree_dir, 0, sizeof(prebuilt_tree_dir));
+    memset(&hostclass_buffer, 0, sizeof(buffer_t));
+    memset(&host_buffer, 0, sizeof(buffer_t));
     memset(previous_package_link_dir, 0, sizeof(previous_package_link_dir));
+    memset(package_trash_dir, 0, sizeof(package_trash_dir));
 
     options.base_url = BASE_URL;
     options.package_dir = PACKAGE_DIR;
@@ -351,8 +1024,20 @@ int main(int argc, char *argv[]) {
     options.log_file = NULL;
     options.pid_file = PID_FILE;
     options.proxy = NULL;
+    options.download_jobs = DOWNLOAD_JOBS;
+    options.keep_trees = KEEP_TREES;
+    options.extract_jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(options.extract_jobs < 1) {
+        options.extract_jobs = 1;
+    }
 
     /* === Start ====================================================== */
+    if(argc > 1 && 0 == strcmp(argv[1], "rc")) {
+        return rc_main(argc - 1, argv + 1);
+    }
+    if(argc > 1 && 0 == strcmp(argv[1], "resolve")) {
+        return resolve_main(argc - 1, argv + 1);
+    }
     if(!parse_commandline(argc, argv, &options)) {
         goto error;
     }
@@ -389,15 +1074,82 @@ int main(int argc, char *argv[]) {
     if(!get_hostname(hostname)) {
         goto error;
     }
+
+    SNPRINTF_OR_ERROR(
+        "Package target directory name",
+        package_target_dir, PATH_MAX, PACKAGE_TARGET_DIR_FORMAT,
+        options.package_dir
+    );
+    SNPRINTF_OR_ERROR(
+        "Package snapshot directory name",
+        package_snapshot_dir, PATH_MAX, PACKAGE_SNAPSHOT_DIR_FORMAT,
+        options.package_dir
+    );
+
+    /* old trees are set aside here, and removed once the roll is done */
+    SNPRINTF_OR_ERROR(
+        "Package trash directory name",
+        package_trash_dir, PATH_MAX, PACKAGE_TRASH_DIR_FORMAT,
+        options.package_dir
+    );
+    if(!trash_is_empty(package_trash_dir)) {
+        /* left by a roll that did not get that far */
+        log_message("Emptying %s in the background\n", package_trash_dir);
+        if(!trash_collect(package_trash_dir)) {
+            log_error("Cannot start emptying %s", package_trash_dir); /* not fatal */
+        }
+    }
+
+    if(options.rollback) {
+        if(!roll_back(&options, package_target_dir, package_snapshot_dir)) {
+            goto error;
+        }
+        goto done;
+    }
     log_message("Hostname is %s\n", hostname);
 
     /* === Fetch configuration ======================================== */
     log_header("Fetching config files", failsafe_mode);
 
+    /* one download context serves every request of this roll */
+    if(!download_context_init(&download_context, options.proxy)) {
+        goto error;
+    }
+
+    /* the copies saved by the last roll, and how to tell if they are current */
+    SNPRINTF_OR_ERROR(
+        "hostclass configuration file",
+        hostclass_file_name, PATH_MAX, "%s/hostclass.yml",
+        options.config_dir
+    );
+    SNPRINTF_OR_ERROR(
+        "host configuration file",
+        host_file_name, PATH_MAX, "%s/host.yml",
+        options.config_dir
+    );
+    SNPRINTF_OR_ERROR(
+        "hostclass validator file",
+        hostclass_validator_file, PATH_MAX, "%s/.hostclass.yml.validator",
+        options.config_dir
+    );
+    SNPRINTF_OR_ERROR(
+        "host validator file",
+        host_validator_file, PATH_MAX, "%s/.host.yml.validator",
+        options.config_dir
+    );
+    SNPRINTF_OR_ERROR(
+        "compiled config file",
+        config_cache_file, PATH_MAX, "%s/.config.compiled",
+        options.config_dir
+    );
+
     /* fetch host file, a versioned snapshot of a host file */
     if(options.host_file) {
         log_info("Using user specified host file %s", options.host_file);
-        strlcpy(host_file_tmpname, options.host_file, sizeof(host_file_tmpname));
+        if(!buffer_map_file(&host_buffer, options.host_file)) {
+            log_error("Unable to open %s: %s", options.host_file, strerror(errno));
+            goto error;
+        }
     } else {
         /* fetch the host config file */
         SNPRINTF_OR_ERROR(
@@ -405,31 +1157,49 @@ int main(int argc, char *argv[]) {
             host_config_url, PATH_MAX, HOST_CONFIG_URL_FORMAT,
             options.base_url, hostname
         );
-        SNPRINTF_OR_ERROR(
-            "Temporary host filename",
-            host_file_tmpname, PATH_MAX, "/var/tmp/roll_host.%ld",
-            (long)getpid()
-        );
-        unlink(host_file_tmpname); /* ignore error */
+        if(!options.hostclass_file) {
+            previous_hostclass = previous_hostclass_tag(&previous_host_config, host_file_name);
+        }
         log_info("Downloading host config from %s", host_config_url);
-        if(!download(host_config_url, host_file_tmpname, options.proxy)) {
+        if(previous_hostclass) {
+            /* fetch the hostclass config of the last roll at the same time */
+            SNPRINTF_OR_ERROR(
+                "Hostclass configuration URL",
+                hostclass_config_url, PATH_MAX, HOSTCLASS_CONFIG_URL_FORMAT,
+                options.base_url, previous_hostclass
+            );
+            log_info("Downloading hostclass config from %s ahead of time", hostclass_config_url);
+            config_download_job(&config_jobs[0], "host config", host_config_url, &host_buffer,
+                                host_file_name, host_validator_file, &host_validator);
+            config_download_job(&config_jobs[1], "hostclass config", hostclass_config_url, &hostclass_buffer,
+                                hostclass_file_name, hostclass_validator_file, &hostclass_validator);
+            download_all(&download_context, config_jobs, 2, 2); /* each job is checked on its own */
+            if(!config_jobs[0].ok ||
+               !use_cached_config(&host_buffer, config_jobs[0].modified, host_file_name))
+            {
+                goto error;
+            }
+            hostclass_prefetched = config_jobs[1].ok &&
+                use_cached_config(&hostclass_buffer, config_jobs[1].modified, hostclass_file_name);
+        } else if(!fetch_config_file(&download_context, host_config_url, &host_buffer,
+                                     host_file_name, host_validator_file, &host_validator))
+        {
             goto error;
         }
-        log_info("Saved host file to %s", host_file_tmpname);
-    }
-
-    host_file = fopen(host_file_tmpname, "rb");
-    if(!host_file) {
-        log_error("Unable to open %s: %s", host_file_tmpname, strerror(errno));
-        goto error;
     }
 
     /* parse the host file, figure out which hostclass file to fetch */
-    log_info("Parsing host config file");
-    if(!parse_host_config(&host_config, host_file)) {
-        goto error;
+    sha256_hex(host_buffer.data, host_buffer.length, host_hash);
+    if( (compiled = read_config_cache(&config, config_cache_file, host_hash)) ) {
+        log_info("Using the host config compiled in %s", config_cache_file);
+    } else {
+        log_info("Parsing host config file");
+        strlcpy(config.host_hash, host_hash, sizeof(config.host_hash));
+        if(!parse_host_config(&config.host, host_buffer.data, host_buffer.length)) {
+            goto error;
+        }
     }
-    if(!host_config.hostclass_tag) {
+    if(!config.host.hostclass_tag) {
         log_error("The host configuration does not specify a hostclass tag");
         goto error;
     }
@@ -437,57 +1207,98 @@ int main(int argc, char *argv[]) {
     /* fetch hostclass file, a verisioned snapshot of a hostclass file */
     if(options.hostclass_file) {
         log_info("Using user specified hostclass file %s", options.hostclass_file);
-        strlcpy(hostclass_file_tmpname, options.hostclass_file, sizeof(hostclass_file_tmpname));
+        if(!buffer_map_file(&hostclass_buffer, options.hostclass_file)) {
+            log_error("Unable to open %s: %s", options.hostclass_file, strerror(errno));
+            goto error;
+        }
+    } else if(hostclass_prefetched && !strcmp(previous_hostclass, config.host.hostclass_tag)) {
+        log_info("Hostclass is still %s; using the hostclass config fetched ahead of time",
+                 previous_hostclass);
     } else {
         /* fetch the hostclass config file */
         SNPRINTF_OR_ERROR(
             "Hostclass configuration URL",
             hostclass_config_url, PATH_MAX, HOSTCLASS_CONFIG_URL_FORMAT,
-            options.base_url, host_config.hostclass_tag
-        );
-        SNPRINTF_OR_ERROR(
-            "Temporary hostclass filename",
-            hostclass_file_tmpname, PATH_MAX, "/var/tmp/roll_hostclass.%ld",
-            (long)getpid()
+            options.base_url, config.host.hostclass_tag
         );
-        unlink(hostclass_file_tmpname); /* ignore error */
         log_info("Downloading hostclass config from %s", hostclass_config_url);
-        if(!download(hostclass_config_url, hostclass_file_tmpname, options.proxy)) {
+        if(!fetch_config_file(&download_context, hostclass_config_url, &hostclass_buffer,
+                              hostclass_file_name, hostclass_validator_file, &hostclass_validator))
+        {
             goto error;
         }
-        log_info("Saved hostclass config file to %s", hostclass_file_tmpname);
     }
 
-    log_info("Parsing hostclass config file");
-    hostclass_file = fopen(hostclass_file_tmpname, "rb");
-    if(!hostclass_file) {
-        log_error("Unable to open %s: %s", hostclass_file_tmpname, strerror(errno));
-        goto error;
-    }
-    if(!parse_hostclass_config(&hostclass_config, hostclass_file)) {
-        goto error;
+    sha256_hex(hostclass_buffer.data, hostclass_buffer.length, hostclass_hash);
+    if(compiled && !strcmp(config.hostclass_hash, hostclass_hash)) {
+        log_info("Using the hostclass config and package list compiled in %s", config_cache_file);
+    } else {
+        compiled = 0;
+        free_hostclass_config(&config.hostclass);
+        free_package_list(&config.packages);
+        strlcpy(config.hostclass_hash, hostclass_hash, sizeof(config.hostclass_hash));
+        log_info("Parsing hostclass config file");
+        if(!parse_hostclass_config(&config.hostclass, hostclass_buffer.data, hostclass_buffer.length)) {
+            goto error;
+        }
+        if(!merge_package_lists(&config.packages,
+                                &config.hostclass.package_list,
+                                &config.host.package_list))
+        {
+            goto error;
+        }
     }
-    merged_package_list = merge_package_lists(hostclass_config.package_list,
-                                              host_config.package_list);
 
     /* === Configuration ======================================== */
     log_header("Configuration", failsafe_mode);
     /* TODO verify image is defined */
     /* TODO verify current image matches desired image */
 
-    log_message("Hostclass tag:     %s\n", host_config.hostclass_tag);
+    log_message("Hostclass tag:     %s\n", config.host.hostclass_tag);
     log_message("Hardware type:     %s\n", "__TODO__");
     log_message("Current OS image:  %s\n", "__TODO__");
     log_message("Required OS image: %s\n", "__TODO__");
 
-    /* === Download packages ========================================== */
-    log_header("Downloading packages", failsafe_mode);
-
+    /* === Skip the roll if nothing changed =========================== */
     SNPRINTF_OR_ERROR(
         "Package stow directory name",
         package_stow_dir, PATH_MAX, PACKAGE_STOW_DIR_FORMAT,
         options.package_dir
     );
+    SNPRINTF_OR_ERROR(
+        "Package manifest directory name",
+        package_manifest_dir, PATH_MAX, PACKAGE_MANIFEST_DIR_FORMAT,
+        options.package_dir
+    );
+    SNPRINTF_OR_ERROR(
+        "State file name",
+        state_file_name, PATH_MAX, STATE_FILE_FORMAT,
+        options.package_dir
+    );
+    SNPRINTF_OR_ERROR(
+        "Roll settings",
+        roll_settings, sizeof(roll_settings), "%s\n%s\n%s\n%s\nepkg=%d incremental=%d legacy-rc=%d",
+        options.config_dir, options.local_initd_file, options.local_profiled_file,
+        (options.hostclass_file ? "__DEV__" : ""),
+        options.epkg, options.incremental, options.legacy_rc
+    );
+    hash_roll_inputs(&roll_state, config.host_hash, config.hostclass_hash,
+                     &config.packages, roll_settings);
+    have_previous_state = read_roll_state(&previous_roll_state, state_file_name);
+    if(options.force || failsafe_mode) {
+        /* roll regardless */
+    } else if(have_previous_state &&
+              same_roll_inputs(&roll_state, &previous_roll_state) &&
+              roll_state_intact(&previous_roll_state, PACKAGE_TARGET_LINK, package_stow_dir))
+    {
+        log_message("\nNothing changed since the last roll; %s is up to date.\n", previous_roll_state.tree);
+        log_message("Use --force to roll anyway.\n");
+        goto up_to_date;
+    }
+
+    /* === Download packages ========================================== */
+    log_header("Downloading packages", failsafe_mode);
+
     SNPRINTF_OR_ERROR(
         "Package download directory name",
         package_download_dir, PATH_MAX, PACKAGE_DOWNLOAD_DIR_FORMAT,
@@ -504,19 +1315,71 @@ int main(int argc, char *argv[]) {
         options.base_url
     );
     MKPATH_OR_ERROR("package repository", package_stow_dir);
+    MKPATH_OR_ERROR("package manifest", package_manifest_dir);
     MKPATH_OR_ERROR("package download", package_download_dir);
     MKPATH_OR_ERROR("package temp", package_temp_dir);
-    if(!download_packages(merged_package_list,
+    memset(&fetch_options, 0, sizeof(fetch_options_t));
+    fetch_options.download_jobs = options.download_jobs;
+    fetch_options.stream = options.stream;
+    fetch_options.system_tar = options.system_tar;
+    fetch_options.extract_jobs = options.extract_jobs;
+    if(!download_packages(&config.packages,
                           download_groups,
                           download_url_format,
                           package_stow_dir,
+                          package_manifest_dir,
                           package_download_dir,
                           package_temp_dir,
-                          options.proxy))
+                          &download_context,
+                          &fetch_options))
     {
         goto error;
     }
 
+    /* === Build the failsafe tree ahead of time ====================== */
+    /* so that falling back needs no more than the switch to it */
+    SNPRINTF_OR_ERROR(
+        "Prebuilt failsafe symlink tree directory name",
+        prebuilt_tree_dir, PATH_MAX, PREBUILT_TREE_FORMAT,
+        package_target_dir,
+        (options.hostclass_file ? "__FAILSAFE__DEV__" : "__FAILSAFE__"),
+        config.host.hostclass_tag
+    );
+    SNPRINTF_OR_ERROR(
+        "Prebuilt failsafe temp symlink tree directory name",
+        prebuilt_temp_dir, PATH_MAX, "%s.%ld",
+        prebuilt_tree_dir, (long)getpid()
+    );
+    if(!describe_prebuilt_tree(&failsafe_tree, &config.packages, failsafe_groups,
+                               prebuilt_tree_dir, options.epkg))
+    {
+        goto error;
+    }
+    if(failsafe_mode || options.dryrun || !failsafe_tree.installed.count ||
+       !(config.host.has_failsafe || config.hostclass.has_failsafe))
+    {
+        /* nothing to fall back to, or no need */
+    } else if(prebuilt_tree_current(&failsafe_tree, &prebuilt_tree)) {
+        log_info("Failsafe tree %s is up to date", prebuilt_tree_dir);
+    } else {
+        strlcpy(pathbuf, prebuilt_temp_dir, sizeof(pathbuf));
+        if(!trash_move(package_trash_dir, prebuilt_temp_dir) ||
+           (0 != mkpath(pathbuf) && EEXIST != errno) ||
+           !start_package_tree(&prebuild, &config.packages, failsafe_groups,
+                               package_stow_dir, package_manifest_dir,
+                               prebuilt_temp_dir, options.epkg,
+                               /* refresh the last one, if it was built the same way */
+                               ((prebuilt_tree.tree[0] &&
+                                 0 == strcmp(prebuilt_tree.settings, failsafe_tree.settings) &&
+                                 dir_exists(prebuilt_tree_dir)) ? prebuilt_tree_dir : NULL),
+                               &prebuilt_tree.installed))
+        {
+            log_error("Cannot build failsafe tree %s ahead of time", prebuilt_tree_dir); /* not fatal */
+        } else {
+            log_info("Building failsafe tree %s in the background", prebuilt_tree_dir);
+        }
+    }
+
  failsafe:
 
     /* === Build symlink tree ========================================= */
@@ -525,36 +1388,84 @@ int main(int argc, char *argv[]) {
 
     /* Figure out where to put things */
     SNPRINTF_OR_ERROR(
-        "Package target directory name",
-        package_target_dir, PATH_MAX, PACKAGE_TARGET_DIR_FORMAT,
-        options.package_dir
-    );
-    SNPRINTF_OR_ERROR(
-        "Hostclass symlink tree directory name",
-        package_link_dir, PATH_MAX, "%s/%s%s",
+        "Hostclass symlink tree name",
+        package_link_name, PATH_MAX, "%s/%s%s",
         package_target_dir,
         (failsafe_mode ?
             (options.hostclass_file ? "__FAILSAFE__DEV__" : "__FAILSAFE__") :
             (options.hostclass_file ? "__DEV__" : "") ),
-        host_config.hostclass_tag
+        config.host.hostclass_tag
+    );
+    SNPRINTF_OR_ERROR(
+        "Hostclass symlink tree directory name",
+        package_link_dir, PATH_MAX, TREE_GENERATION_FORMAT,
+        package_link_name, next_tree_generation(package_target_dir, package_link_name)
     );
     SNPRINTF_OR_ERROR(
         "Hostclass temp symlink tree directory name",
         temp_package_link_dir, PATH_MAX, "%s.%ld",
-        package_link_dir, (long)getpid()
+        package_link_name, (long)getpid()
     );
 
-    RMRF_OR_ERROR("temporary package link", temp_package_link_dir);
-    MKPATH_OR_ERROR("temporary package link", temp_package_link_dir);
+    TRASH_OR_ERROR("temporary package link", temp_package_link_dir);
+
+    /* falling back is quick if the failsafe tree was built ahead of time */
+    use_prebuilt = 0;
+    if(failsafe_mode && !options.dryrun && prebuilt_tree_dir[0] &&
+       prebuilt_tree_current(&failsafe_tree, &prebuilt_tree))
+    {
+        if(0 == rename(prebuilt_tree_dir, temp_package_link_dir)) {
+            log_info("Using failsafe tree %s, built ahead of time", prebuilt_tree_dir);
+            SNPRINTF_OR_ERROR(
+                "Prebuilt failsafe tree stamp",
+                pathbuf, PATH_MAX, PREBUILT_STAMP_FORMAT,
+                temp_package_link_dir
+            );
+            unlink(pathbuf); /* ignore error */
+            use_prebuilt = 1;
+        } else {
+            log_error("Cannot move %s to %s: %s", prebuilt_tree_dir, temp_package_link_dir, strerror(errno));
+        }
+    }
+    if(!use_prebuilt) {
+        MKPATH_OR_ERROR("temporary package link", temp_package_link_dir);
+    }
+
+    /* the tree of the last roll can be updated, if it is still as it was left */
+    previous_tree = NULL;
+    if(options.incremental && !failsafe_mode && have_previous_state &&
+       is_tree_generation(previous_roll_state.tree, package_link_name) &&
+       roll_state_intact(&previous_roll_state, PACKAGE_TARGET_LINK, package_stow_dir))
+    {
+        previous_tree = previous_roll_state.tree;
+    } else if(options.incremental && !failsafe_mode) {
+        log_info("No intact symlink tree from the last roll; building a new one");
+    }
 
-    if(!create_package_tree(merged_package_list,
+    if(!use_prebuilt &&
+       !create_package_tree(&config.packages,
                             (failsafe_mode ? failsafe_groups : base_groups),
                             package_stow_dir,
-                            temp_package_link_dir))
+                            package_manifest_dir,
+                            temp_package_link_dir,
+                            options.epkg,
+                            previous_tree,
+                            &previous_roll_state.installed))
     {
         goto error;
     }
 
+    if(prebuild.started) {
+        if(finish_package_tree(&prebuild) &&
+           install_prebuilt_tree(&failsafe_tree, prebuilt_temp_dir, package_trash_dir))
+        {
+            log_info("Failsafe tree %s is ready", prebuilt_tree_dir);
+        } else {
+            log_error("Cannot build failsafe tree %s ahead of time", prebuilt_tree_dir); /* not fatal */
+            trash_move(package_trash_dir, prebuilt_temp_dir); /* ignore error */
+        }
+    }
+
     /* !! Any failures from here on out will trigger failsafe mode */
     try_failsafe = 1;
 
@@ -617,46 +1528,48 @@ int main(int argc, char *argv[]) {
 
     /* === Run /etc/init.d/local_initd stop =========================== */
     log_header("Shutting down services", failsafe_mode);
+    restart_plan_free(&restart_plan);
+    selective = 0;
     if(options.dryrun) {
         log_info("Skipping in dry run mode");
     } else {
-        exit_code = run_command(options.local_initd_file, "stop", NULL);
-        if(0 != exit_code) {
-            log_error("  Could not run %s stop (status = %d)", options.local_initd_file, exit_code);
+        /* a failsafe roll is for when something is wrong, so it restarts everything */
+        if(options.selective_restart && !options.legacy_rc && !failsafe_mode) {
+            selective = restart_plan_init(&restart_plan, PACKAGE_TARGET_LINK, temp_package_link_dir,
+                                          package_stow_dir, options.config_dir);
+        }
+        if(selective) {
+            log_info("Stopping %lu services whose packages changed", (unsigned long)restart_plan.changed.count);
+        }
+        if(!run_services(&options, "stop", selective ? &restart_plan.changed : NULL)) {
             goto error;
         }
     }
 
     /* === Move symlink tree into place =============================== */
     log_header("Moving package link tree into /usr/local", failsafe_mode);
-    if(options.dryrun) {
-        log_info("Skipping in dry run mode");
-    } else {
-        if(0 == lstat(PACKAGE_TARGET_LINK, &st)) {
-            if(S_ISLNK(st.st_mode)) {
-                log_message("Removing old %s symlink\n", PACKAGE_TARGET_LINK);
-
-                /* Remember the current value for later; ignore error */
-                readlink(PACKAGE_TARGET_LINK, previous_package_link_dir, PATH_MAX);
 
-                if(0 != unlink(PACKAGE_TARGET_LINK)) {
-                    log_error("Cannot unlink %s: %s", PACKAGE_TARGET_LINK, strerror(errno));
-                    goto error;
-                }
-            } else {
-                log_error("%s is expected to be missing or a symlink", PACKAGE_TARGET_LINK);
-                goto error;
-            }
-        } else {
-            if(ENOENT != errno) {
-                log_error("%s: cannot stat", PACKAGE_TARGET_LINK);
-                goto error;
-            }
+    /* Remember the current tree for later */
+    memset(previous_package_link_dir, 0, sizeof(previous_package_link_dir));
+    if(0 == lstat(PACKAGE_TARGET_LINK, &st)) {
+        if(S_ISLNK(st.st_mode)) {
+            readlink(PACKAGE_TARGET_LINK, previous_package_link_dir, PATH_MAX - 1); /* ignore error */
+        } else if(!options.dryrun) {
+            log_error("%s is expected to be missing or a symlink", PACKAGE_TARGET_LINK);
+            goto error;
         }
+    } else if(ENOENT != errno) {
+        log_error("%s: cannot stat", PACKAGE_TARGET_LINK);
+        goto error;
+    }
 
-        if(dir_exists(package_link_dir)) {
-            log_message("Removing old link tree\n");
-            RMRF_OR_ERROR("old package link", package_link_dir);
+    if(options.dryrun) {
+        log_info("Skipping in dry run mode");
+    } else {
+        /* the state no longer describes what is installed until this roll succeeds */
+        if(0 != unlink(state_file_name) && ENOENT != errno) {
+            log_error("Cannot remove %s: %s", state_file_name, strerror(errno));
+            goto error;
         }
 
         log_message("Moving link tree to %s\n", package_link_dir);
@@ -665,32 +1578,28 @@ int main(int argc, char *argv[]) {
             goto error;
         }
 
-        log_message("Creating symlink from %s to %s\n", PACKAGE_TARGET_LINK, package_link_dir);
-        if(0 != symlink(package_link_dir, PACKAGE_TARGET_LINK)) {
-            log_error("Cannot create symlink from %s to %s: %s", PACKAGE_TARGET_LINK, package_link_dir, strerror(errno));
+        log_message("Switching %s from %s to %s\n", PACKAGE_TARGET_LINK,
+                    (previous_package_link_dir[0] ? previous_package_link_dir : "nothing"),
+                    package_link_dir);
+        if(!switch_package_tree(package_link_dir)) {
             goto error;
         }
     }
 
-    /* === Copy hostclass file and host file to config_dir ====== */
-    SNPRINTF_OR_ERROR(
-        "hostclass configuration file",
-        hostclass_file_name, PATH_MAX, "%s/hostclass.yml",
-        options.config_dir
-    );
-    CP_OR_ERROR("hostclass configuration file",
-        hostclass_file_tmpname,
+    /* === Save hostclass file and host file in config_dir ====== */
+    MKPATH_OR_ERROR("config output directory", options.config_dir);
+
+    /* the validators only describe these copies once the roll succeeds */
+    unlink(hostclass_validator_file); /* ignore error */
+    unlink(host_validator_file); /* ignore error */
+    WRITE_OR_ERROR("hostclass configuration file",
+        &hostclass_buffer,
         hostclass_file_name,
         0644
     );
 
-    SNPRINTF_OR_ERROR(
-        "host configuration file",
-        host_file_name, PATH_MAX, "%s/host.yml",
-        options.config_dir
-    );
-    CP_OR_ERROR("host configuration file",
-        host_file_tmpname,
+    WRITE_OR_ERROR("host configuration file",
+        &host_buffer,
         host_file_name,
         0644
     );
@@ -698,12 +1607,10 @@ int main(int argc, char *argv[]) {
     /* === Run configuration scripts ================================== */
     log_header("Processing package configuration scripts", failsafe_mode);
 
-    MKPATH_OR_ERROR("config output directory", options.config_dir);
-
     exit_code = run_command(CONFIGURATE,
                             "--template-outdir", options.config_dir,
-                            hostclass_file_tmpname,
-                            host_file_tmpname,
+                            hostclass_file_name,
+                            host_file_name,
                             NULL
     );
     if(0 != exit_code) {
@@ -716,9 +1623,24 @@ int main(int argc, char *argv[]) {
     if(options.dryrun) {
         log_info("Skipping in dry run mode");
     } else {
-        exit_code = run_command(options.local_initd_file, "start", NULL);
-        if(0 != exit_code) {
-            log_error("  Could not run %s start", options.local_initd_file);
+        if(selective) {
+            if(!restart_plan_configured(&restart_plan, options.config_dir)) {
+                selective = 0;
+                log_info("Stopping all services");
+                run_services(&options, "stop", NULL); /* the old scripts are gone; ignore error */
+            } else if(restart_plan.reconfigured.count > 0) {
+                log_info((restart_plan.everything ? "Stopping the other %lu services" :
+                                                    "Stopping %lu services whose config files changed"),
+                         (unsigned long)restart_plan.reconfigured.count);
+                run_services(&options, "stop", &restart_plan.reconfigured); /* ignore error */
+            }
+        }
+        if(selective && !restart_plan.everything) {
+            log_info("Starting %lu services", (unsigned long)restart_plan.started.count);
+        }
+        if(!run_services(&options, "start",
+                         (selective && !restart_plan.everything) ? &restart_plan.started : NULL))
+        {
             goto error;
         }
     }
@@ -731,25 +1653,72 @@ int main(int argc, char *argv[]) {
         /* ignore errors */
         clean_previous_package_trees(package_target_dir,
                                      options.dryrun ? temp_package_link_dir : package_link_dir,
-                                     previous_package_link_dir);
+                                     previous_package_link_dir,
+                                     prebuilt_tree_dir,
+                                     options.keep_trees,
+                                     package_snapshot_dir,
+                                     package_trash_dir);
         if(options.dryrun) {
           log_info("Skipping package prune in dry run mode");
         }
         else if (prune_packages) {
           log_info("Removing unused packages from prior installations.");
-          clean_previous_packages(merged_package_list,
-                                  package_stow_dir);
+          /* the trees kept to roll back to still need theirs */
+          if(!snapshot_packages(&kept_packages, package_snapshot_dir)) {
+              log_error("Cannot tell which packages older trees use; not removing any"); /* not fatal */
+          } else {
+              clean_previous_packages(&config.packages,
+                                      &kept_packages,
+                                      package_stow_dir,
+                                      package_manifest_dir,
+                                      package_trash_dir);
+          }
         }
     } else {
         log_info("Not removing package target directories from prior installations in failsafe mode.");
     }
 
+    /* remember what was installed, so that the next roll can skip it all */
+    if(!failsafe_mode && !options.dryrun) {
+        strlcpy(roll_state.tree, package_link_dir, sizeof(roll_state.tree));
+        if(!set_installed_packages(&roll_state, &config.packages, base_groups) ||
+           !write_roll_state(&roll_state, state_file_name))
+        {
+            log_error("Cannot save roll state; the next roll will not be skipped"); /* not fatal */
+        } else if(!snapshot_save(package_snapshot_dir, package_link_dir,
+                                 host_file_name, hostclass_file_name,
+                                 state_file_name, package_trash_dir))
+        {
+            log_error("Cannot save a snapshot of the configuration; %s cannot be rolled back to", package_link_dir); /* not fatal */
+        }
+    }
+
+ up_to_date:
+    /* remember what was fetched, so that an unchanged config is not sent again */
+    if(hostclass_validator.url[0] &&
+       !download_save_validator(hostclass_validator_file, &hostclass_validator))
+    {
+        log_error("Cannot write %s", hostclass_validator_file); /* not fatal */
+    }
+    if(host_validator.url[0] &&
+       !download_save_validator(host_validator_file, &host_validator))
+    {
+        log_error("Cannot write %s", host_validator_file); /* not fatal */
+    }
+    if(!compiled && !options.dryrun && !write_config_cache(&config, config_cache_file)) {
+        log_error("Cannot write %s: %s", config_cache_file, strerror(errno)); /* not fatal */
+    }
+
     /* TODO reboot if necessary */
 
     goto done;
  error:
+    if(prebuild.started) {
+        finish_package_tree(&prebuild);
+        trash_move(package_trash_dir, prebuilt_temp_dir); /* ignore error */
+    }
     if(!failsafe_mode && try_failsafe) {
-        if(host_config.has_failsafe || hostclass_config.has_failsafe) {
+        if(config.host.has_failsafe || config.hostclass.has_failsafe) {
             failsafe_mode = 1;
             log_message("\n!!! Falling back to failsafe configuration...\n");
             goto failsafe;
@@ -760,22 +1729,27 @@ int main(int argc, char *argv[]) {
     }
     exit_code = 1;
  done:
-    if(host_file)
-        fclose(host_file);
-    host_file = NULL;
-    if(host_file_tmpname[0] && !options.host_file)
-        unlink(host_file_tmpname);
-    free_host_config(&host_config);
-
-    if(hostclass_file)
-        fclose(hostclass_file);
-    hostclass_file = NULL;
-    if(hostclass_file_tmpname[0] && !options.hostclass_file)
-        unlink(hostclass_file_tmpname);
-    free_hostclass_config(&hostclass_config);
-
-    if(merged_package_list)
-        free_package_list(merged_package_list);
+    buffer_free(&host_buffer);
+    buffer_free(&hostclass_buffer);
+    free_resolved_config(&config);
+    free_host_config(&previous_host_config);
+
+    free_package_list(&kept_packages);
+    free_roll_state(&roll_state);
+    free_roll_state(&previous_roll_state);
+    free_roll_state(&failsafe_tree);
+    free_roll_state(&prebuilt_tree);
+    restart_plan_free(&restart_plan);
+
+    download_context_cleanup(&download_context);
+
+    /* everything set aside is removed now that services are back */
+    if(package_trash_dir[0] && !trash_is_empty(package_trash_dir)) {
+        log_message("\nEmptying %s in the background\n", package_trash_dir);
+        if(!trash_collect(package_trash_dir)) {
+            log_error("Cannot start emptying %s; the next roll will", package_trash_dir);
+        }
+    }
 
     if(report_errors) {
         if(failsafe_mode) {
@@ -806,5 +1780,5 @@ int main(int argc, char *argv[]) {
 
     #undef SNPRINTF_OR_ERROR
     #undef MKPATH_OR_ERROR
-    #undef RMRF_OR_ERROR
+    #undef TRASH_OR_ERROR
 }
@@ -0,0 +1,342 @@
+/* run.c - Spawns a child process.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Children are started with posix_spawn(), which does not copy the page
+ * tables of a big parent, and exec right away. Their stdout and stderr
+ * go to a non-blocking pipe; one poll() loop serves any number of them
+ * at once and logs their output a whole line at a time, each line with
+ * the prefix of the child it came from. A child that runs past its
+ * timeout is sent SIGTERM, then SIGKILL.
+ */
+
+#define _GNU_SOURCE  /* pipe2(), posix_spawn_file_actions_addchdir_np() */
+#include "config.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#ifdef HAVE_SYS_TYPES_H
+    #include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_WAIT_H
+    #include <sys/wait.h>
+#endif
+#ifdef HAVE_UNISTD_H
+    #include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+    #include <fcntl.h>
+#endif
+#if !defined(HAVE_STRLCPY) && !HAVE_DECL_STRLCPY
+    #include "strlcpy.h"
+#endif
+#include "run.h"
+#include "log.h"
+
+#define MAX_ARGS 256
+#define READ_BUFFER_SIZE 4096
+#define MAX_CHILDREN 256
+#define SPAWN_POLL_INTERVAL 250     /* ms; to notice children whose pipe stays open */
+#define SPAWN_REAP_INTERVAL 10      /* ms; a child that closed its pipe is about to exit */
+#define SPAWN_KILL_GRACE 5          /* seconds from SIGTERM to SIGKILL */
+
+/* Set a static environment for subprocesses */
+static char *const DEFAULT_ENV[] = {
+    "PATH=/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin",
+    NULL
+};
+
+#ifndef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+/* without a chdir file action, a shell changes to dir and then runs argv */
+static char *const *in_directory(const char *dir, char *const argv[], char *shell_argv[]) {
+    int argc;
+
+    shell_argv[0] = "/bin/sh";
+    shell_argv[1] = "-c";
+    shell_argv[2] = "cd \"$0\" && exec \"$@\"";
+    shell_argv[3] = (char *)dir;
+    for(argc = 0; argv[argc] && argc < MAX_ARGS - 5; argc++) {
+        shell_argv[4 + argc] = argv[argc];
+    }
+    shell_argv[4 + argc] = NULL;
+    return shell_argv;
+}
+#endif
+
+/*
+ * Start argv[0] with argv in dir (or here, if NULL) with environment envp
+ * (or the default one, if NULL). Its output is logged as spawn_wait()
+ * reads it, each line preceded by prefix. If timeout is positive, the
+ * child is stopped after that many seconds. Returns 0 if it could not be
+ * started.
+ */
+int spawn_command(spawn_child_t *child, const char *prefix, int timeout,
+                  const char *dir, char *const envp[], char *const argv[])
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    sigset_t default_signals;
+    char *const *command = argv;
+#ifndef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+    char *shell_argv[MAX_ARGS];
+#endif
+    int pipefd[2];
+    int rc;
+
+    memset(child, 0, sizeof(spawn_child_t));
+    child->fd = -1;
+    child->exit_code = -1;
+    child->timeout = timeout;
+    strlcpy(child->prefix, prefix ? prefix : "", sizeof(child->prefix));
+    strlcpy(child->name, argv[0], sizeof(child->name));
+
+    /* close-on-exec, so children started by other threads don't hold
+       our pipe open */
+#ifdef HAVE_PIPE2
+    if(pipe2(pipefd, O_CLOEXEC) == -1) {
+        log_error("Cannot create a pipe for %s: %s", argv[0], strerror(errno));
+        return 0;
+    }
+#else
+    if(pipe(pipefd) == -1) {
+        log_error("Cannot create a pipe for %s: %s", argv[0], strerror(errno));
+        return 0;
+    }
+    fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+    /* the child gets the pipe as stdout and stderr, and SIGPIPE back,
+       as libcurl may have us ignoring it */
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], 1);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], 2);
+    if(dir) {
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+        posix_spawn_file_actions_addchdir_np(&actions, dir);
+#else
+        command = in_directory(dir, argv, shell_argv);
+#endif
+    }
+    posix_spawnattr_init(&attributes);
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attributes, &default_signals);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF);
+
+    rc = posix_spawn(&child->pid, command[0], &actions, &attributes, command,
+                     envp ? envp : DEFAULT_ENV);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    if(0 != rc) {
+        log_error("Cannot run %s: %s", argv[0], strerror(rc));
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return 0;
+    }
+
+    close(pipefd[1]); /* close write end of pipe */
+    fcntl(pipefd[0], F_SETFL, fcntl(pipefd[0], F_GETFL) | O_NONBLOCK);
+    child->fd = pipefd[0];
+    child->running = 1;
+    child->deadline = (timeout > 0) ? time(NULL) + timeout : 0;
+    return 1;
+}
+
+/* log what is left of a line that did not end in a newline */
+static void flush_output(spawn_child_t *child) {
+    if(child->length > 0) {
+        log_message("%s%.*s\n", child->prefix, (int)child->length, child->line);
+        child->length = 0;
+    }
+}
+
+static void close_output(spawn_child_t *child) {
+    flush_output(child);
+    close(child->fd);
+    child->fd = -1;
+}
+
+/* log each whole line that is ready; close the pipe at end of file */
+static void read_output(spawn_child_t *child) {
+    char buffer[READ_BUFFER_SIZE];
+    char *start, *end;
+    ssize_t n;
+    size_t length;
+
+    while( (n = read(child->fd, buffer, sizeof(buffer))) != 0 ) {
+        if(n < 0) {
+            if(EINTR == errno) {
+                continue;
+            }
+            if(EAGAIN != errno && EWOULDBLOCK != errno) {
+                close_output(child);
+            }
+            return;
+        }
+        for(start = buffer; start < buffer + n; start = end) {
+            end = memchr(start, '\n', buffer + n - start);
+            end = end ? end + 1 : buffer + n;
+            length = end - start;
+            if(child->length + length > sizeof(child->line)) {
+                flush_output(child); /* too long to keep whole */
+            }
+            memcpy(child->line + child->length, start, length);
+            child->length += length;
+            if(child->line[child->length - 1] == '\n') {
+                log_message("%s%.*s", child->prefix, (int)child->length, child->line);
+                child->length = 0;
+            }
+        }
+    }
+    close_output(child);
+}
+
+/* send SIGTERM at the deadline, and SIGKILL if that is not enough */
+static void enforce_timeout(spawn_child_t *child, time_t now) {
+    if(!child->running || !child->deadline || now < child->deadline) {
+        return;
+    }
+    if(!child->timed_out) {
+        log_error("%s%s did not finish in %d second%s; stopping it",
+                  child->prefix, child->name, child->timeout, child->timeout == 1 ? "" : "s");
+        child->timed_out = 1;
+        kill(child->pid, SIGTERM);
+        child->deadline = now + SPAWN_KILL_GRACE;
+    } else {
+        kill(child->pid, SIGKILL);
+        child->deadline = 0;
+    }
+}
+
+static void reap(spawn_child_t *child) {
+    int status;
+
+    if(waitpid(child->pid, &status, WNOHANG) != child->pid) {
+        return;
+    }
+    child->running = 0;
+    child->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+    /* whatever it left in the pipe; anything it started that still
+       holds the pipe open is not waited for */
+    if(child->fd >= 0) {
+        read_output(child);
+    }
+    if(child->fd >= 0) {
+        close_output(child);
+    }
+}
+
+/* wait for all n children, logging their output; returns once all have exited */
+void spawn_wait(spawn_child_t *children, int n) {
+    struct pollfd fds[MAX_CHILDREN];
+    spawn_child_t *polled[MAX_CHILDREN];
+    int i, nfds, active, wait_ms, ms;
+    time_t now;
+
+    for(;;) {
+        nfds = 0;
+        active = 0;
+        wait_ms = -1;
+        now = time(NULL);
+        for(i = 0; i < n; i++) {
+            if(children[i].running) {
+                reap(&children[i]);
+            }
+            enforce_timeout(&children[i], now);
+            if(!children[i].running && children[i].fd < 0) {
+                continue;
+            }
+            active++;
+            if(children[i].fd >= 0 && nfds < MAX_CHILDREN) {
+                fds[nfds].fd = children[i].fd;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                polled[nfds++] = &children[i];
+            }
+            if(children[i].running) {
+                ms = (children[i].fd >= 0) ? SPAWN_POLL_INTERVAL : SPAWN_REAP_INTERVAL;
+                if(children[i].deadline && (children[i].deadline - now) * 1000 < ms) {
+                    ms = (children[i].deadline - now) * 1000;
+                }
+                if(wait_ms < 0 || ms < wait_ms) {
+                    wait_ms = ms;
+                }
+            }
+        }
+        if(!active) {
+            return;
+        }
+        if(poll(fds, nfds, wait_ms) > 0) {
+            for(i = 0; i < nfds; i++) {
+                if(fds[i].revents) {
+                    read_output(polled[i]);
+                }
+            }
+        }
+    }
+}
+
+/* run argv[0] with argv and wait for it; returns its exit code, or -1 */
+int run_command_argv(const char *prefix, int timeout, char *const argv[]) {
+    spawn_child_t child;
+
+    if(!spawn_command(&child, prefix, timeout, NULL, NULL, argv)) {
+        return -1;
+    }
+    spawn_wait(&child, 1);
+    return child.exit_code;
+}
+
+int run_command(const char *command, ...) {
+    va_list ap;
+    char *argv[MAX_ARGS];
+    int argc = 0;
+
+    argv[argc++] = (char *)command; /* arg[0] is the command name */
+    va_start(ap, command);
+    while( (argc < MAX_ARGS) &&
+           (argv[argc++] = va_arg(ap, char *)) != (char *)0) ;
+    va_end(ap);
+    if(argc == MAX_ARGS) {
+        return -1;
+    }
+
+    return run_command_argv("", 0, argv);
+}
@@ -0,0 +1,73 @@
+/* run.h - Spawns a child process.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RUN_H
+#define RUN_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAX_PREFIX_SIZE 128
+#define MAX_COMMAND_NAME_SIZE 256
+#define MAX_OUTPUT_LINE_SIZE 4096
+
+/* a command started by spawn_command() */
+typedef struct spawn_child_s {
+    pid_t pid;
+    int fd;                             /* its stdout and stderr, or -1 once closed */
+    int running;
+    int exit_code;                      /* once it has exited; -1 if killed */
+    int timeout;
+    int timed_out;
+    time_t deadline;                    /* when to stop it, or 0 */
+    char prefix[MAX_PREFIX_SIZE];       /* logged before each line of output */
+    char name[MAX_COMMAND_NAME_SIZE];
+    char line[MAX_OUTPUT_LINE_SIZE];    /* output up to the next newline */
+    size_t length;
+} spawn_child_t;
+
+int spawn_command(spawn_child_t *child, const char *prefix, int timeout,
+                  const char *dir, char *const envp[], char *const argv[]);
+void spawn_wait(spawn_child_t *children, int n);
+int run_command_argv(const char *prefix, int timeout, char *const argv[]);
+int run_command(const char *command, ...);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef RUN_H */
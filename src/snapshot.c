@@ -0,0 +1,218 @@
+/* snapshot.c - Keep the configuration each symlink tree was built from.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Rolling back to a retained symlink tree needs the host and hostclass
+ * files it was built from, for configurate, and the roll state that
+ * describes it. These are copied aside when a roll succeeds, and go
+ * when the tree does.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#ifdef HAVE_SYS_TYPES_H
+    #include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+    #include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+    #include <unistd.h>
+#endif
+#ifdef HAVE_LIMITS_H
+    #include <limits.h>
+#endif
+#include "snapshot.h"
+#include "cp.h"
+#include "mkpath.h"
+#include "trash.h"
+#include "state.h"
+#if !defined(HAVE_STRLCPY) && !HAVE_DECL_STRLCPY
+    #include "strlcpy.h"
+#endif
+
+#define SNAPSHOT_NEW_SUFFIX ".new"
+
+/* the last component of tree, which names its snapshot */
+static const char *tree_name(const char *tree) {
+    const char *name = strrchr(tree, '/');
+    return name ? name + 1 : tree;
+}
+
+/* path of file in the snapshot of tree, or of the snapshot itself if file is NULL */
+int snapshot_path(char *path, size_t size, const char *snapshot_dir,
+                  const char *tree, const char *file)
+{
+    int n;
+
+    if(file) {
+        n = snprintf(path, size, "%s/%s/%s", snapshot_dir, tree_name(tree), file);
+    } else {
+        n = snprintf(path, size, "%s/%s", snapshot_dir, tree_name(tree));
+    }
+    return n >= 0 && (size_t)n < size;
+}
+
+/* return 1 if there is a complete snapshot of tree */
+int snapshot_exists(const char *snapshot_dir, const char *tree) {
+    const char *files[] = {SNAPSHOT_HOST_FILE, SNAPSHOT_HOSTCLASS_FILE, SNAPSHOT_STATE_FILE, NULL};
+    char path[PATH_MAX];
+    struct stat st;
+    int i;
+
+    for(i = 0; files[i]; i++) {
+        if(!snapshot_path(path, sizeof(path), snapshot_dir, tree, files[i]) ||
+           0 != stat(path, &st) || !S_ISREG(st.st_mode))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* copy the files tree was built from into its snapshot, replacing any old one */
+int snapshot_save(const char *snapshot_dir, const char *tree,
+                  const char *host_file, const char *hostclass_file,
+                  const char *state_file, const char *trash_dir)
+{
+    char snapshot[PATH_MAX],
+         temp[PATH_MAX],
+         path[PATH_MAX];
+
+    if(!snapshot_path(snapshot, sizeof(snapshot), snapshot_dir, tree, NULL) ||
+       snprintf(temp, sizeof(temp), "%s" SNAPSHOT_NEW_SUFFIX, snapshot) >= (int)sizeof(temp))
+    {
+        return 0;
+    }
+
+    /* put together in a temp directory, so that a snapshot is whole or missing */
+    if(!trash_move(trash_dir, temp)) {
+        return 0;
+    }
+    strlcpy(path, temp, sizeof(path)); /* mkpath() writes to its argument */
+    if(0 != mkpath(path) && EEXIST != errno) {
+        return 0;
+    }
+
+    #define SNAPSHOT_COPY(source, file) \
+        if(snprintf(path, sizeof(path), "%s/%s", temp, (file)) >= (int)sizeof(path) || \
+           0 != cp((source), path, 0644)) { \
+            return 0; \
+        }
+    SNAPSHOT_COPY(host_file, SNAPSHOT_HOST_FILE);
+    SNAPSHOT_COPY(hostclass_file, SNAPSHOT_HOSTCLASS_FILE);
+    SNAPSHOT_COPY(state_file, SNAPSHOT_STATE_FILE);
+    #undef SNAPSHOT_COPY
+
+    if(!trash_move(trash_dir, snapshot) || 0 != rename(temp, snapshot)) {
+        return 0;
+    }
+    return 1;
+}
+
+/* set the snapshot of tree aside for removal */
+int snapshot_remove(const char *snapshot_dir, const char *tree, const char *trash_dir) {
+    char snapshot[PATH_MAX];
+
+    if(!snapshot_path(snapshot, sizeof(snapshot), snapshot_dir, tree, NULL)) {
+        return 0;
+    }
+    return trash_move(trash_dir, snapshot);
+}
+
+/*
+ * Add the packages installed in all the trees with snapshots to
+ * packages. Returns 0 if out of memory; then not all are there.
+ */
+int snapshot_packages(package_list_t *packages, const char *snapshot_dir) {
+    DIR *dp;
+    struct dirent *entry;
+    roll_state_t state;
+    const package_spec_t *package;
+    char path[PATH_MAX];
+    int ok = 1;
+
+    if(!(dp = opendir(snapshot_dir))) {
+        return 1;
+    }
+    while(NULL != (entry = readdir(dp))) {
+        if(entry->d_name[0] == '.' ||
+           !snapshot_path(path, sizeof(path), snapshot_dir, entry->d_name, SNAPSHOT_STATE_FILE))
+        {
+            continue;
+        }
+        memset(&state, 0, sizeof(roll_state_t));
+        if(read_roll_state(&state, path)) {
+            for(package = state.installed.packages;
+                ok && package < state.installed.packages + state.installed.count;
+                package++)
+            {
+                ok = NULL != add_package_spec(packages, package->group, package->package_name);
+            }
+        }
+        free_roll_state(&state);
+    }
+    closedir(dp);
+    return ok;
+}
+
+/* remove the snapshots of trees that are gone */
+void snapshot_prune(const char *snapshot_dir, const char *package_target_dir,
+                    const char *trash_dir)
+{
+    DIR *dp;
+    struct dirent *entry;
+    struct stat st;
+    char path[PATH_MAX];
+
+    if(!(dp = opendir(snapshot_dir))) {
+        return;
+    }
+    while(NULL != (entry = readdir(dp))) {
+        if(entry->d_name[0] == '.') {
+            continue;
+        }
+        if(snprintf(path, sizeof(path), "%s/%s", package_target_dir, entry->d_name) < (int)sizeof(path) &&
+           0 == lstat(path, &st))
+        {
+            continue;
+        }
+        if(snprintf(path, sizeof(path), "%s/%s", snapshot_dir, entry->d_name) < (int)sizeof(path)) {
+            trash_move(trash_dir, path); /* ignore error */
+        }
+    }
+    closedir(dp);
+}
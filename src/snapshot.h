@@ -0,0 +1,65 @@
+/* snapshot.h - Keep the configuration each symlink tree was built from.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include "config_parse.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the files kept for each tree, in <snapshot_dir>/<tree name>/ */
+#define SNAPSHOT_HOST_FILE "host.yml"
+#define SNAPSHOT_HOSTCLASS_FILE "hostclass.yml"
+#define SNAPSHOT_STATE_FILE "state"
+
+int snapshot_path(char *path, size_t size, const char *snapshot_dir,
+                  const char *tree, const char *file);
+int snapshot_exists(const char *snapshot_dir, const char *tree);
+int snapshot_save(const char *snapshot_dir, const char *tree,
+                  const char *host_file, const char *hostclass_file,
+                  const char *state_file, const char *trash_dir);
+int snapshot_remove(const char *snapshot_dir, const char *tree,
+                    const char *trash_dir);
+int snapshot_packages(package_list_t *packages, const char *snapshot_dir);
+void snapshot_prune(const char *snapshot_dir, const char *package_target_dir,
+                    const char *trash_dir);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef SNAPSHOT_H */
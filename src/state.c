@@ -0,0 +1,227 @@
+/* state.c - Records what the last successful roll installed.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+    #include <unistd.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+    #include <sys/stat.h>
+#endif
+#include "state.h"
+#include "log.h"
+#if !defined(HAVE_STRLCPY) && !HAVE_DECL_STRLCPY
+    #include "strlcpy.h"
+#endif
+
+#define STATE_FORMAT_VERSION 1
+
+static void hash_field(sha256_t *ctx, const char *s) {
+    sha256_update(ctx, s, strlen(s) + 1);  /* keep the terminator as a separator */
+}
+
+/*
+ * Hash everything that decides what a roll installs. Two rolls with the
+ * same hashes, by the same version of roll, would produce the same tree.
+ * The config files are hashed by the caller, with sha256_hex().
+ */
+void hash_roll_inputs(roll_state_t *state, const char *host_hash, const char *hostclass_hash,
+                      const package_list_t *packages, const char *settings)
+{
+    const package_spec_t *package;
+    sha256_t ctx;
+
+    memset(state, 0, sizeof(roll_state_t));
+    strlcpy(state->roll_version, ROLL_VERSION, sizeof(state->roll_version));
+
+    strlcpy(state->host, host_hash, sizeof(state->host));
+    strlcpy(state->hostclass, hostclass_hash, sizeof(state->hostclass));
+
+    sha256_init(&ctx);
+    for(package = packages->packages; package < packages->packages + packages->count; package++) {
+        hash_field(&ctx, package->group);
+        hash_field(&ctx, package->package_name);
+    }
+    sha256_final_hex(&ctx, state->packages);
+
+    sha256_init(&ctx);
+    hash_field(&ctx, settings);
+    sha256_final_hex(&ctx, state->settings);
+}
+
+/* remember the packages of the given groups as the ones in the tree */
+int set_installed_packages(roll_state_t *state, const package_list_t *packages, const char *groups[]) {
+    const package_spec_t *package;
+    unsigned long group_mask = package_groups_mask(groups);
+
+    for(package = packages->packages; package < packages->packages + packages->count; package++) {
+        if(package_in_groups(package, groups, group_mask) &&
+           !add_package_spec(&state->installed, package->group, package->package_name))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int same_roll_inputs(const roll_state_t *a, const roll_state_t *b) {
+    return !strcmp(a->roll_version, b->roll_version) &&
+           !strcmp(a->host, b->host) &&
+           !strcmp(a->hostclass, b->hostclass) &&
+           !strcmp(a->packages, b->packages) &&
+           !strcmp(a->settings, b->settings);
+}
+
+/* is what the state describes still in place? */
+int roll_state_intact(const roll_state_t *state, const char *target_link, const char *package_stow_dir) {
+    const package_spec_t *package;
+    struct stat st;
+    char path[PATH_MAX];
+    ssize_t n;
+
+    n = readlink(target_link, path, sizeof(path) - 1);
+    if(n < 0) {
+        return 0;
+    }
+    path[n] = '\0';
+    if(!state->tree[0] || strcmp(path, state->tree) ||
+       0 != stat(state->tree, &st) || !S_ISDIR(st.st_mode))
+    {
+        return 0;
+    }
+    for(package = state->installed.packages;
+        package < state->installed.packages + state->installed.count;
+        package++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", package_stow_dir, package->package_name);
+        if(0 != stat(path, &st) || !S_ISDIR(st.st_mode)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* value of "key value" in line, or NULL */
+static char *state_value(char *line, const char *key) {
+    size_t n = strlen(key);
+
+    if(strncmp(line, key, n) || line[n] != ' ') {
+        return NULL;
+    }
+    line[strcspn(line, "\n")] = '\0';
+    return line + n + 1;
+}
+
+/* returns 0 if there is no usable state file, which is not an error */
+int read_roll_state(roll_state_t *state, const char *path) {
+    FILE *fp;
+    char line[PATH_MAX + 64], *value, *name;
+    int version = 0;
+
+    memset(state, 0, sizeof(roll_state_t));
+    if( !(fp = fopen(path, "r")) ) {
+        return 0;
+    }
+    while(fgets(line, sizeof(line), fp)) {
+        if( (value = state_value(line, "version")) ) {
+            version = atoi(value);
+        } else if( (value = state_value(line, "roll")) ) {
+            strlcpy(state->roll_version, value, sizeof(state->roll_version));
+        } else if( (value = state_value(line, "host")) ) {
+            strlcpy(state->host, value, sizeof(state->host));
+        } else if( (value = state_value(line, "hostclass")) ) {
+            strlcpy(state->hostclass, value, sizeof(state->hostclass));
+        } else if( (value = state_value(line, "packages")) ) {
+            strlcpy(state->packages, value, sizeof(state->packages));
+        } else if( (value = state_value(line, "settings")) ) {
+            strlcpy(state->settings, value, sizeof(state->settings));
+        } else if( (value = state_value(line, "tree")) ) {
+            strlcpy(state->tree, value, sizeof(state->tree));
+        } else if( (value = state_value(line, "package")) && (name = strchr(value, ' ')) ) {
+            *name++ = '\0';
+            if(!add_package_spec(&state->installed, value, name)) {
+                version = 0;    /* a partial list would not describe the tree */
+                break;
+            }
+        }
+    }
+    fclose(fp);
+    if(version != STATE_FORMAT_VERSION) {
+        free_roll_state(state);
+        return 0;
+    }
+    return 1;
+}
+
+/* replace the state file in one step, so that a crash never leaves half of it */
+int write_roll_state(const roll_state_t *state, const char *path) {
+    FILE *fp;
+    const package_spec_t *package;
+    char temp_path[PATH_MAX];
+    int ok;
+
+    snprintf(temp_path, sizeof(temp_path), "%s.new", path);
+    if( !(fp = fopen(temp_path, "w")) ) {
+        log_error("Cannot open %s for writing: %s", temp_path, strerror(errno));
+        return 0;
+    }
+    fprintf(fp, "version %d\n", STATE_FORMAT_VERSION);
+    fprintf(fp, "roll %s\n", state->roll_version);
+    fprintf(fp, "host %s\n", state->host);
+    fprintf(fp, "hostclass %s\n", state->hostclass);
+    fprintf(fp, "packages %s\n", state->packages);
+    fprintf(fp, "settings %s\n", state->settings);
+    fprintf(fp, "tree %s\n", state->tree);
+    for(package = state->installed.packages;
+        package < state->installed.packages + state->installed.count;
+        package++)
+    {
+        fprintf(fp, "package %s %s\n", package->group, package->package_name);
+    }
+    ok = 0 == fflush(fp) && 0 == fsync(fileno(fp));
+    ok = (0 == fclose(fp)) && ok;
+    if(!ok || 0 != rename(temp_path, path)) {
+        log_error("Cannot write %s: %s", path, strerror(errno));
+        unlink(temp_path);
+        return 0;
+    }
+    return 1;
+}
+
+void free_roll_state(roll_state_t *state) {
+    free_package_list(&state->installed);
+}
@@ -0,0 +1,71 @@
+/* state.h - Records what the last successful roll installed.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef STATE_H
+#define STATE_H
+
+#include <limits.h>
+#include "config_parse.h"
+#include "sha256.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAX_ROLL_VERSION_SIZE 64
+
+/* written to <packagedir>/state after each successful roll */
+typedef struct roll_state_s {
+    char roll_version[MAX_ROLL_VERSION_SIZE];
+    char host[SHA256_HEX_SIZE];         /* hash of the host file */
+    char hostclass[SHA256_HEX_SIZE];    /* hash of the hostclass file */
+    char packages[SHA256_HEX_SIZE];     /* hash of the merged package list */
+    char settings[SHA256_HEX_SIZE];     /* hash of options that change the result */
+    char tree[PATH_MAX];                /* symlink tree that was installed */
+    package_list_t installed;           /* packages linked into it */
+} roll_state_t;
+
+void hash_roll_inputs(roll_state_t *state, const char *host_hash, const char *hostclass_hash,
+                      const package_list_t *packages, const char *settings);
+int set_installed_packages(roll_state_t *state, const package_list_t *packages, const char *groups[]);
+int same_roll_inputs(const roll_state_t *a, const roll_state_t *b);
+int roll_state_intact(const roll_state_t *state, const char *target_link, const char *package_stow_dir);
+int read_roll_state(roll_state_t *state, const char *path);
+int write_roll_state(const roll_state_t *state, const char *path);
+void free_roll_state(roll_state_t *state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef STATE_H */
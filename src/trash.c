@@ -0,0 +1,256 @@
+/* trash.c - Set directories aside to be removed in the background.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Removing a tree can take minutes, and most of the trees roll removes
+ * are removed while services are down or in the middle of a roll.
+ * Instead they are renamed into a trash directory on the same file
+ * system, which is instant, and a detached process at low priority
+ * empties it once the roll is done with. Anything a crashed roll or
+ * collector left in the trash is picked up by the next collector.
+ */
+
+#define _GNU_SOURCE  /* syscall() */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#ifdef HAVE_SYS_TYPES_H
+    #include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+    #include <sys/stat.h>
+#endif
+#ifdef HAVE_SYS_WAIT_H
+    #include <sys/wait.h>
+#endif
+#ifdef HAVE_UNISTD_H
+    #include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+    #include <fcntl.h>
+#endif
+#ifdef HAVE_LIMITS_H
+    #include <limits.h>
+#endif
+#if defined(__linux__)
+    #include <sys/syscall.h>
+#endif
+#include "trash.h"
+#include "rmrf.h"
+#include "mkpath.h"
+#if !defined(HAVE_STRLCPY) && !HAVE_DECL_STRLCPY
+    #include "strlcpy.h"
+#endif
+
+/* held by the collector emptying the trash, so that only one runs */
+#define TRASH_LOCK_NAME ".lock"
+#define TRASH_NICE 19
+#define MAX_TRASH_ATTEMPTS 100
+#define MAX_CLOSE_FD 65536
+
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    #define IOPRIO_WHO_PROCESS 1
+    #define IOPRIO_CLASS_IDLE 3
+    #define IOPRIO_CLASS_SHIFT 13
+#endif
+
+static unsigned int sequence = 0;
+
+static int is_trash_entry(const char *name) {
+    return 0 != strcmp(name, ".") &&
+           0 != strcmp(name, "..") &&
+           0 != strcmp(name, TRASH_LOCK_NAME);
+}
+
+/*
+ * Move path into the trash. If it cannot be renamed there, most likely
+ * because it is on another file system, it is removed on the spot.
+ * A path that does not exist counts as moved.
+ */
+int trash_move(const char *trash_dir, const char *path) {
+    struct stat st;
+    char dest[PATH_MAX];
+    const char *name;
+    int attempt;
+
+    if(0 != lstat(path, &st)) {
+        return ENOENT == errno;
+    }
+
+    /* mkpath() writes to its argument */
+    strlcpy(dest, trash_dir, sizeof(dest));
+    if(0 != mkpath(dest) && EEXIST != errno) {
+        return rmrf(path);
+    }
+
+    name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    for(attempt = 0; attempt < MAX_TRASH_ATTEMPTS; attempt++) {
+        if(snprintf(dest, PATH_MAX, "%s/%s.%ld.%u", trash_dir, name,
+                    (long)getpid(), sequence++) >= PATH_MAX)
+        {
+            break;
+        }
+        if(0 == rename(path, dest)) {
+            return 1;
+        }
+        /* left behind by an earlier roll with the same pid */
+        if(EEXIST != errno && ENOTEMPTY != errno) {
+            break;
+        }
+    }
+    return rmrf(path);
+}
+
+/* return 1 if there is nothing in the trash (or no trash at all) */
+int trash_is_empty(const char *trash_dir) {
+    DIR *dp;
+    struct dirent *entry;
+    int empty = 1;
+
+    if(!(dp = opendir(trash_dir))) {
+        return 1;
+    }
+    while(empty && NULL != (entry = readdir(dp))) {
+        if(is_trash_entry(entry->d_name)) {
+            empty = 0;
+        }
+    }
+    closedir(dp);
+    return empty;
+}
+
+/* remove everything in the trash; return the number of entries removed */
+static int empty_trash(const char *trash_dir) {
+    DIR *dp;
+    struct dirent *entry;
+    char path[PATH_MAX];
+    int removed = 0;
+
+    if(!(dp = opendir(trash_dir))) {
+        return 0;
+    }
+    while(NULL != (entry = readdir(dp))) {
+        if(!is_trash_entry(entry->d_name)) {
+            continue;
+        }
+        if(snprintf(path, PATH_MAX, "%s/%s", trash_dir, entry->d_name) >= PATH_MAX) {
+            continue;
+        }
+        /* one thread; this is meant to go unnoticed, not to be quick */
+        if(rmrf_parallel(path, 1, NULL)) {
+            removed++;
+        }
+    }
+    closedir(dp);
+    return removed;
+}
+
+/* the detached collector; never returns */
+static void collect(const char *trash_dir) {
+    char lock_file[PATH_MAX];
+    long fd, max_fd;
+
+    if(0 != chdir("/")) {
+        _exit(1);
+    }
+
+    /* let go of the log, the pid file and the terminal */
+    max_fd = sysconf(_SC_OPEN_MAX);
+    if(max_fd < 0 || max_fd > MAX_CLOSE_FD) {
+        max_fd = MAX_CLOSE_FD;
+    }
+    for(fd = 0; fd < max_fd; fd++) {
+        close((int)fd);
+    }
+    if(0 == open("/dev/null", O_RDWR)) {
+        dup2(0, 1);
+        dup2(0, 2);
+    }
+
+    /* stay out of the way of the services that were just started */
+    if(-1 == nice(TRASH_NICE)) {
+        /* ignore error */
+    }
+#if defined(IOPRIO_CLASS_IDLE)
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#endif
+
+    /* wait for any collector that is already running, then take over;
+       things may be trashed while it runs, so go until a pass finds nothing */
+    if(snprintf(lock_file, PATH_MAX, "%s/%s", trash_dir, TRASH_LOCK_NAME) >= PATH_MAX) {
+        _exit(1);
+    }
+    if( (fd = open(lock_file, O_RDWR | O_CREAT, 0600)) < 0 ||
+        lockf((int)fd, F_LOCK, 0) < 0 )
+    {
+        _exit(1);
+    }
+    while(!trash_is_empty(trash_dir) && empty_trash(trash_dir) > 0) ;
+    _exit(0);
+}
+
+/*
+ * Start a detached, low priority process that empties the trash.
+ * Return 1 if one was started or there was nothing to do.
+ */
+int trash_collect(const char *trash_dir) {
+    pid_t pid;
+    int status;
+
+    if(trash_is_empty(trash_dir)) {
+        return 1;
+    }
+
+    pid = fork();
+    if(pid == -1) {
+        return 0;
+    } else if(pid == 0) {
+        /* fork again, so that the collector is not our child and
+           is not in our session; roll does not wait for it */
+        setsid();
+        pid = fork();
+        if(pid == 0) {
+            collect(trash_dir);
+        }
+        _exit(pid == -1 ? 1 : 0);
+    }
+
+    if(waitpid(pid, &status, 0) != pid) {
+        return 0;
+    }
+    return WIFEXITED(status) && 0 == WEXITSTATUS(status);
+}
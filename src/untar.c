@@ -0,0 +1,781 @@
+/* untar.c - Extract gzipped tar archives in process.
+ *
+ * Copyright (c) 2013, Groupon, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of GROUPON nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This is a small streaming reader for the subset of tar that Roller
+ * packages use: ustar and GNU headers, GNU long names and pax path,
+ * linkpath and size records. Data is pushed in with untar_write() as it
+ * arrives, so a package can be unpacked straight off the network.
+ *
+ * Everything is created relative to a directory file descriptor and no
+ * path is ever resolved through a symlink, so extraction does not depend
+ * on the current directory. Like "tar xzf -p -o", permissions are kept
+ * and ownership is left to whoever runs roll.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef HAVE_SYS_TYPES_H
+    #include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+    #include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+    #include <unistd.h>
+#endif
+#ifdef HAVE_STRING_H
+    #include <string.h>
+#endif
+#ifdef HAVE_FCNTL_H
+    #include <fcntl.h>
+#endif
+#ifdef HAVE_LIMITS_H
+    #include <limits.h>
+#endif
+#include <errno.h>
+#include <time.h>
+#include <zlib.h>
+#include "untar.h"
+#include "log.h"
+
+#define TAR_BLOCK_SIZE 512
+#define INFLATE_BUFFER_SIZE 65536
+#define MAX_META_SIZE (1024 * 1024)
+
+/* gzip or zlib header autodetection, see inflateInit2() */
+#define INFLATE_WINDOW_BITS (15 + 32)
+
+typedef enum {
+    STATE_HEADER,
+    STATE_DATA,
+    STATE_PADDING,
+    STATE_END
+} untar_state_t;
+
+/* directory modes and times are applied last, so that read-only
+   directories can still be filled in */
+typedef struct untar_dir_s {
+    char *path;
+    mode_t mode;
+    time_t mtime;
+} untar_dir_t;
+
+struct untar_s {
+    char dest_dir[PATH_MAX];
+    char label[PATH_MAX];       /* archive name, for error messages */
+    int root_fd;
+    int failed;
+
+    z_stream zs;
+    int zs_initialized;
+    int zs_stream_end;
+
+    untar_state_t state;
+    unsigned char block[TAR_BLOCK_SIZE];
+    size_t block_length;
+
+    /* entry currently being read */
+    char type;
+    char *path;
+    mode_t mode;
+    time_t mtime;
+    unsigned long long remaining;
+    size_t padding;
+    int fd;
+
+    /* contents of GNU long name and pax header entries */
+    char *meta;
+    size_t meta_length;
+    char *long_name, *long_link;
+    char *pax_path, *pax_link;
+    int has_pax_size;
+    unsigned long long pax_size;
+
+    /* parent directory of the last entry created */
+    char parent_path[PATH_MAX];
+    int parent_fd;
+
+    untar_dir_t *dirs;
+    size_t ndirs, dirs_size;
+
+    unsigned char out[INFLATE_BUFFER_SIZE];
+};
+
+static void fail(untar_t *untar, const char *format, const char *path) {
+    log_error(format, path, strerror(errno));
+    untar->failed = 1;
+}
+
+/* numeric header fields are octal, or base-256 when the high bit is set */
+static unsigned long long parse_number(const unsigned char *field, size_t size) {
+    unsigned long long value = 0;
+    size_t i = 0;
+
+    if(field[0] & 0x80) {
+        value = field[0] & 0x7f;
+        for(i = 1; i < size; i++) {
+            value = (value << 8) | field[i];
+        }
+        return value;
+    }
+
+    while(i < size && (field[i] == ' ' || field[i] == '\0')) i++;
+    for(; i < size && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = (value << 3) | (field[i] - '0');
+    }
+    return value;
+}
+
+static int checksum_ok(const unsigned char *block) {
+    unsigned long expected, sum = 0;
+    long signed_sum = 0;
+    int i;
+
+    expected = (unsigned long)parse_number(block + 148, 8);
+    for(i = 0; i < TAR_BLOCK_SIZE; i++) {
+        if(i >= 148 && i < 156) {
+            sum += ' ';
+            signed_sum += ' ';
+        } else {
+            sum += block[i];
+            signed_sum += (signed char)block[i];
+        }
+    }
+    return expected == sum || (long)expected == signed_sum;
+}
+
+static char *copy_field(const unsigned char *field, size_t size) {
+    char *s;
+    size_t n;
+
+    for(n = 0; n < size && field[n]; n++) ;
+    if( !(s = (char *)malloc(n + 1)) ) return NULL;
+    memcpy(s, field, n);
+    s[n] = '\0';
+    return s;
+}
+
+/* strip leading slashes and "./", refuse anything that climbs out with ".." */
+static char *sanitize_path(char *path) {
+    char *p, *component;
+    size_t length;
+
+    for(;;) {
+        if(path[0] == '/') {
+            path++;
+        } else if(path[0] == '.' && (path[1] == '/' || path[1] == '\0')) {
+            path += path[1] ? 2 : 1;
+        } else {
+            break;
+        }
+    }
+    length = strlen(path);
+    while(length > 0 && path[length - 1] == '/') {
+        path[--length] = '\0';
+    }
+
+    for(component = path; component && *component; ) {
+        p = strchr(component, '/');
+        if((p ? p - component : strlen(component)) == 2 && !strncmp(component, "..", 2)) {
+            return NULL;
+        }
+        component = p ? p + 1 : NULL;
+    }
+    return path;
+}
+
+static void clear_entry(untar_t *untar) {
+    if(untar->fd >= 0)
+        close(untar->fd);
+    untar->fd = -1;
+    free(untar->path);
+    free(untar->long_name);
+    free(untar->long_link);
+    free(untar->pax_path);
+    free(untar->pax_link);
+    untar->path = untar->long_name = untar->long_link = NULL;
+    untar->pax_path = untar->pax_link = NULL;
+    untar->has_pax_size = 0;
+}
+
+/*
+ * Open the directory that will contain path, creating missing
+ * directories along the way, and point *leaf at the last component.
+ * Symlinks are never followed.
+ */
+static int open_parent(untar_t *untar, char *path, char **leaf) {
+    char *slash, *component, *next;
+    int fd, next_fd;
+
+    if( !(slash = strrchr(path, '/')) ) {
+        *leaf = path;
+        return untar->root_fd;
+    }
+    *leaf = slash + 1;
+
+    *slash = '\0';
+    if(untar->parent_fd >= 0 && !strcmp(untar->parent_path, path)) {
+        *slash = '/';
+        return untar->parent_fd;
+    }
+    if(untar->parent_fd >= 0)
+        close(untar->parent_fd);
+    untar->parent_fd = -1;
+
+    fd = untar->root_fd;
+    for(component = path; component; component = next) {
+        if( (next = strchr(component, '/')) ) *next++ = '\0';
+        if(*component) {
+            next_fd = openat(fd, component, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+            if(next_fd < 0 && ENOENT == errno) {
+                if(0 != mkdirat(fd, component, 0755) && EEXIST != errno) {
+                    fail(untar, "  Cannot create directory %s: %s", component);
+                } else {
+                    next_fd = openat(fd, component, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+                }
+            }
+            if(next_fd < 0 && !untar->failed) {
+                fail(untar, "  Cannot open directory %s: %s", component);
+            }
+            if(fd != untar->root_fd)
+                close(fd);
+            if(next_fd < 0) {
+                if(next) next[-1] = '/';
+                *slash = '/';
+                return -1;
+            }
+            fd = next_fd;
+        }
+        if(next) next[-1] = '/';
+    }
+
+    strncpy(untar->parent_path, path, PATH_MAX - 1);
+    untar->parent_path[PATH_MAX - 1] = '\0';
+    *slash = '/';
+    if(fd != untar->root_fd)
+        untar->parent_fd = fd;
+    return fd;
+}
+
+static int remember_dir(untar_t *untar, const char *path) {
+    untar_dir_t *dirs;
+
+    if(untar->ndirs == untar->dirs_size) {
+        untar->dirs_size = untar->dirs_size ? untar->dirs_size * 2 : 64;
+        dirs = (untar_dir_t *)realloc(untar->dirs, untar->dirs_size * sizeof(untar_dir_t));
+        if(!dirs) {
+            log_error("Fatal error: out of memory.");
+            return 0;
+        }
+        untar->dirs = dirs;
+    }
+    if( !(untar->dirs[untar->ndirs].path = strdup(path)) ) {
+        log_error("Fatal error: out of memory.");
+        return 0;
+    }
+    untar->dirs[untar->ndirs].mode = untar->mode;
+    untar->dirs[untar->ndirs].mtime = untar->mtime;
+    untar->ndirs++;
+    return 1;
+}
+
+/* create whatever the header in untar->block describes */
+static int start_entry(untar_t *untar) {
+    const unsigned char *block = untar->block;
+    char *path, *leaf, *link = NULL;
+    struct timespec times[2];
+    struct stat st;
+    int parent_fd;
+    int ok = 0;
+
+    /* file name, preferring long names over the ustar prefix/name pair */
+    if(untar->long_name) {
+        untar->path = untar->long_name;
+        untar->long_name = NULL;
+    } else if(untar->pax_path) {
+        untar->path = untar->pax_path;
+        untar->pax_path = NULL;
+    } else {
+        char name[256 + 1];
+        size_t n = 0;
+        if(!memcmp(block + 257, "ustar", 5) && block[345]) {
+            for(; n < 155 && block[345 + n]; n++) name[n] = block[345 + n];
+            name[n++] = '/';
+        }
+        memcpy(name + n, block, 100);
+        name[n + 100] = '\0';
+        untar->path = strdup(name);
+    }
+    if(untar->long_link) {
+        link = untar->long_link;
+    } else if(untar->pax_link) {
+        link = untar->pax_link;
+    } else {
+        link = copy_field(block + 157, 100);
+        untar->long_link = link;
+    }
+    if(!untar->path || !link) {
+        log_error("Fatal error: out of memory.");
+        return 0;
+    }
+
+    if( !(path = sanitize_path(untar->path)) ) {
+        log_error("  Refusing to extract %s outside of %s", untar->path, untar->dest_dir);
+        return 0;
+    }
+    if(!*path) {
+        return 1;  /* the archive root itself */
+    }
+    if( (parent_fd = open_parent(untar, path, &leaf)) < 0 ) {
+        return 0;
+    }
+
+    times[0].tv_sec = times[1].tv_sec = untar->mtime;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+
+    switch(untar->type) {
+        case '0':
+        case '\0':
+        case '7':
+            if(0 != unlinkat(parent_fd, leaf, 0) && ENOENT != errno) {
+                fail(untar, "  Cannot replace %s: %s", path);
+                break;
+            }
+            untar->fd = openat(parent_fd, leaf, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0600);
+            if(untar->fd < 0) {
+                fail(untar, "  Cannot create %s: %s", path);
+                break;
+            }
+            ok = 1;
+            break;
+        case '5':
+            if(0 != mkdirat(parent_fd, leaf, 0700)) {
+                if(EEXIST != errno ||
+                   0 != fstatat(parent_fd, leaf, &st, AT_SYMLINK_NOFOLLOW) ||
+                   !S_ISDIR(st.st_mode))
+                {
+                    fail(untar, "  Cannot create directory %s: %s", path);
+                    break;
+                }
+            }
+            ok = remember_dir(untar, path);
+            break;
+        case '2':
+            if(0 != unlinkat(parent_fd, leaf, 0) && ENOENT != errno) {
+                fail(untar, "  Cannot replace %s: %s", path);
+                break;
+            }
+            if(0 != symlinkat(link, parent_fd, leaf)) {
+                fail(untar, "  Cannot create symlink %s: %s", path);
+                break;
+            }
+            utimensat(parent_fd, leaf, times, AT_SYMLINK_NOFOLLOW); /* ignore error */
+            ok = 1;
+            break;
+        case '1':
+            if( !(link = sanitize_path(link)) ) {
+                log_error("  Refusing to link %s outside of %s", path, untar->dest_dir);
+                break;
+            }
+            if(0 != unlinkat(parent_fd, leaf, 0) && ENOENT != errno) {
+                fail(untar, "  Cannot replace %s: %s", path);
+                break;
+            }
+            if(0 != linkat(untar->root_fd, link, parent_fd, leaf, 0)) {
+                fail(untar, "  Cannot create hard link %s: %s", path);
+                break;
+            }
+            ok = 1;
+            break;
+        default:
+            log_info("  Skipping special file %s", path);
+            ok = 1;
+            break;
+    }
+    return ok;
+}
+
+/* collect the body of a long name or pax entry */
+static int save_meta(untar_t *untar, const unsigned char *data, size_t length) {
+    memcpy(untar->meta + untar->meta_length, data, length);
+    untar->meta_length += length;
+    return 1;
+}
+
+static void parse_pax(untar_t *untar) {
+    char *record = untar->meta, *end = untar->meta + untar->meta_length;
+    char *key, *value, *next;
+    unsigned long length;
+
+    while(record < end) {
+        length = strtoul(record, &key, 10);
+        if(length == 0 || record + length > end || *key != ' ') return;
+        next = record + length;
+        key++;
+        if( !(value = memchr(key, '=', next - key)) ) return;
+        *value++ = '\0';
+        next[-1] = '\0';  /* trailing newline */
+        if(!strcmp(key, "path")) {
+            free(untar->pax_path);
+            untar->pax_path = strdup(value);
+        } else if(!strcmp(key, "linkpath")) {
+            free(untar->pax_link);
+            untar->pax_link = strdup(value);
+        } else if(!strcmp(key, "size")) {
+            untar->pax_size = strtoull(value, NULL, 10);
+            untar->has_pax_size = 1;
+        }
+        record = next;
+    }
+}
+
+static int finish_entry(untar_t *untar) {
+    struct timespec times[2];
+    int ok = 1;
+
+    switch(untar->type) {
+        case 'L':
+            free(untar->long_name);
+            untar->meta[untar->meta_length] = '\0';
+            untar->long_name = strdup(untar->meta);
+            break;
+        case 'K':
+            free(untar->long_link);
+            untar->meta[untar->meta_length] = '\0';
+            untar->long_link = strdup(untar->meta);
+            break;
+        case 'x':
+            parse_pax(untar);
+            break;
+        case 'g':
+            break;
+        default:
+            if(untar->fd >= 0) {
+                times[0].tv_sec = times[1].tv_sec = untar->mtime;
+                times[0].tv_nsec = times[1].tv_nsec = 0;
+                if(0 != fchmod(untar->fd, untar->mode)) {
+                    fail(untar, "  Cannot set permissions on %s: %s", untar->path);
+                    ok = 0;
+                }
+                futimens(untar->fd, times); /* ignore error */
+                if(0 != close(untar->fd)) {
+                    fail(untar, "  Cannot write %s: %s", untar->path);
+                    ok = 0;
+                }
+                untar->fd = -1;
+            }
+            clear_entry(untar);
+            break;
+    }
+    free(untar->meta);
+    untar->meta = NULL;
+    untar->meta_length = 0;
+    return ok;
+}
+
+static int read_header(untar_t *untar) {
+    unsigned long long size;
+    int i;
+
+    for(i = 0; i < TAR_BLOCK_SIZE && !untar->block[i]; i++) ;
+    if(i == TAR_BLOCK_SIZE) {
+        untar->state = STATE_END;
+        return 1;
+    }
+    if(!checksum_ok(untar->block)) {
+        log_error("  Corrupt tar header in %s", untar->label);
+        return 0;
+    }
+
+    untar->type = untar->block[156];
+    untar->mode = (mode_t)parse_number(untar->block + 100, 8) & 07777;
+    untar->mtime = (time_t)parse_number(untar->block + 136, 12);
+    size = parse_number(untar->block + 124, 12);
+    if(untar->has_pax_size && untar->type != 'x' && untar->type != 'g') {
+        size = untar->pax_size;
+    }
+    /* links and directories have no data, whatever their size field says */
+    if(untar->type == '1' || untar->type == '2' || untar->type == '5') {
+        size = 0;
+    }
+
+    switch(untar->type) {
+        case 'L':
+        case 'K':
+        case 'x':
+            if(size > MAX_META_SIZE) {
+                log_error("  Oversized tar extended header in %s", untar->label);
+                return 0;
+            }
+            if( !(untar->meta = (char *)malloc(size + 1)) ) {
+                log_error("Fatal error: out of memory.");
+                return 0;
+            }
+            untar->meta_length = 0;
+            break;
+        case 'g':
+            break;
+        default:
+            if(!start_entry(untar)) {
+                return 0;
+            }
+            break;
+    }
+
+    untar->remaining = size;
+    untar->padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+    if(size > 0) {
+        untar->state = STATE_DATA;
+    } else {
+        untar->state = STATE_HEADER;
+        return finish_entry(untar);
+    }
+    return 1;
+}
+
+static int write_all(int fd, const unsigned char *data, size_t length) {
+    ssize_t n;
+
+    while(length > 0) {
+        n = write(fd, data, length);
+        if(n < 0) {
+            if(EINTR == errno) continue;
+            return 0;
+        }
+        data += n;
+        length -= n;
+    }
+    return 1;
+}
+
+/* feed decompressed bytes through the tar state machine */
+static int tar_consume(untar_t *untar, const unsigned char *data, size_t length) {
+    size_t n;
+
+    while(length > 0 && !untar->failed) {
+        switch(untar->state) {
+            case STATE_HEADER:
+                n = TAR_BLOCK_SIZE - untar->block_length;
+                if(n > length) n = length;
+                memcpy(untar->block + untar->block_length, data, n);
+                untar->block_length += n;
+                if(untar->block_length == TAR_BLOCK_SIZE) {
+                    untar->block_length = 0;
+                    if(!read_header(untar)) {
+                        untar->failed = 1;
+                    }
+                }
+                break;
+            case STATE_DATA:
+                n = length < untar->remaining ? length : (size_t)untar->remaining;
+                if(untar->meta) {
+                    save_meta(untar, data, n);
+                } else if(untar->fd >= 0 && !write_all(untar->fd, data, n)) {
+                    fail(untar, "  Cannot write %s: %s", untar->path);
+                }
+                untar->remaining -= n;
+                if(untar->remaining == 0) {
+                    untar->state = untar->padding ? STATE_PADDING : STATE_HEADER;
+                    if(!finish_entry(untar)) {
+                        untar->failed = 1;
+                    }
+                }
+                break;
+            case STATE_PADDING:
+                n = length < untar->padding ? length : untar->padding;
+                untar->padding -= n;
+                if(untar->padding == 0) {
+                    untar->state = STATE_HEADER;
+                }
+                break;
+            case STATE_END:
+            default:
+                n = length;  /* trailing zero blocks */
+                break;
+        }
+        data += n;
+        length -= n;
+    }
+    return !untar->failed;
+}
+
+untar_t *untar_open(const char *dest_dir, const char *label) {
+    untar_t *untar;
+
+    if( !(untar = (untar_t *)calloc(1, sizeof(untar_t))) ) {
+        log_error("Fatal error: out of memory.");
+        return NULL;
+    }
+    untar->fd = -1;
+    untar->parent_fd = -1;
+    strncpy(untar->dest_dir, dest_dir, PATH_MAX - 1);
+    strncpy(untar->label, label, PATH_MAX - 1);
+
+    untar->root_fd = open(dest_dir, O_RDONLY|O_DIRECTORY);
+    if(untar->root_fd < 0) {
+        log_error("  Cannot open directory %s: %s", dest_dir, strerror(errno));
+        free(untar);
+        return NULL;
+    }
+    if(Z_OK != inflateInit2(&untar->zs, INFLATE_WINDOW_BITS)) {
+        log_error("  Cannot initialize zlib.");
+        close(untar->root_fd);
+        free(untar);
+        return NULL;
+    }
+    untar->zs_initialized = 1;
+    untar->state = STATE_HEADER;
+    return untar;
+}
+
+int untar_write(untar_t *untar, const void *data, size_t length) {
+    int rc;
+
+    if(untar->failed) return 0;
+
+    untar->zs.next_in = (unsigned char *)data;
+    untar->zs.avail_in = length;
+    while(untar->zs.avail_in > 0) {
+        /* anything after the tar trailer is padding */
+        if(untar->zs_stream_end) {
+            if(untar->state == STATE_END) {
+                return 1;
+            }
+            inflateReset(&untar->zs);
+            untar->zs_stream_end = 0;
+        }
+        untar->zs.next_out = untar->out;
+        untar->zs.avail_out = INFLATE_BUFFER_SIZE;
+        rc = inflate(&untar->zs, Z_NO_FLUSH);
+        if(Z_OK != rc && Z_STREAM_END != rc && Z_BUF_ERROR != rc) {
+            log_error("  Corrupt gzip data in %s: %s", untar->label,
+                      untar->zs.msg ? untar->zs.msg : "inflate failed");
+            untar->failed = 1;
+            return 0;
+        }
+        if(!tar_consume(untar, untar->out, INFLATE_BUFFER_SIZE - untar->zs.avail_out)) {
+            return 0;
+        }
+        if(Z_STREAM_END == rc) {
+            untar->zs_stream_end = 1;
+        } else if(Z_BUF_ERROR == rc && untar->zs.avail_out != 0) {
+            break;
+        }
+    }
+    return 1;
+}
+
+static void untar_free(untar_t *untar) {
+    size_t i;
+
+    clear_entry(untar);
+    free(untar->meta);
+    for(i = 0; i < untar->ndirs; i++) {
+        free(untar->dirs[i].path);
+    }
+    free(untar->dirs);
+    if(untar->parent_fd >= 0)
+        close(untar->parent_fd);
+    if(untar->root_fd >= 0)
+        close(untar->root_fd);
+    if(untar->zs_initialized)
+        inflateEnd(&untar->zs);
+    free(untar);
+}
+
+/* check that the whole archive arrived, then set directory modes */
+int untar_finish(untar_t *untar) {
+    struct timespec times[2];
+    int ok = !untar->failed;
+    size_t i;
+
+    if(ok && (!untar->zs_stream_end ||
+              (untar->state != STATE_END &&
+               !(untar->state == STATE_HEADER && untar->block_length == 0))))
+    {
+        log_error("  Archive %s is truncated", untar->label);
+        ok = 0;
+    }
+
+    for(i = untar->ndirs; ok && i > 0; i--) {
+        untar_dir_t *dir = &untar->dirs[i - 1];
+        times[0].tv_sec = times[1].tv_sec = dir->mtime;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        if(0 != fchmodat(untar->root_fd, dir->path, dir->mode, 0)) {
+            log_error("  Cannot set permissions on %s: %s", dir->path, strerror(errno));
+            ok = 0;
+        }
+        utimensat(untar->root_fd, dir->path, times, 0); /* ignore error */
+    }
+
+    untar_free(untar);
+    return ok;
+}
+
+void untar_abort(untar_t *untar) {
+    untar_free(untar);
+}
+
+int untar_file(const char *archive, const char *dest_dir) {
+    untar_t *untar;
+    unsigned char buffer[INFLATE_BUFFER_SIZE];
+    ssize_t n;
+    int fd;
+
+    if( (fd = open(archive, O_RDONLY)) < 0 ) {
+        log_error("  Cannot open %s: %s", archive, strerror(errno));
+        return 0;
+    }
+    if( !(untar = untar_open(dest_dir, archive)) ) {
+        close(fd);
+        return 0;
+    }
+    while( (n = read(fd, buffer, sizeof(buffer))) != 0 ) {
+        if(n < 0) {
+            if(EINTR == errno) continue;
+            log_error("  Cannot read %s: %s", archive, strerror(errno));
+            break;
+        }
+        if(!untar_write(untar, buffer, n)) {
+            break;
+        }
+    }
+    close(fd);
+    if(n != 0) {
+        untar_abort(untar);
+        return 0;
+    }
+    return untar_finish(untar);
+}